@@ -27,6 +27,9 @@ bool intersectBox(const Pvl::Box3f& box, const Ray& ray, float& t_min, float& t_
     }
     tmin = std::max(tmin, tymin);
     tmax = std::min(tmax, tymax);
+    if (tmin > ray.t_max || tmax < ray.t_min) {
+        return false;
+    }
 
     const float tzmin = (b[ray.signs[2]][2] - ray.orig[2]) * ray.invDir[2];
     const float tzmax = (b[1 - ray.signs[2]][2] - ray.orig[2]) * ray.invDir[2];
@@ -38,6 +41,13 @@ bool intersectBox(const Pvl::Box3f& box, const Ray& ray, float& t_min, float& t_
     tmin = std::max(tmin, tzmin);
     tmax = std::min(tmax, tzmax);
 
+    // clip to the segment
+    tmin = std::max(tmin, ray.t_min);
+    tmax = std::min(tmax, ray.t_max);
+    if (tmin > tmax) {
+        return false;
+    }
+
     t_min = tmin;
     t_max = tmax;
 
@@ -51,39 +61,42 @@ void Bvh<TBvhObject>::getIntersections(const Ray& ray, const TAddIntersection& a
     uint32_t closer;
     uint32_t other;
 
+    // copy of the ray, the segment can be shortened by addIntersection
+    Ray segment = ray;
+
     std::array<BvhTraversal, 64> stack;
     int stackIdx = 0;
 
     stack[stackIdx].idx = 0;
-    stack[stackIdx].t_min = 0.f; // -INFTY;
+    stack[stackIdx].t_min = ray.tMin();
 
     while (stackIdx >= 0) {
         const uint32_t idx = stack[stackIdx].idx;
-        // const float t_min = stack[stackIdx].t_min;
+        const float t_min = stack[stackIdx].t_min;
         stackIdx--;
         const BvhNode& node = nodes[idx];
 
-        /// \todo optimization for the single intersection case
-        /*        if (t_min > intersection.t) {
-                    continue;
-                }*/
+        if (t_min > segment.tMax()) {
+            // the node is behind an already found intersection
+            continue;
+        }
         if (node.rightOffset == 0) {
             // leaf
             for (uint32_t primIdx = 0; primIdx < node.primCnt; ++primIdx) {
                 IntersectionInfo current;
 
                 const TBvhObject& obj = objects[node.start + primIdx];
-                const bool hit = obj.getIntersection(ray, current);
+                const bool hit = obj.getIntersection(segment, current);
 
-                if (hit && !addIntersection(current)) {
+                if (hit && !addIntersection(current, segment)) {
                     // bailout
                     return;
                 }
             }
         } else {
             // inner node
-            const bool hitc0 = intersectBox(nodes[idx + 1].box, ray, boxHits[0], boxHits[1]);
-            const bool hitc1 = intersectBox(nodes[idx + node.rightOffset].box, ray, boxHits[2], boxHits[3]);
+            const bool hitc0 = intersectBox(nodes[idx + 1].box, segment, boxHits[0], boxHits[1]);
+            const bool hitc1 = intersectBox(nodes[idx + node.rightOffset].box, segment, boxHits[2], boxHits[3]);
 
             if (hitc0 && hitc1) {
                 closer = idx + 1;
@@ -115,9 +128,10 @@ bool Bvh<TBvhObject>::getFirstIntersection(const Ray& ray, IntersectionInfo& int
     intersection.t = std::numeric_limits<float>::max();
     intersection.object = nullptr;
 
-    this->getIntersections(ray, [&intersection](IntersectionInfo& current) {
-        if (current.t > 0 && current.t < intersection.t) {
+    this->getIntersections(ray, [&intersection](IntersectionInfo& current, Ray& segment) {
+        if (current.t < intersection.t) {
             intersection = current;
+            segment.setTMax(current.t);
         }
         return true;
     });
@@ -127,7 +141,7 @@ bool Bvh<TBvhObject>::getFirstIntersection(const Ray& ray, IntersectionInfo& int
 template <typename TBvhObject>
 bool Bvh<TBvhObject>::isOccluded(const Ray& ray) const {
     bool occluded = false;
-    getIntersections(ray, [&occluded](IntersectionInfo&) {
+    getIntersections(ray, [&occluded](IntersectionInfo&, Ray&) {
         occluded = true;
         return false; // do not continue with traversal
     });
@@ -6,6 +6,7 @@
 
 namespace Mpcv {
 
+/// \brief Ray segment, only intersections with t in interval (tMin, tMax) are reported.
 class Ray {
     friend bool intersectBox(const Pvl::Box3f& box, const Ray& ray, float& t_min, float& t_max);
 
@@ -14,13 +15,17 @@ private:
     Pvl::Vec3f dir;
     Pvl::Vec3f invDir;
     std::array<int, 3> signs;
+    float t_min = 0.f;
+    float t_max = INFINITY;
 
 public:
     Ray() = default;
 
-    Ray(const Pvl::Vec3f& origin, const Pvl::Vec3f& dir)
+    Ray(const Pvl::Vec3f& origin, const Pvl::Vec3f& dir, const float tMin = 0.f, const float tMax = INFINITY)
         : orig(origin)
-        , dir(dir) {
+        , dir(dir)
+        , t_min(tMin)
+        , t_max(tMax) {
         for (int i = 0; i < 3; ++i) {
             invDir[i] = (dir[i] == 0.f) ? INFINITY : 1.f / dir[i];
             signs[i] = int(invDir[i] < 0.f);
@@ -34,8 +39,25 @@ public:
     const Pvl::Vec3f& direction() const {
         return dir;
     }
+
+    float tMin() const {
+        return t_min;
+    }
+
+    float tMax() const {
+        return t_max;
+    }
+
+    /// \brief Shortens the segment, used by the traversal once a closer hit is found.
+    void setTMax(const float tMax) {
+        t_max = tMax;
+    }
 };
 
+/// \brief Intersects the box with the ray segment.
+///
+/// Returns false if the box does not overlap the segment; otherwise the interval of the ray inside the box,
+/// clipped to the segment, is returned in t_min and t_max.
 bool intersectBox(const Pvl::Box3f& box, const Ray& ray, float& t_min, float& t_max);
 
 struct BvhPrimitive {
@@ -96,7 +118,7 @@ public:
             return false;
         }
         const float t = f * dotProd(dir2, q);
-        if (t <= 0) {
+        if (t <= ray.tMin() || t >= ray.tMax()) {
             return false;
         }
         intersection.object = this;
@@ -169,13 +191,14 @@ public:
 
     bool getFirstIntersection(const Ray& ray, IntersectionInfo& intersection) const;
 
-    /// \brief Returns true if the ray is occluded by some geometry
+    /// \brief Returns true if the ray segment is occluded by some geometry
     bool isOccluded(const Ray& ray) const;
 
     /// \brief Returns the bounding box of all objects in BVH.
     Pvl::Box3f getBoundingBox() const;
 
 private:
+    /// Calls addIntersection for every hit; the functor may shorten the segment to prune farther nodes.
     template <typename TAddIntersection>
     void getIntersections(const Ray& ray, const TAddIntersection& addIntersection) const;
 };
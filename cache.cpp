@@ -0,0 +1,70 @@
+#include "cache.h"
+#include "parameters.h"
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <iomanip>
+#include <sstream>
+
+namespace Mpcv {
+
+namespace {
+
+/// \brief FNV-1a hash, stable between runs and platforms unlike std::hash.
+uint64_t hashString(const std::string& s) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : s) {
+        hash ^= uint8_t(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void addFile(std::stringstream& ss, const std::string& prefix, const QFileInfo& info) {
+    ss << prefix << "=" << info.absoluteFilePath().toStdString() << "\n";
+    ss << "size=" << info.size() << "\n";
+    ss << "modified=" << info.lastModified().toMSecsSinceEpoch() << "\n";
+}
+
+} // namespace
+
+std::string cachePath(const QString& file, const std::string& suffix) {
+    const QString dir = QDir::homePath() + "/.cache/mpcv";
+    QDir().mkpath(dir);
+    std::stringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0')
+       << hashString(QFileInfo(file).absoluteFilePath().toStdString());
+    return dir.toStdString() + "/" + ss.str() + suffix;
+}
+
+std::string cacheKey(const QString& file, const std::vector<std::string>& dependencies) {
+    const Parameters& params = Parameters::global();
+    std::stringstream ss;
+    ss << std::setprecision(17);
+    addFile(ss, "file", QFileInfo(file));
+    for (const std::string& dependency : dependencies) {
+        addFile(ss, "dependency", QFileInfo(QString::fromStdString(dependency)));
+    }
+    ss << "extents=" << params.extents.lower()[0] << "," << params.extents.lower()[1] << ":"
+       << params.extents.upper()[0] << "," << params.extents.upper()[1] << "\n";
+    ss << "stride=" << params.pointStride << "\n";
+    ss << "subset=" << int(params.subset) << "\n";
+    ss << "textureScale=" << params.textureScale << "\n";
+    ss << "dsmResolution=" << params.dsmResolution << "\n";
+    return ss.str();
+}
+
+std::vector<std::string> cacheDependencies(const std::string& key) {
+    const std::string prefix = "dependency=";
+    std::vector<std::string> dependencies;
+    std::stringstream ss(key);
+    std::string line;
+    while (std::getline(ss, line)) {
+        if (line.compare(0, prefix.size(), prefix) == 0) {
+            dependencies.push_back(line.substr(prefix.size()));
+        }
+    }
+    return dependencies;
+}
+
+} // namespace Mpcv
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <QString>
+#include <string>
+#include <vector>
+
+namespace Mpcv {
+
+/// \brief Returns the path of the file caching data loaded from given file.
+///
+/// Caches are stored in ~/.cache/mpcv, the directory is created if it does not exist.
+/// \param suffix Distinguishes caches of different data loaded from the same file.
+std::string cachePath(const QString& file, const std::string& suffix = ".mpcv");
+
+/// \brief Returns a string identifying the file and the global parameters affecting the loaded mesh.
+///
+/// The cached mesh can be used if its key matches the key of the source file, otherwise the source file has
+/// been modified or the parameters changed since the cache was written.
+/// \param dependencies Other files read when loading the mesh, see \ref TexturedMesh::dependencies.
+std::string cacheKey(const QString& file, const std::vector<std::string>& dependencies = {});
+
+/// \brief Returns the dependencies listed in given key.
+///
+/// The dependencies are only known once the mesh is loaded, so the key of the cached mesh has to be checked
+/// against the dependencies stored in it.
+std::vector<std::string> cacheDependencies(const std::string& key);
+
+} // namespace Mpcv
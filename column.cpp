@@ -0,0 +1,40 @@
+#include "column.h"
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Mpcv {
+
+MappedFile::MappedFile(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open file '" + path + "'");
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Cannot read size of file '" + path + "'");
+    }
+    size_ = info.st_size;
+    if (size_ > 0) {
+        // private writable mapping, modified pages are copied and never written back
+        void* data = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Cannot map file '" + path + "'");
+        }
+        data_ = static_cast<uint8_t*>(data);
+    }
+    // the mapping stays valid after closing the descriptor
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_) {
+        munmap(data_, size_);
+    }
+}
+
+} // namespace Mpcv
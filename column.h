@@ -0,0 +1,207 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Mpcv {
+
+/// \brief Private memory mapping of a whole file.
+///
+/// Pages are loaded on demand and shared with other processes mapping the same file. Writes to the mapped
+/// memory are copy-on-write, they are never stored to the file.
+class MappedFile {
+    uint8_t* data_ = nullptr;
+    std::size_t size_ = 0;
+
+public:
+    /// \brief Maps the file, throws std::runtime_error on failure.
+    explicit MappedFile(const std::string& path);
+
+    MappedFile(const MappedFile&) = delete;
+
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile();
+
+    uint8_t* data() const {
+        return data_;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+};
+
+/// \brief Array of trivially copyable values, either owned or stored in a memory-mapped file.
+///
+/// Provides the subset of std::vector interface used by \ref TexturedMesh. Values of a mapped column are
+/// paged in when accessed and can be modified in place (copy-on-write); operations changing the size copy the
+/// values into memory first.
+template <typename T>
+class Column {
+    static_assert(std::is_trivially_destructible<T>::value, "Column values must be plain data");
+
+    std::vector<T> owned_;
+
+    ///< Keeps the mapping alive, null for owned columns
+    std::shared_ptr<MappedFile> file_;
+    T* mapped_ = nullptr;
+    std::size_t mappedSize_ = 0;
+
+public:
+    using value_type = T;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    Column() = default;
+
+    Column(std::vector<T>&& values)
+        : owned_(std::move(values)) {}
+
+    /// \brief Maps size values stored in the file at given offset in bytes.
+    Column(std::shared_ptr<MappedFile> file, const std::size_t offset, const std::size_t size)
+        : file_(std::move(file))
+        , mapped_(reinterpret_cast<T*>(file_->data() + offset))
+        , mappedSize_(size) {}
+
+    Column(const Column& other)
+        : owned_(other.begin(), other.end()) {}
+
+    Column(Column&& other) noexcept
+        : owned_(std::move(other.owned_))
+        , file_(std::move(other.file_))
+        , mapped_(std::exchange(other.mapped_, nullptr))
+        , mappedSize_(std::exchange(other.mappedSize_, 0)) {}
+
+    Column& operator=(const Column& other) {
+        if (this != &other) {
+            *this = Column(other);
+        }
+        return *this;
+    }
+
+    Column& operator=(Column&& other) noexcept {
+        owned_ = std::move(other.owned_);
+        file_ = std::move(other.file_);
+        mapped_ = std::exchange(other.mapped_, nullptr);
+        mappedSize_ = std::exchange(other.mappedSize_, 0);
+        return *this;
+    }
+
+    bool mapped() const {
+        return mapped_ != nullptr;
+    }
+
+    std::size_t size() const {
+        return mapped_ ? mappedSize_ : owned_.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    T* data() {
+        return mapped_ ? mapped_ : owned_.data();
+    }
+
+    const T* data() const {
+        return mapped_ ? mapped_ : owned_.data();
+    }
+
+    T* begin() {
+        return data();
+    }
+
+    const T* begin() const {
+        return data();
+    }
+
+    T* end() {
+        return data() + size();
+    }
+
+    const T* end() const {
+        return data() + size();
+    }
+
+    T& operator[](const std::size_t i) {
+        return data()[i];
+    }
+
+    const T& operator[](const std::size_t i) const {
+        return data()[i];
+    }
+
+    T& front() {
+        return data()[0];
+    }
+
+    const T& front() const {
+        return data()[0];
+    }
+
+    T& back() {
+        return data()[size() - 1];
+    }
+
+    const T& back() const {
+        return data()[size() - 1];
+    }
+
+    void push_back(const T& value) {
+        detach();
+        owned_.push_back(value);
+    }
+
+    template <typename... TArgs>
+    void emplace_back(TArgs&&... args) {
+        detach();
+        owned_.emplace_back(std::forward<TArgs>(args)...);
+    }
+
+    template <typename TIter>
+    void insert(const T* pos, TIter first, TIter last) {
+        const std::size_t index = pos - begin();
+        detach();
+        owned_.insert(owned_.begin() + index, first, last);
+    }
+
+    void reserve(const std::size_t capacity) {
+        detach();
+        owned_.reserve(capacity);
+    }
+
+    void resize(const std::size_t size) {
+        detach();
+        owned_.resize(size);
+    }
+
+    void resize(const std::size_t size, const T& value) {
+        detach();
+        owned_.resize(size, value);
+    }
+
+    void shrink_to_fit() {
+        owned_.shrink_to_fit();
+    }
+
+    void clear() {
+        *this = Column();
+    }
+
+private:
+    void detach() {
+        if (mapped_) {
+            owned_.assign(mapped_, mapped_ + mappedSize_);
+            mapped_ = nullptr;
+            mappedSize_ = 0;
+            file_.reset();
+        }
+    }
+};
+
+} // namespace Mpcv
@@ -0,0 +1,670 @@
+#include "decimation.h"
+#include "pvl/Box.hpp"
+#include "pvl/Utils.hpp"
+#include <queue>
+#include <tbb/tbb.h>
+
+namespace Mpcv {
+
+namespace {
+
+/// Position, texture coordinates and color
+constexpr int MAX_DIM = 8;
+
+/// \brief Quadric measuring the squared distance to planes in R^n, where n = 3 + number of attributes.
+class Quadric {
+    ///< Upper triangle of the symmetric matrix
+    std::array<double, MAX_DIM*(MAX_DIM + 1) / 2> a_;
+    std::array<double, MAX_DIM> b_;
+    double c_;
+
+    ///< Sum of areas of the planes
+    double weight_;
+
+    static int index(const int i, const int j) {
+        return i * MAX_DIM - i * (i - 1) / 2 + (j - i);
+    }
+
+public:
+    Quadric() {
+        a_.fill(0.);
+        b_.fill(0.);
+        c_ = 0.;
+        weight_ = 0.;
+    }
+
+    /// \brief Creates the quadric of a triangle, see Garland & Heckbert (1998).
+    Quadric(const double* p, const double* q, const double* r, const int n, const double area)
+        : Quadric() {
+        // orthonormal basis of the triangle plane
+        std::array<double, MAX_DIM> e1, e2;
+        double len1 = 0.;
+        for (int i = 0; i < n; ++i) {
+            e1[i] = q[i] - p[i];
+            len1 += e1[i] * e1[i];
+        }
+        if (len1 == 0. || area == 0.) {
+            return;
+        }
+        len1 = std::sqrt(len1);
+        double proj = 0.;
+        for (int i = 0; i < n; ++i) {
+            e1[i] /= len1;
+            e2[i] = r[i] - p[i];
+            proj += e2[i] * e1[i];
+        }
+        double len2 = 0.;
+        for (int i = 0; i < n; ++i) {
+            e2[i] -= proj * e1[i];
+            len2 += e2[i] * e2[i];
+        }
+        if (len2 == 0.) {
+            return;
+        }
+        len2 = std::sqrt(len2);
+        double pe1 = 0., pe2 = 0., pp = 0.;
+        for (int i = 0; i < n; ++i) {
+            e2[i] /= len2;
+            pe1 += p[i] * e1[i];
+            pe2 += p[i] * e2[i];
+            pp += p[i] * p[i];
+        }
+        for (int i = 0; i < n; ++i) {
+            for (int j = i; j < n; ++j) {
+                a_[index(i, j)] = area * (double(i == j) - e1[i] * e1[j] - e2[i] * e2[j]);
+            }
+            b_[i] = area * (pe1 * e1[i] + pe2 * e2[i] - p[i]);
+        }
+        c_ = area * (pp - pe1 * pe1 - pe2 * pe2);
+        weight_ = area;
+    }
+
+    Quadric& operator+=(const Quadric& other) {
+        for (std::size_t i = 0; i < a_.size(); ++i) {
+            a_[i] += other.a_[i];
+        }
+        for (int i = 0; i < MAX_DIM; ++i) {
+            b_[i] += other.b_[i];
+        }
+        c_ += other.c_;
+        weight_ += other.weight_;
+        return *this;
+    }
+
+    /// \brief Returns the area-weighted RMS distance of the point to the planes of both quadrics.
+    static double error(const Quadric& q1, const Quadric& q2, const double* x, const int n) {
+        const double weight = q1.weight_ + q2.weight_;
+        if (weight == 0.) {
+            return 0.;
+        }
+        return std::sqrt(std::max(q1.evaluate(x, n) + q2.evaluate(x, n), 0.) / weight);
+    }
+
+private:
+    double evaluate(const double* x, const int n) const {
+        double value = c_;
+        for (int i = 0; i < n; ++i) {
+            value += a_[index(i, i)] * x[i] * x[i] + 2. * b_[i] * x[i];
+            for (int j = i + 1; j < n; ++j) {
+                value += 2. * a_[index(i, j)] * x[i] * x[j];
+            }
+        }
+        return value;
+    }
+};
+
+struct Collapse {
+    float error;
+    uint32_t from;
+    uint32_t to;
+    uint32_t fromStamp;
+    uint32_t toStamp;
+
+    bool operator>(const Collapse& other) const {
+        return error > other.error;
+    }
+};
+
+/// \brief Simplifies faces of a single cluster; vertices referenced by other clusters must be locked.
+///
+/// Only modifies the faces of the cluster, so clusters can be simplified concurrently.
+class ClusterDecimator {
+    TexturedMesh& mesh_;
+    const DecimationSettings& settings_;
+    const std::vector<uint8_t>& shared_;
+    std::vector<uint8_t>& removedFaces_;
+
+    bool hasUv_;
+    bool uvError_;
+    bool colorError_;
+    int dim_;
+    double uvScale_;
+    double colorScale_;
+
+    ///< Global indices of the cluster faces
+    const uint32_t* faceIds_;
+
+    ///< Cluster faces with local vertex indices and global texture indices
+    std::vector<TexturedMesh::Face> faces_;
+    std::vector<TexturedMesh::Face> texIds_;
+    std::vector<uint8_t> deadFaces_;
+
+    ///< Normals of the cluster faces before simplification
+    std::vector<Pvl::Vec3f> normals_;
+
+    ///< Global indices of the cluster vertices, sorted
+    std::vector<uint32_t> vertices_;
+    std::vector<std::vector<uint32_t>> vertexFaces_;
+    std::vector<Quadric> quadrics_;
+    std::vector<uint8_t> boundary_;
+    std::vector<uint8_t> locked_;
+    std::vector<uint8_t> deadVertices_;
+    std::vector<uint32_t> stamps_;
+    Pvl::Vec3f center_;
+    float error_ = 0.f;
+
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> queue_;
+
+    // buffers reused by collapses
+    std::vector<uint32_t> edgeFaces_, fromNeighs_, toNeighs_, opposite_;
+    std::vector<std::pair<uint32_t, uint32_t>> texMap_;
+
+public:
+    ClusterDecimator(TexturedMesh& mesh,
+        const DecimationSettings& settings,
+        const std::vector<uint8_t>& shared,
+        std::vector<uint8_t>& removedFaces,
+        const double diagonal)
+        : mesh_(mesh)
+        , settings_(settings)
+        , shared_(shared)
+        , removedFaces_(removedFaces) {
+        hasUv_ = !mesh.texIds.empty();
+        uvError_ = hasUv_ && settings.attributeWeight > 0.f;
+        colorError_ = !mesh.colors.empty() && settings.attributeWeight > 0.f;
+        dim_ = 3 + (uvError_ ? 2 : 0) + (colorError_ ? 3 : 0);
+        // attributes in [0, 1] are scaled to the size of the mesh
+        uvScale_ = settings.attributeWeight * diagonal;
+        colorScale_ = settings.attributeWeight * diagonal / 255.;
+    }
+
+    /// \brief Collapses edges until the cluster has targetFaces faces or the error limit is reached.
+    ///
+    /// Returns the number of removed faces.
+    std::size_t run(const uint32_t* faceBegin, const uint32_t* faceEnd, const std::size_t targetFaces) {
+        build(faceBegin, faceEnd);
+        std::size_t numFaces = faces_.size();
+        while (numFaces > targetFaces && !queue_.empty()) {
+            const Collapse c = queue_.top();
+            queue_.pop();
+            if (deadVertices_[c.from] || deadVertices_[c.to] || stamps_[c.from] != c.fromStamp ||
+                stamps_[c.to] != c.toStamp) {
+                // outdated
+                continue;
+            }
+            if (c.error > settings_.maxError) {
+                break;
+            }
+            const std::size_t removed = collapse(c.from, c.to);
+            if (removed > 0) {
+                numFaces -= removed;
+                error_ = std::max(error_, c.error);
+            }
+        }
+        writeBack();
+        return faces_.size() - numFaces;
+    }
+
+    /// \brief Returns the largest error of the done collapses.
+    float error() const {
+        return error_;
+    }
+
+private:
+    void build(const uint32_t* faceBegin, const uint32_t* faceEnd) {
+        faceIds_ = faceBegin;
+        const std::size_t numFaces = faceEnd - faceBegin;
+        for (std::size_t i = 0; i < numFaces; ++i) {
+            const TexturedMesh::Face& f = mesh_.faces[faceBegin[i]];
+            vertices_.insert(vertices_.end(), f.begin(), f.end());
+        }
+        std::sort(vertices_.begin(), vertices_.end());
+        vertices_.erase(std::unique(vertices_.begin(), vertices_.end()), vertices_.end());
+        const std::size_t numVertices = vertices_.size();
+
+        Pvl::Box3f box;
+        for (uint32_t vi : vertices_) {
+            box.extend(mesh_.vertices[vi]);
+        }
+        center_ = box.center();
+
+        faces_.resize(numFaces);
+        deadFaces_.resize(numFaces, 0);
+        vertexFaces_.resize(numVertices);
+        for (std::size_t i = 0; i < numFaces; ++i) {
+            const TexturedMesh::Face& f = mesh_.faces[faceBegin[i]];
+            for (int j = 0; j < 3; ++j) {
+                auto iter = std::lower_bound(vertices_.begin(), vertices_.end(), f[j]);
+                faces_[i][j] = uint32_t(iter - vertices_.begin());
+                vertexFaces_[faces_[i][j]].push_back(uint32_t(i));
+            }
+            if (hasUv_) {
+                texIds_.push_back(mesh_.texIds[faceBegin[i]]);
+            }
+        }
+
+        quadrics_.resize(numVertices);
+        normals_.resize(numFaces);
+        for (std::size_t i = 0; i < numFaces; ++i) {
+            normals_[i] = mesh_.normal(faceBegin[i]);
+            std::array<std::array<double, MAX_DIM>, 3> x;
+            for (int j = 0; j < 3; ++j) {
+                point(uint32_t(i), j, x[j].data());
+            }
+            const Quadric q(x[0].data(), x[1].data(), x[2].data(), dim_, area(faces_[i]));
+            for (int j = 0; j < 3; ++j) {
+                quadrics_[faces_[i][j]] += q;
+            }
+        }
+
+        // lock vertices shared with other clusters and vertices on the boundary or non-manifold edges
+        boundary_.resize(numVertices, 0);
+        locked_.resize(numVertices);
+        deadVertices_.resize(numVertices, 0);
+        stamps_.resize(numVertices, 0);
+        std::vector<uint32_t> neighs;
+        for (uint32_t vi = 0; vi < numVertices; ++vi) {
+            neighbors(vi, neighs, false);
+            for (std::size_t i = 0; i < neighs.size() && !boundary_[vi];) {
+                std::size_t j = i + 1;
+                while (j < neighs.size() && neighs[j] == neighs[i]) {
+                    ++j;
+                }
+                boundary_[vi] = (j - i) != 2;
+                i = j;
+            }
+            locked_[vi] = shared_[vertices_[vi]] || boundary_[vi];
+        }
+
+        for (uint32_t vi = 0; vi < numVertices; ++vi) {
+            if (locked_[vi]) {
+                continue;
+            }
+            neighbors(vi, neighs, true);
+            for (uint32_t vj : neighs) {
+                push(vi, vj);
+            }
+        }
+    }
+
+    void writeBack() {
+        for (std::size_t i = 0; i < faces_.size(); ++i) {
+            const uint32_t fi = faceIds_[i];
+            if (deadFaces_[i]) {
+                removedFaces_[fi] = 1;
+                continue;
+            }
+            for (int j = 0; j < 3; ++j) {
+                mesh_.faces[fi][j] = vertices_[faces_[i][j]];
+            }
+            if (hasUv_) {
+                mesh_.texIds[fi] = texIds_[i];
+            }
+        }
+    }
+
+    /// Returns the position and attributes of j-th corner of the face, relative to the cluster center
+    void point(const uint32_t fi, const int j, double* x) const {
+        const uint32_t vi = vertices_[faces_[fi][j]];
+        const Pvl::Vec3f p = mesh_.vertices[vi] - center_;
+        x[0] = p[0];
+        x[1] = p[1];
+        x[2] = p[2];
+        int k = 3;
+        if (uvError_) {
+            const Pvl::Vec2f& uv = mesh_.uv[texIds_[fi][j]];
+            x[k++] = uvScale_ * uv[0];
+            x[k++] = uvScale_ * uv[1];
+        }
+        if (colorError_) {
+            const Color& c = mesh_.colors[vi];
+            for (int i = 0; i < 3; ++i) {
+                x[k++] = colorScale_ * c[i];
+            }
+        }
+    }
+
+    Pvl::Vec3f position(const uint32_t vi) const {
+        return mesh_.vertices[vertices_[vi]];
+    }
+
+    double area(const TexturedMesh::Face& f) const {
+        const Pvl::Vec3f p0 = position(f[0]);
+        return 0.5 * Pvl::norm(Pvl::crossProd(position(f[1]) - p0, position(f[2]) - p0));
+    }
+
+    static int corner(const TexturedMesh::Face& f, const uint32_t vi) {
+        return f[0] == vi ? 0 : (f[1] == vi ? 1 : (f[2] == vi ? 2 : -1));
+    }
+
+    /// Returns the vertices adjacent to given vertex, optionally removing duplicates
+    void neighbors(const uint32_t vi, std::vector<uint32_t>& neighs, const bool unique) const {
+        neighs.clear();
+        for (uint32_t fi : vertexFaces_[vi]) {
+            for (uint32_t vj : faces_[fi]) {
+                if (vj != vi) {
+                    neighs.push_back(vj);
+                }
+            }
+        }
+        std::sort(neighs.begin(), neighs.end());
+        if (unique) {
+            neighs.erase(std::unique(neighs.begin(), neighs.end()), neighs.end());
+        }
+    }
+
+    void push(const uint32_t from, const uint32_t to) {
+        // evaluate the attributes of the target vertex in a face shared with the collapsed vertex, so that
+        // the texture coordinates are taken from the same chart
+        for (uint32_t fi : vertexFaces_[from]) {
+            const int j = corner(faces_[fi], to);
+            if (j < 0) {
+                continue;
+            }
+            std::array<double, MAX_DIM> x;
+            point(fi, j, x.data());
+            const double error = Quadric::error(quadrics_[from], quadrics_[to], x.data(), dim_);
+            queue_.push(Collapse{ float(error), from, to, stamps_[from], stamps_[to] });
+            return;
+        }
+    }
+
+    /// Moves vertex 'from' into vertex 'to', returns the number of removed faces or zero if the collapse is
+    /// invalid
+    std::size_t collapse(const uint32_t from, const uint32_t to) {
+        edgeFaces_.clear();
+        opposite_.clear();
+        texMap_.clear();
+        for (uint32_t fi : vertexFaces_[from]) {
+            const TexturedMesh::Face& f = faces_[fi];
+            const int j = corner(f, to);
+            if (j < 0) {
+                continue;
+            }
+            edgeFaces_.push_back(fi);
+            opposite_.push_back(f[0] + f[1] + f[2] - from - to);
+            if (hasUv_) {
+                // texture coordinates of the moved corners are replaced by the ones of the same chart
+                const uint32_t fromTex = texIds_[fi][corner(f, from)];
+                const uint32_t toTex = texIds_[fi][j];
+                for (const auto& p : texMap_) {
+                    if (p.first == fromTex && p.second != toTex) {
+                        // the vertices are on a seam, but the edge is not
+                        return 0;
+                    }
+                }
+                texMap_.emplace_back(fromTex, toTex);
+            }
+        }
+        if (edgeFaces_.size() != 2) {
+            return 0;
+        }
+
+        // link condition, the only common neighbors are the opposite_ vertices of the edge
+        neighbors(from, fromNeighs_, true);
+        neighbors(to, toNeighs_, true);
+        std::size_t common = 0;
+        for (uint32_t vi : fromNeighs_) {
+            if (std::binary_search(toNeighs_.begin(), toNeighs_.end(), vi)) {
+                ++common;
+            }
+        }
+        if (common != 2 || opposite_[0] == opposite_[1]) {
+            return 0;
+        }
+        if (shared_[vertices_[to]]) {
+            // faces of other clusters are not visible, reject collapses that could connect the target vertex
+            // to another shared vertex
+            for (uint32_t vi : fromNeighs_) {
+                if (vi != to && vi != opposite_[0] && vi != opposite_[1] && shared_[vertices_[vi]]) {
+                    return 0;
+                }
+            }
+        }
+
+        const Pvl::Vec3f target = position(to);
+        for (uint32_t fi : vertexFaces_[from]) {
+            const TexturedMesh::Face& f = faces_[fi];
+            if (corner(f, to) >= 0) {
+                continue;
+            }
+            const int j = corner(f, from);
+            if (hasUv_) {
+                const uint32_t fromTex = texIds_[fi][j];
+                auto sameChart = [fromTex](const std::pair<uint32_t, uint32_t>& p) {
+                    return p.first == fromTex;
+                };
+                if (std::find_if(texMap_.begin(), texMap_.end(), sameChart) == texMap_.end()) {
+                    // the face is in a chart not adjacent to the edge
+                    return 0;
+                }
+            }
+            if (boundary_[to] && boundary_[f[(j + 1) % 3]] && boundary_[f[(j + 2) % 3]]) {
+                // the face would span the boundary and fold it
+                return 0;
+            }
+            // prevent face flips and degenerate faces
+            const Pvl::Vec3f p1 = position(f[(j + 1) % 3]);
+            const Pvl::Vec3f p2 = position(f[(j + 2) % 3]);
+            const Pvl::Vec3f n0 = Pvl::crossProd(p1 - position(from), p2 - position(from));
+            const Pvl::Vec3f n1 = Pvl::crossProd(p1 - target, p2 - target);
+            const float limit = 0.2f * Pvl::norm(n1);
+            if (Pvl::dotProd(n0, n1) <= limit * Pvl::norm(n0) || Pvl::dotProd(normals_[fi], n1) <= limit) {
+                // also compared to the original normal, small rotations could add up to a flip
+                return 0;
+            }
+        }
+
+        // valid collapse, update the faces
+        for (uint32_t fi : edgeFaces_) {
+            deadFaces_[fi] = 1;
+            for (uint32_t vi : faces_[fi]) {
+                if (vi != from) {
+                    std::vector<uint32_t>& list = vertexFaces_[vi];
+                    list.erase(std::find(list.begin(), list.end(), fi));
+                }
+            }
+        }
+        for (uint32_t fi : vertexFaces_[from]) {
+            if (deadFaces_[fi]) {
+                continue;
+            }
+            const int j = corner(faces_[fi], from);
+            faces_[fi][j] = to;
+            if (hasUv_) {
+                for (const auto& p : texMap_) {
+                    if (p.first == texIds_[fi][j]) {
+                        texIds_[fi][j] = p.second;
+                        break;
+                    }
+                }
+            }
+            vertexFaces_[to].push_back(fi);
+        }
+        vertexFaces_[from] = {};
+        deadVertices_[from] = 1;
+        quadrics_[to] += quadrics_[from];
+        stamps_[to]++;
+
+        neighbors(to, toNeighs_, true);
+        for (uint32_t vi : toNeighs_) {
+            if (!locked_[to]) {
+                push(to, vi);
+            }
+            if (!locked_[vi]) {
+                push(vi, to);
+            }
+        }
+        return edgeFaces_.size();
+    }
+};
+
+/// Returns the cell size of a grid over the box with approximately given number of cells
+float cellSize(const Pvl::Box3f& box, const std::size_t cellCnt) {
+    const Pvl::Vec3f size = box.size();
+    auto count = [&size](const float h) {
+        double cnt = 1.;
+        for (int i = 0; i < 3; ++i) {
+            cnt *= std::max(std::ceil(size[i] / h), 1.f);
+        }
+        return cnt;
+    };
+    float lower = 0.f;
+    float upper = std::max(std::max(size[0], size[1]), std::max(size[2], 1.e-6f));
+    for (int iter = 0; iter < 32; ++iter) {
+        const float h = 0.5f * (lower + upper);
+        if (count(h) > cellCnt) {
+            lower = h;
+        } else {
+            upper = h;
+        }
+    }
+    return upper;
+}
+
+} // namespace
+
+bool decimate(TexturedMesh& mesh,
+              const DecimationSettings& settings,
+              std::function<bool(float)> progress,
+              float* error) {
+    const std::size_t numVertices = mesh.vertices.size();
+    std::size_t numFaces = mesh.faces.size();
+    if (error) {
+        *error = 0.f;
+    }
+    if (numFaces <= settings.targetFaces) {
+        return true;
+    }
+    Pvl::Box3f box;
+    for (const Pvl::Vec3f& p : mesh.vertices) {
+        box.extend(p);
+    }
+    const double diagonal = Pvl::norm(box.size());
+    const std::size_t clusterFaces = std::max<std::size_t>(settings.clusterFaces, 64);
+
+    std::vector<uint8_t> removedFaces(numFaces, 0);
+    std::vector<uint8_t> shared(numVertices);
+    std::vector<uint32_t> vertexCluster(numVertices);
+    std::vector<uint32_t> faceCluster(numFaces);
+    std::vector<uint32_t> clusterOffsets, clusterFaceIds;
+    constexpr uint32_t NO_CLUSTER = uint32_t(-1);
+
+    const int passes = std::max(settings.passes, 1);
+    auto meter = Pvl::makeProgressMeter(numFaces - settings.targetFaces, std::move(progress));
+    tbb::atomic<bool> cancelled = false;
+    for (int pass = 0; pass < passes && !cancelled; ++pass) {
+        // partition the faces into grid cells, shifted by a different fraction of the cell in each pass, so
+        // that the cell borders of a pass do not coincide with the borders of any previous pass
+        const std::size_t cellCnt = (numFaces + clusterFaces - 1) / clusterFaces;
+        const float h = cellSize(box, cellCnt);
+        const Pvl::Vec3f origin = box.lower() - Pvl::Vec3f(h * float(pass) / passes);
+        Pvl::Vec3i dims;
+        for (int i = 0; i < 3; ++i) {
+            dims[i] = int(std::ceil((box.upper()[i] - origin[i]) / h)) + 1;
+        }
+        const std::size_t numClusters = std::size_t(dims[0]) * dims[1] * dims[2];
+        clusterOffsets.assign(numClusters + 1, 0);
+        tbb::parallel_for(std::size_t(0), mesh.faces.size(), [&](std::size_t fi) {
+            if (removedFaces[fi]) {
+                faceCluster[fi] = NO_CLUSTER;
+                return;
+            }
+            const Pvl::Vec3f c = (mesh.centroid(uint32_t(fi)) - origin) / h;
+            Pvl::Vec3i idxs;
+            for (int i = 0; i < 3; ++i) {
+                idxs[i] = std::min(std::max(int(c[i]), 0), dims[i] - 1);
+            }
+            faceCluster[fi] = uint32_t((std::size_t(idxs[2]) * dims[1] + idxs[1]) * dims[0] + idxs[0]);
+        });
+
+        // counting sort of faces by clusters; vertices referenced from multiple clusters are locked
+        std::fill(vertexCluster.begin(), vertexCluster.end(), NO_CLUSTER);
+        std::fill(shared.begin(), shared.end(), 0);
+        for (std::size_t fi = 0; fi < faceCluster.size(); ++fi) {
+            const uint32_t ci = faceCluster[fi];
+            if (ci == NO_CLUSTER) {
+                continue;
+            }
+            clusterOffsets[ci + 1]++;
+            for (uint32_t vi : mesh.faces[fi]) {
+                if (vertexCluster[vi] == NO_CLUSTER) {
+                    vertexCluster[vi] = ci;
+                } else if (vertexCluster[vi] != ci) {
+                    shared[vi] = 1;
+                }
+            }
+        }
+        for (std::size_t ci = 0; ci < numClusters; ++ci) {
+            clusterOffsets[ci + 1] += clusterOffsets[ci];
+        }
+        clusterFaceIds.resize(numFaces);
+        std::vector<uint32_t> fill(clusterOffsets.begin(), clusterOffsets.end() - 1);
+        for (std::size_t fi = 0; fi < faceCluster.size(); ++fi) {
+            if (faceCluster[fi] != NO_CLUSTER) {
+                clusterFaceIds[fill[faceCluster[fi]]++] = uint32_t(fi);
+            }
+        }
+
+        // each cluster is reduced by the same ratio
+        const double ratio = double(settings.targetFaces) / numFaces;
+        tbb::atomic<std::size_t> removed = 0;
+        tbb::mutex errorMutex;
+        tbb::parallel_for(std::size_t(0), numClusters, [&](std::size_t ci) {
+            const uint32_t first = clusterOffsets[ci];
+            const uint32_t last = clusterOffsets[ci + 1];
+            if (first == last || cancelled) {
+                return;
+            }
+            ClusterDecimator decimator(mesh, settings, shared, removedFaces, diagonal);
+            const std::size_t target = std::size_t(std::ceil(ratio * (last - first)));
+            const std::size_t count =
+                decimator.run(clusterFaceIds.data() + first, clusterFaceIds.data() + last, target);
+            removed += count;
+            if (error) {
+                tbb::mutex::scoped_lock lock(errorMutex);
+                *error = std::max(*error, decimator.error());
+            }
+            for (std::size_t i = 0; i < count; ++i) {
+                if (meter.inc()) {
+                    cancelled = true;
+                    break;
+                }
+            }
+        });
+        numFaces -= removed;
+        if (numFaces <= settings.targetFaces || removed < numFaces / 100) {
+            break;
+        }
+    }
+
+    // compact the faces
+    std::size_t dst = 0;
+    for (std::size_t fi = 0; fi < mesh.faces.size(); ++fi) {
+        if (removedFaces[fi]) {
+            continue;
+        }
+        mesh.faces[dst] = mesh.faces[fi];
+        if (!mesh.texIds.empty()) {
+            mesh.texIds[dst] = mesh.texIds[fi];
+        }
+        ++dst;
+    }
+    mesh.faces.resize(dst);
+    if (!mesh.texIds.empty()) {
+        mesh.texIds.resize(dst);
+    }
+    return !cancelled;
+}
+
+} // namespace Mpcv
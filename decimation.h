@@ -0,0 +1,41 @@
+#pragma once
+
+#include "mesh.h"
+#include <functional>
+#include <limits>
+
+namespace Mpcv {
+
+struct DecimationSettings {
+    ///< Number of faces of the simplified mesh
+    std::size_t targetFaces = 0;
+
+    ///< Maximal error of a collapse in units of the mesh; collapses with larger error are not done
+    float maxError = std::numeric_limits<float>::infinity();
+
+    ///< Approximate number of faces in a cluster simplified by a single thread
+    std::size_t clusterFaces = 1 << 16;
+
+    ///< Weight of texture coordinates and colors in the error, zero for geometry-only simplification
+    float attributeWeight = 1.f;
+
+    ///< Maximal number of passes; each pass shifts the clusters to simplify the previously locked borders
+    int passes = 3;
+};
+
+/// \brief Simplifies the mesh by collapsing edges until the target face count or the error limit is reached.
+///
+/// The mesh is partitioned into spatial clusters simplified in parallel; vertices shared between clusters are
+/// locked and simplified in the next pass with shifted clusters. Collapses move a vertex into its neighbor, so
+/// the remaining vertices keep their positions, colors and other attributes. The error is measured by quadrics
+/// extended with texture coordinates and colors (Garland & Heckbert 1998); texture seams are only collapsed
+/// along the seam. Mesh boundaries and non-manifold edges are preserved.
+///
+/// \param error If not null, receives the largest error of the done collapses.
+/// \return False if cancelled by the progress callback; the mesh is valid but only partially simplified.
+bool decimate(TexturedMesh& mesh,
+              const DecimationSettings& settings,
+              std::function<bool(float)> progress,
+              float* error = nullptr);
+
+} // namespace Mpcv
@@ -2,6 +2,7 @@
 #include "./ui_framebuffer.h"
 #include "mesh.h"
 #include "utils.h"
+#include <QMessageBox>
 #include <QProgressBar>
 #include <QTimer>
 #include <tbb/tbb.h>
@@ -13,46 +14,16 @@ struct TaskGroup {
     tbb::mutex mutex;
 };
 
-inline float aces(const float v0) {
-    float v = 0.6f * v0;
-    float a = 2.51f;
-    float b = 0.03f;
-    float c = 2.43f;
-    float d = 0.59f;
-    float e = 0.14f;
-    return (v * (a * v + b)) / (v * (c * v + d) + e);
-}
-
-inline Color colormap(const Pvl::Vec3f& color, float exposure) {
-    Color result;
-    for (int c = 0; c < 3; ++c) {
-        float value = exposure * color[c];
-        //      float compressed = 5.f * value / (5.f + value);
-        float compressed = aces(value);
-        float clamped = std::max(std::min(compressed, 1.f), 0.f);
-        result[c] = uint8_t(std::pow(clamped, 1.f / 2.2f) * 255.f);
-    }
-    return result;
-}
-
 void View::paintEvent(QPaintEvent*) {
-    QImage image;
-    {
-        tbb::mutex::scoped_lock lock(tg_->mutex);
-        Pvl::Vec2i dims = image_.dimension();
-        image = QImage(dims[0], dims[1], QImage::Format_RGB888);
-        image.fill(QColor(0, 0, 0));
-        for (int y = 0; y < dims[1]; ++y) {
-            for (int x = 0; x < dims[0]; ++x) {
-                Pvl::Vec2i pix(x, y);
-                Color color = colormap(image_(pix), exposure_);
-                image.setPixelColor(x, y, QColor(color[0], color[1], color[2]));
-            }
-        }
+    // the display image is kept up to date by setTile and setExposure, so the repaint is just a blit
+    tbb::mutex::scoped_lock lock(tg_->mutex);
+    QPainter painter(this);
+    painter.fillRect(rect(), QColor(0, 0, 0));
+    if (display_.isNull()) {
+        return;
     }
-    // image.save("render-" + QString::number(pass) + ".png");
     QRect targetRect = rect();
-    QRect sourceRect = image.rect();
+    QRect sourceRect = display_.rect();
     float targetAspect = float(targetRect.width()) / targetRect.height();
     float sourceAspect = float(sourceRect.width()) / sourceRect.height();
     if (targetAspect > sourceAspect) {
@@ -66,9 +37,7 @@ void View::paintEvent(QPaintEvent*) {
         targetRect.setY(newY);
         targetRect.setHeight(newHeight);
     }
-    QPainter painter(this);
-    painter.fillRect(rect(), QColor(0, 0, 0));
-    painter.drawImage(targetRect, image, sourceRect);
+    painter.drawImage(targetRect, display_, sourceRect);
     painter.end();
 }
 
@@ -76,48 +45,61 @@ void View::setTaskGroup(std::shared_ptr<TaskGroup> tg) {
     tg_ = tg;
 }
 
-void View::setImage(Image&& image) {
+void View::setResolution(const Pvl::Vec2i& resolution) {
     {
         tbb::mutex::scoped_lock lock(tg_->mutex);
-        image_ = std::move(image);
+        image_ = Image(resolution);
+        for (int y = 0; y < resolution[1]; ++y) {
+            for (int x = 0; x < resolution[0]; ++x) {
+                image_(Pvl::Vec2i(x, y)) = Pvl::Vec3f(0.f);
+            }
+        }
+        display_ = QImage(resolution[0], resolution[1], QImage::Format_RGB888);
+        display_.fill(QColor(0, 0, 0));
+    }
+    dirty_ = true;
+}
+
+void View::setTile(const Pvl::Vec2i& offset, const Image& tile) {
+    {
+        tbb::mutex::scoped_lock lock(tg_->mutex);
+        Pvl::Vec2i dims = tile.dimension();
+        for (int y = 0; y < dims[1]; ++y) {
+            for (int x = 0; x < dims[0]; ++x) {
+                Pvl::Vec2i pix(x, y);
+                image_(offset + pix) = tile(pix);
+            }
+        }
+        toneMap(tile, exposure_, display_, offset);
+    }
+    // repainted by the timer of the parent widget, only updated tiles are copied here
+    dirty_ = true;
+}
+
+void View::updateTiles() {
+    if (dirty_.exchange(false)) {
+        update();
     }
-    update();
 }
 
 void View::setExposure(int exposure) {
-    exposure_ = std::pow(2.f, float(exposure - 50.f) / 10.f);
+    {
+        tbb::mutex::scoped_lock lock(tg_->mutex);
+        exposure_ = std::pow(2.f, float(exposure - 50.f) / 10.f);
+        if (!display_.isNull()) {
+            toneMap(image_, exposure_, display_);
+        }
+    }
     update();
 }
 
-void View::save() {
-    QDir& initialDir = saveFileDialogInitialDir();
-    QString file = QFileDialog::getSaveFileName(this,
-        tr("Save render"),
-        initialDir.path(),
-        tr("PNG image (*.png);;JPEG image (*.jpg);;Targa image (*.tga)"));
-    if (!file.isEmpty()) {
-        QFileInfo info(file);
-        initialDir = info.dir();
-        if (info.suffix().isEmpty()) {
-            file += ".png";
-        }
-        /// \todo deduplicate
-        QImage image;
-        {
-            tbb::mutex::scoped_lock lock(tg_->mutex);
-            Pvl::Vec2i dims = image_.dimension();
-            image = QImage(dims[0], dims[1], QImage::Format_RGB888);
-            image.fill(QColor(0, 0, 0));
-            for (int y = 0; y < dims[1]; ++y) {
-                for (int x = 0; x < dims[0]; ++x) {
-                    Pvl::Vec2i pix(x, y);
-                    Color color = colormap(image_(pix), exposure_);
-                    image.setPixelColor(x, y, QColor(color[0], color[1], color[2]));
-                }
-            }
-        }
-        image.save(file);
+void View::save(const QString& file) {
+    QImage image;
+    {
+        tbb::mutex::scoped_lock lock(tg_->mutex);
+        image = display_.copy();
     }
+    image.save(file);
 }
 
 FrameBufferWidget::FrameBufferWidget(QWidget* parent)
@@ -141,6 +123,7 @@ FrameBufferWidget::FrameBufferWidget(QWidget* parent)
     QObject::connect(timer, &QTimer::timeout, this, [this] {
         iterationBar_->setValue(passValue_);
         progressBar_->setValue(progressValue_);
+        view_->updateTiles();
     });
     timer->start(200);
 }
@@ -158,11 +141,74 @@ void FrameBufferWidget::setProgress(const int pass, const int prog) {
     progressValue_ = prog;
 }
 void FrameBufferWidget::run(const std::function<void()>& func) {
-    tg_->group.run(func);
+    rendering_ = true;
+    tg_->group.run([this, func] {
+        func();
+        rendering_ = false;
+    });
+}
+
+bool FrameBufferWidget::checkRenderFinished() {
+    if (rendering_) {
+        QMessageBox box(QMessageBox::Warning, "Error", "The render buffers can be saved once the rendering finishes.");
+        box.exec();
+        return false;
+    }
+    return true;
 }
 
 void FrameBufferWidget::on_actionSave_render_triggered() {
-    view_->save();
+    QDir& initialDir = saveFileDialogInitialDir();
+    QString file = QFileDialog::getSaveFileName(this,
+        tr("Save render"),
+        initialDir.path(),
+        tr("PNG image (*.png);;JPEG image (*.jpg);;Targa image (*.tga);;OpenEXR image with normals and variance "
+           "(*.exr);;Portable float map (*.pfm)"));
+    if (file.isEmpty()) {
+        return;
+    }
+    QFileInfo info(file);
+    initialDir = info.dir();
+    if (info.suffix().isEmpty()) {
+        file += ".png";
+    }
+    const QString ext = QFileInfo(file).suffix().toLower();
+    if (ext == "exr" || ext == "pfm") {
+        if (!checkRenderFinished()) {
+            return;
+        }
+        try {
+            saveRenderBuffers(file.toStdString(), buffers_);
+        } catch (const std::exception& e) {
+            QMessageBox box(QMessageBox::Warning, "Error", e.what());
+            box.exec();
+        }
+    } else {
+        view_->save(file);
+    }
+}
+
+void FrameBufferWidget::on_actionSave_checkpoint_triggered() {
+    if (!checkRenderFinished()) {
+        return;
+    }
+    QDir& initialDir = saveFileDialogInitialDir();
+    QString file = QFileDialog::getSaveFileName(
+        this, tr("Save checkpoint"), initialDir.path(), tr("Render checkpoint (*.ckpt)"));
+    if (file.isEmpty()) {
+        return;
+    }
+    QFileInfo info(file);
+    initialDir = info.dir();
+    if (info.suffix().isEmpty()) {
+        file += ".ckpt";
+    }
+    try {
+        saveCheckpoint(file.toStdString(), buffers_);
+    } catch (const std::exception& e) {
+        QMessageBox box(QMessageBox::Warning, "Error", e.what());
+        box.exec();
+    }
 }
 
 void FrameBufferWidget::on_horizontalSlider_valueChanged(int value) {
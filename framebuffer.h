@@ -1,10 +1,12 @@
 #pragma once
 
-#include "pvl/UniformGrid.hpp"
+#include "image.h"
+#include "renderer.h"
 #include <QFileDialog>
 #include <QMainWindow>
 #include <QPainter>
 #include <QResizeEvent>
+#include <atomic>
 #include <memory>
 
 QT_BEGIN_NAMESPACE
@@ -16,7 +18,7 @@ QT_END_NAMESPACE
 
 struct TaskGroup;
 
-using Image = Pvl::UniformGrid<Pvl::Vec3f, 2>;
+using Mpcv::Image;
 
 class View : public QWidget {
 public:
@@ -27,43 +29,62 @@ public:
 
     void setTaskGroup(std::shared_ptr<TaskGroup> tg);
 
-    void setImage(Image&& image);
+    void setResolution(const Pvl::Vec2i& resolution);
+
+    void setTile(const Pvl::Vec2i& offset, const Image& tile);
+
+    /// \brief Repaints the view if any tile has been updated since the last call.
+    void updateTiles();
 
     void setExposure(int exposure);
 
-    void save();
+    void save(const QString& file);
 
 private:
     Image image_;
+    ///< Tonemapped image_, updated when tiles are rendered or the exposure changes
+    QImage display_;
     std::shared_ptr<TaskGroup> tg_;
     float exposure_ = 1.f;
+    std::atomic<bool> dirty_{ false };
 };
 
 
-class FrameBufferWidget : public QMainWindow {
+class FrameBufferWidget : public QMainWindow, public Mpcv::IRenderOutput {
     Q_OBJECT
 
 public:
     FrameBufferWidget(QWidget* parent = nullptr);
     ~FrameBufferWidget();
 
-    void setImage(Image&& image) {
-        view_->setImage(std::move(image));
+    virtual void setResolution(const Pvl::Vec2i& resolution) override {
+        view_->setResolution(resolution);
+    }
+
+    virtual void setTile(const Pvl::Vec2i& offset, const Image& tile) override {
+        view_->setTile(offset, tile);
     }
 
-    bool cancelled() const {
+    virtual bool cancelled() const override {
         return cancelled_;
     }
 
-    void setProgress(int pass, int prog);
+    virtual void setProgress(int pass, int prog) override;
 
-    void setNumIters(int numIters);
+    virtual void setNumIters(int numIters) override;
 
     void run(const std::function<void()>& func);
 
+    /// \brief Accumulation buffers of the renderer, must not be accessed while rendering.
+    Mpcv::RenderBuffers& buffers() {
+        return buffers_;
+    }
+
 private slots:
     void on_actionSave_render_triggered();
 
+    void on_actionSave_checkpoint_triggered();
+
     void on_horizontalSlider_valueChanged(int value);
 
     void on_actionClose_triggered();
@@ -78,4 +99,8 @@ private:
     int progressValue_ = 0;
     std::shared_ptr<TaskGroup> tg_;
     bool cancelled_ = false;
+    std::atomic<bool> rendering_{ false };
+    Mpcv::RenderBuffers buffers_;
+
+    bool checkRenderFinished();
 };
@@ -0,0 +1,205 @@
+#include "headless.h"
+#include "mainwindow.h"
+#include "mesh.h"
+#include <QFileInfo>
+#include <chrono>
+#include <iostream>
+
+namespace Mpcv {
+
+namespace {
+
+class ConsoleOutput : public IRenderOutput {
+    Image image_;
+    int numIters_ = 0;
+    int lastPass_ = -1;
+    int lastProg_ = -1;
+    std::chrono::steady_clock::time_point passBegin_ = std::chrono::steady_clock::now();
+
+public:
+    virtual void setNumIters(int numIters) override {
+        numIters_ = numIters;
+    }
+
+    virtual void setProgress(int pass, int prog) override {
+        if (pass == lastPass_ && prog == lastProg_) {
+            return;
+        }
+        if (pass != lastPass_ && lastPass_ >= 0) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            std::cout << "\rPass " << lastPass_ + 1 << "/" << numIters_ << " finished in "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(now - passBegin_).count()
+                      << "ms" << std::endl;
+            passBegin_ = now;
+        }
+        if (pass < numIters_) {
+            std::cout << "\rPass " << pass + 1 << "/" << numIters_ << " " << prog << "%" << std::flush;
+        }
+        lastPass_ = pass;
+        lastProg_ = prog;
+    }
+
+    virtual void setResolution(const Pvl::Vec2i& resolution) override {
+        image_ = Image(resolution);
+    }
+
+    virtual void setTile(const Pvl::Vec2i& offset, const Image& tile) override {
+        // tiles do not overlap, so they can be copied without locking
+        Pvl::Vec2i dims = tile.dimension();
+        for (int y = 0; y < dims[1]; ++y) {
+            for (int x = 0; x < dims[0]; ++x) {
+                Pvl::Vec2i pix(x, y);
+                image_(offset + pix) = tile(pix);
+            }
+        }
+    }
+
+    virtual bool cancelled() const override {
+        return false;
+    }
+
+    const Image& image() const {
+        return image_;
+    }
+};
+
+Coords parseCoords(const std::string& s) {
+    Coords p;
+    if (sscanf(s.c_str(), "%lf,%lf,%lf", &p[0], &p[1], &p[2]) != 3) {
+        throw std::runtime_error("Cannot parse coordinates '" + s + "'");
+    }
+    return p;
+}
+
+} // namespace
+
+bool parseRenderArgument(const std::string& arg, const std::string& param, HeadlessSettings& settings) {
+    if (arg == "--render") {
+        settings.output = param;
+    } else if (arg == "--camera") {
+        std::size_t sep = param.find(':');
+        if (sep == std::string::npos) {
+            throw std::runtime_error("Expected camera in format ex,ey,ez:tx,ty,tz");
+        }
+        settings.eye = parseCoords(param.substr(0, sep));
+        settings.target = parseCoords(param.substr(sep + 1));
+        settings.hasCamera = true;
+    } else if (arg == "--fov") {
+        settings.fov = std::stof(param) * M_PI / 180.f;
+    } else if (arg == "--resolution") {
+        int width, height;
+        if (sscanf(param.c_str(), "%dx%d", &width, &height) != 2) {
+            throw std::runtime_error("Expected resolution in format WIDTHxHEIGHT");
+        }
+        settings.render.resolution = Pvl::Vec2i(width, height);
+    } else if (arg == "--iters") {
+        settings.render.numIters = std::stoi(param);
+    } else if (arg == "--depth") {
+        settings.render.maxDepth = std::stoi(param);
+    } else if (arg == "--adaptive") {
+        settings.render.adaptive = true;
+        settings.render.errorThreshold = std::stof(param);
+    } else if (arg == "--sun") {
+        settings.render.dirToSun = Pvl::normalize(vec3f(parseCoords(param)));
+    } else if (arg == "--checkpoint") {
+        settings.render.checkpoint = param;
+    } else if (arg == "--exposure") {
+        settings.exposure = std::stof(param);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+int renderHeadless(const HeadlessSettings& settings, const std::vector<QString>& files) {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    std::vector<TexturedMesh> meshes;
+    for (const QString& file : files) {
+        std::cout << "Loading '" << file.toStdString() << "'" << std::endl;
+        try {
+            TexturedMesh mesh = MainWindow::loadMesh(file, [](float) { return false; });
+            if (mesh.faces.empty()) {
+                std::cout << "Skipping '" << file.toStdString() << "', only meshes can be rendered" << std::endl;
+                continue;
+            }
+            meshes.emplace_back(std::move(mesh));
+        } catch (const std::exception& e) {
+            std::cout << "Cannot open file '" << file.toStdString() << "': " << e.what() << std::endl;
+            return -1;
+        }
+    }
+    if (meshes.empty()) {
+        std::cout << "No meshes to render" << std::endl;
+        return -1;
+    }
+    std::chrono::steady_clock::time_point loaded = std::chrono::steady_clock::now();
+
+    const Srs srs = meshes.front().srs;
+    Pvl::Vec3f eye, target, up;
+    if (settings.hasCamera) {
+        eye = vec3f(srs.worldToLocal(settings.eye));
+        target = vec3f(srs.worldToLocal(settings.target));
+        up = Pvl::Vec3f(0, 0, 1);
+        if (Pvl::norm(Pvl::crossProd(up, Pvl::normalize(target - eye))) < 1.e-6f) {
+            up = Pvl::Vec3f(0, 1, 0);
+        }
+    } else {
+        // same as the default camera of the viewer
+        Pvl::Box3f box;
+        for (const Pvl::Vec3f& p : meshes.front().vertices) {
+            box.extend(p);
+        }
+        const float scale = std::max(box.size()[0], box.size()[1]);
+        target = box.center();
+        eye = target + Pvl::Vec3f(0, 0, std::max(1.5f * scale, 0.001f));
+        up = Pvl::Vec3f(0, 1, 0);
+    }
+
+    RenderSettings renderSettings = settings.render;
+    RenderBuffers buffers;
+    const std::string& checkpoint = renderSettings.checkpoint;
+    if (!checkpoint.empty() && QFileInfo::exists(QString::fromStdString(checkpoint))) {
+        try {
+            buffers = loadCheckpoint(checkpoint);
+        } catch (const std::exception& e) {
+            std::cout << e.what() << std::endl;
+            return -1;
+        }
+        // the checkpoint is only valid for its resolution, continue with it instead of starting over
+        const Pvl::Vec2i resolution = buffers.color.dimension();
+        if (resolution[0] != renderSettings.resolution[0] || resolution[1] != renderSettings.resolution[1]) {
+            std::cout << "Using resolution " << resolution[0] << "x" << resolution[1] << " of the checkpoint"
+                      << std::endl;
+            renderSettings.resolution = resolution;
+        }
+    }
+    Camera camera(eye, target, up, settings.fov, srs, renderSettings.resolution);
+
+    std::vector<TexturedMesh*> meshesToRender;
+    for (TexturedMesh& mesh : meshes) {
+        meshesToRender.push_back(&mesh);
+    }
+    ConsoleOutput output;
+    renderMeshes(&output, buffers, meshesToRender, camera, renderSettings);
+    std::chrono::steady_clock::time_point rendered = std::chrono::steady_clock::now();
+
+    try {
+        const QString ext = QFileInfo(QString::fromStdString(settings.output)).suffix().toLower();
+        if (ext == "exr" || ext == "pfm") {
+            saveRenderBuffers(settings.output, buffers);
+        } else {
+            saveImage(settings.output, output.image(), std::pow(2.f, settings.exposure));
+        }
+    } catch (const std::exception& e) {
+        std::cout << e.what() << std::endl;
+        return -1;
+    }
+    std::cout << "Saved render to '" << settings.output << "'" << std::endl;
+    std::cout << "Loading took " << std::chrono::duration_cast<std::chrono::milliseconds>(loaded - begin).count()
+              << "ms, rendering took "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(rendered - loaded).count() << "ms"
+              << std::endl;
+    return 0;
+}
+
+} // namespace Mpcv
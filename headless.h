@@ -0,0 +1,40 @@
+#pragma once
+
+#include "coordinates.h"
+#include "renderer.h"
+#include <QString>
+#include <string>
+#include <vector>
+
+namespace Mpcv {
+
+struct HeadlessSettings {
+    ///< Output image; EXR files contain radiance, normals, variance and sample counts, PFM files radiance
+    std::string output;
+
+    ///< Camera position and target in world coordinates, used if hasCamera is true; otherwise the camera
+    ///< looks down at the first mesh
+    bool hasCamera = false;
+    Coords eye;
+    Coords target;
+
+    ///< Vertical field of view in radians
+    float fov = M_PI / 4.f;
+
+    ///< Exposure in stops, used for tonemapped outputs
+    float exposure = 0.f;
+
+    RenderSettings render;
+};
+
+/// \brief Parses a command-line argument of the headless renderer.
+///
+/// Returns false if the argument is not related to rendering.
+bool parseRenderArgument(const std::string& arg, const std::string& param, HeadlessSettings& settings);
+
+/// \brief Renders given files without creating any window or OpenGL context.
+///
+/// Returns the exit code of the application.
+int renderHeadless(const HeadlessSettings& settings, const std::vector<QString>& files);
+
+} // namespace Mpcv
@@ -0,0 +1,225 @@
+#include "image.h"
+#include <QFileInfo>
+#include <algorithm>
+#include <fstream>
+#include <tbb/tbb.h>
+
+namespace Mpcv {
+
+inline float aces(const float v0) {
+    float v = 0.6f * v0;
+    float a = 2.51f;
+    float b = 0.03f;
+    float c = 2.43f;
+    float d = 0.59f;
+    float e = 0.14f;
+    return (v * (a * v + b)) / (v * (c * v + d) + e);
+}
+
+namespace {
+
+// gamma correction of the tonemapped values, replaces std::pow for each channel
+constexpr int GAMMA_LUT_SIZE = 1 << 16;
+
+const std::vector<uint8_t>& gammaLut() {
+    static const std::vector<uint8_t> lut = [] {
+        std::vector<uint8_t> values(GAMMA_LUT_SIZE);
+        for (int i = 0; i < GAMMA_LUT_SIZE; ++i) {
+            values[i] = uint8_t(std::pow(float(i) / (GAMMA_LUT_SIZE - 1), 1.f / 2.2f) * 255.f);
+        }
+        return values;
+    }();
+    return lut;
+}
+
+inline uint8_t toneMapChannel(const uint8_t* lut, const float value) {
+    // float compressed = 5.f * value / (5.f + value);
+    // aces of infinity is NaN and the curve is not monotonic for negative values; it is already saturated
+    // for values much lower than the upper limit
+    float compressed = aces(std::max(std::min(value, 1.e6f), 0.f));
+    if (!(compressed >= 0.f)) {
+        // NaN would index the table out of bounds
+        compressed = 0.f;
+    }
+    float clamped = std::min(compressed, 1.f);
+    return lut[int(clamped * (GAMMA_LUT_SIZE - 1) + 0.5f)];
+}
+
+} // namespace
+
+Color colormap(const Pvl::Vec3f& color, float exposure) {
+    const uint8_t* lut = gammaLut().data();
+    Color result;
+    for (int c = 0; c < 3; ++c) {
+        result[c] = toneMapChannel(lut, exposure * color[c]);
+    }
+    return result;
+}
+
+void toneMap(const Image& source, const float exposure, QImage& target, const Pvl::Vec2i& offset) {
+    PVL_ASSERT(target.format() == QImage::Format_RGB888);
+    const Pvl::Vec2i dims = source.dimension();
+    const uint8_t* lut = gammaLut().data();
+    // bits() detaches the image, so it is called only once outside the parallel loop
+    uint8_t* bits = target.bits();
+    const std::size_t bytesPerLine = target.bytesPerLine();
+    auto toneMapRows = [&](const tbb::blocked_range<int>& range) {
+        for (int y = range.begin(); y < range.end(); ++y) {
+            uint8_t* line = bits + (offset[1] + y) * bytesPerLine + 3 * offset[0];
+            for (int x = 0; x < dims[0]; ++x) {
+                const Pvl::Vec3f& color = source(Pvl::Vec2i(x, y));
+                line[3 * x + 0] = toneMapChannel(lut, exposure * color[0]);
+                line[3 * x + 1] = toneMapChannel(lut, exposure * color[1]);
+                line[3 * x + 2] = toneMapChannel(lut, exposure * color[2]);
+            }
+        }
+    };
+    if (dims[0] * dims[1] < (1 << 16)) {
+        toneMapRows(tbb::blocked_range<int>(0, dims[1]));
+    } else {
+        tbb::parallel_for(tbb::blocked_range<int>(0, dims[1], 16), toneMapRows);
+    }
+}
+
+QImage toQImage(const Image& source, float exposure) {
+    Pvl::Vec2i dims = source.dimension();
+    QImage image(dims[0], dims[1], QImage::Format_RGB888);
+    toneMap(source, exposure, image);
+    return image;
+}
+
+namespace {
+
+// all values are written as little-endian, same as the host
+template <typename T>
+void write(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void writeString(std::ostream& out, const std::string& s) {
+    out.write(s.c_str(), s.size() + 1); // including the terminating zero
+}
+
+void writeAttribute(std::ostream& out, const std::string& name, const std::string& type, int32_t size) {
+    writeString(out, name);
+    writeString(out, type);
+    write(out, size);
+}
+
+} // namespace
+
+void saveExr(const std::string& file, const Pvl::Vec2i& size, std::vector<ImageChannel> channels) {
+    std::ofstream out(file, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Cannot write image '" + file + "'");
+    }
+    // channels must be sorted by name
+    std::sort(channels.begin(), channels.end(), [](const ImageChannel& c1, const ImageChannel& c2) {
+        return c1.name < c2.name;
+    });
+
+    write(out, int32_t(20000630)); // magic number
+    write(out, int32_t(2));        // version 2, single-part scanline file
+
+    int32_t channelsSize = 1;
+    for (const ImageChannel& channel : channels) {
+        channelsSize += channel.name.size() + 1 + 16;
+    }
+    writeAttribute(out, "channels", "chlist", channelsSize);
+    for (const ImageChannel& channel : channels) {
+        writeString(out, channel.name);
+        write(out, int32_t(2)); // FLOAT
+        write(out, int32_t(0)); // pLinear + reserved
+        write(out, int32_t(1)); // x sampling
+        write(out, int32_t(1)); // y sampling
+    }
+    write(out, uint8_t(0));
+
+    writeAttribute(out, "compression", "compression", 1);
+    write(out, uint8_t(0)); // NO_COMPRESSION
+    for (std::string window : { "dataWindow", "displayWindow" }) {
+        writeAttribute(out, window, "box2i", 16);
+        write(out, int32_t(0));
+        write(out, int32_t(0));
+        write(out, int32_t(size[0] - 1));
+        write(out, int32_t(size[1] - 1));
+    }
+    writeAttribute(out, "lineOrder", "lineOrder", 1);
+    write(out, uint8_t(0)); // INCREASING_Y
+    writeAttribute(out, "pixelAspectRatio", "float", 4);
+    write(out, 1.f);
+    writeAttribute(out, "screenWindowCenter", "v2f", 8);
+    write(out, 0.f);
+    write(out, 0.f);
+    writeAttribute(out, "screenWindowWidth", "float", 4);
+    write(out, 1.f);
+    write(out, uint8_t(0)); // end of header
+
+    // offset table, each uncompressed chunk contains a single scanline
+    const int32_t lineSize = int32_t(channels.size() * size[0] * sizeof(float));
+    const uint64_t tableEnd = uint64_t(out.tellp()) + size[1] * sizeof(uint64_t);
+    for (int y = 0; y < size[1]; ++y) {
+        write(out, tableEnd + uint64_t(y) * (lineSize + 2 * sizeof(int32_t)));
+    }
+
+    std::vector<float> line(size[0]);
+    for (int y = 0; y < size[1]; ++y) {
+        write(out, int32_t(y));
+        write(out, lineSize);
+        for (const ImageChannel& channel : channels) {
+            const float* row = channel.data + std::size_t(y) * size[0] * channel.stride;
+            for (int x = 0; x < size[0]; ++x) {
+                line[x] = row[x * channel.stride];
+            }
+            out.write(reinterpret_cast<const char*>(line.data()), line.size() * sizeof(float));
+        }
+    }
+    if (!out) {
+        throw std::runtime_error("Cannot write image '" + file + "'");
+    }
+}
+
+void savePfm(const std::string& file, const Image& image) {
+    std::ofstream out(file, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Cannot write image '" + file + "'");
+    }
+    Pvl::Vec2i dims = image.dimension();
+    // negative scale denotes little-endian data
+    out << "PF\n" << dims[0] << " " << dims[1] << "\n-1.0\n";
+    // rows are stored from bottom to top
+    std::vector<float> line(3 * dims[0]);
+    for (int y = dims[1] - 1; y >= 0; --y) {
+        for (int x = 0; x < dims[0]; ++x) {
+            const Pvl::Vec3f& color = image(Pvl::Vec2i(x, y));
+            for (int c = 0; c < 3; ++c) {
+                line[3 * x + c] = color[c];
+            }
+        }
+        out.write(reinterpret_cast<const char*>(line.data()), line.size() * sizeof(float));
+    }
+    if (!out) {
+        throw std::runtime_error("Cannot write image '" + file + "'");
+    }
+}
+
+void saveImage(const std::string& file, const Image& image, float exposure) {
+    QString ext = QFileInfo(QString::fromStdString(file)).suffix().toLower();
+    if (ext == "exr") {
+        const float* data = reinterpret_cast<const float*>(image.data());
+        const int stride = sizeof(Pvl::Vec3f) / sizeof(float);
+        saveExr(file,
+            image.dimension(),
+            {
+                ImageChannel{ "R", data, stride },
+                ImageChannel{ "G", data + 1, stride },
+                ImageChannel{ "B", data + 2, stride },
+            });
+    } else if (ext == "pfm") {
+        savePfm(file, image);
+    } else if (!toQImage(image, exposure).save(QString::fromStdString(file))) {
+        throw std::runtime_error("Cannot write image '" + file + "'");
+    }
+}
+
+} // namespace Mpcv
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "mesh.h"
+#include "pvl/UniformGrid.hpp"
+#include <QImage>
+#include <string>
+#include <vector>
+
+namespace Mpcv {
+
+using Image = Pvl::UniformGrid<Pvl::Vec3f, 2>;
+
+/// \brief Converts the linear radiance to a displayable color using ACES tonemapping and gamma correction.
+Color colormap(const Pvl::Vec3f& color, float exposure);
+
+/// \brief Tonemaps the image and writes it into the target at given offset.
+///
+/// Large images are processed in parallel, small ones (like render tiles) in the calling thread. The target
+/// must have RGB888 format and must not be accessed concurrently.
+void toneMap(const Image& source, float exposure, QImage& target, const Pvl::Vec2i& offset = Pvl::Vec2i(0, 0));
+
+/// \brief Returns the tonemapped image.
+QImage toQImage(const Image& image, float exposure);
+
+struct ImageChannel {
+    std::string name;
+
+    /// Value of the first pixel
+    const float* data;
+
+    /// Distance between values of consecutive pixels (in floats)
+    int stride;
+};
+
+/// \brief Saves given float channels into an uncompressed OpenEXR file.
+///
+/// Rows are stored in the order of increasing y, i.e. the first row is the top of the image.
+void saveExr(const std::string& file, const Pvl::Vec2i& size, std::vector<ImageChannel> channels);
+
+/// \brief Saves the radiance into a portable float map.
+void savePfm(const std::string& file, const Image& image);
+
+/// \brief Saves the image, the format is deduced from the extension.
+///
+/// EXR and PFM files contain raw radiance, other formats are tonemapped using given exposure.
+void saveImage(const std::string& file, const Image& image, float exposure = 1.f);
+
+} // namespace Mpcv
@@ -0,0 +1,202 @@
+#include "kdtree.h"
+#include <algorithm>
+#include <tbb/tbb.h>
+
+namespace Mpcv {
+
+void KdTree::build(const Pvl::Vec3f* points, std::size_t count) {
+    points_ = points;
+    count_ = count;
+    indices_.clear();
+    nodes_.clear();
+    if (count_ == 0) {
+        return;
+    }
+    PVL_ASSERT(count_ < std::numeric_limits<uint32_t>::max());
+
+    // the tree is balanced, so the number of levels is known in advance
+    depth_ = 0;
+    while ((count_ >> depth_) > leafSize_) {
+        ++depth_;
+    }
+    nodes_.resize((std::size_t(2) << depth_) - 1);
+
+    indices_.resize(count_);
+    tbb::parallel_for(std::size_t(0), count_, [this](std::size_t i) { indices_[i] = uint32_t(i); });
+
+    buildNode(0, 0, 0, uint32_t(count_));
+}
+
+void KdTree::buildNode(uint32_t nodeIdx, int depth, uint32_t start, uint32_t end) {
+    Node& node = nodes_[nodeIdx];
+    node.start = start;
+    node.end = end;
+    node.box = Pvl::Box3f();
+    for (uint32_t i = start; i < end; ++i) {
+        node.box.extend(points_[indices_[i]]);
+    }
+    if (depth == depth_) {
+        return;
+    }
+
+    const int splitDim = argMax(node.box.size());
+    const uint32_t mid = start + (end - start) / 2;
+    std::nth_element(indices_.begin() + start,
+        indices_.begin() + mid,
+        indices_.begin() + end,
+        [this, splitDim](uint32_t i1, uint32_t i2) { return points_[i1][splitDim] < points_[i2][splitDim]; });
+
+    auto left = [=] { buildNode(2 * nodeIdx + 1, depth + 1, start, mid); };
+    auto right = [=] { buildNode(2 * nodeIdx + 2, depth + 1, mid, end); };
+    if (end - start > (1 << 16)) {
+        tbb::parallel_invoke(left, right);
+    } else {
+        left();
+        right();
+    }
+}
+
+bool KdTree::pick(const Ray& ray, const float tanRadius, uint32_t& index, float& t) const {
+    if (nodes_.empty()) {
+        return false;
+    }
+    const Pvl::Vec3f& origin = ray.origin();
+    const Pvl::Vec3f& dir = ray.direction();
+
+    struct Entry {
+        uint32_t idx;
+        float t_min;
+    };
+    std::array<Entry, 64> stack;
+    int stackIdx = 0;
+    stack[0] = Entry{ 0, 0.f };
+
+    float t_best = std::numeric_limits<float>::max();
+    bool found = false;
+    // enlarges the box by the radius of the cone at the far end of the box and intersects it with the ray
+    auto hitNode = [&](uint32_t idx, float& t_enter) {
+        const Pvl::Box3f& box = nodes_[idx].box;
+        const float halfDiag = 0.5f * Pvl::norm(box.size());
+        const float t_far = Pvl::norm(box.center() - origin) + halfDiag;
+        const Pvl::Vec3f r(tanRadius * t_far);
+        float t_exit;
+        return intersectBox(Pvl::Box3f(box.lower() - r, box.upper() + r), ray, t_enter, t_exit) && t_exit > 0;
+    };
+
+    float t_root;
+    if (!hitNode(0, t_root)) {
+        return false;
+    }
+    while (stackIdx >= 0) {
+        const Entry entry = stack[stackIdx--];
+        if (entry.t_min > t_best) {
+            continue;
+        }
+        const Node& node = nodes_[entry.idx];
+        if (isLeaf(entry.idx)) {
+            for (uint32_t i = node.start; i < node.end; ++i) {
+                const uint32_t pi = indices_[i];
+                const Pvl::Vec3f dr = points_[pi] - origin;
+                const float proj = Pvl::dotProd(dr, dir);
+                if (proj <= 0.f || proj >= t_best) {
+                    continue;
+                }
+                const float dist = Pvl::norm(dr - dir * proj);
+                if (dist <= tanRadius * proj) {
+                    t_best = proj;
+                    index = pi;
+                    found = true;
+                }
+            }
+        } else {
+            uint32_t closer = 2 * entry.idx + 1;
+            uint32_t other = 2 * entry.idx + 2;
+            float t_closer, t_other;
+            bool hitCloser = hitNode(closer, t_closer);
+            bool hitOther = hitNode(other, t_other);
+            if (hitCloser && hitOther && t_other < t_closer) {
+                std::swap(closer, other);
+                std::swap(t_closer, t_other);
+            }
+            // push the farther child first, so that the closer one is processed first
+            if (hitOther) {
+                stack[++stackIdx] = Entry{ other, t_other };
+            }
+            if (hitCloser) {
+                stack[++stackIdx] = Entry{ closer, t_closer };
+            }
+        }
+    }
+    if (found) {
+        t = t_best;
+    }
+    return found;
+}
+
+void KdTree::kNearest(const Pvl::Vec3f& point, const uint32_t k, std::vector<Neighbor>& neighs) const {
+    neighs.clear();
+    if (nodes_.empty() || k == 0) {
+        return;
+    }
+    auto boxDistSqr = [&point](const Pvl::Box3f& box) {
+        float distSqr = 0.f;
+        for (int i = 0; i < 3; ++i) {
+            const float d = std::max(std::max(box.lower()[i] - point[i], point[i] - box.upper()[i]), 0.f);
+            distSqr += d * d;
+        }
+        return distSqr;
+    };
+    // max-heap, the farthest of the current neighbors is on top
+    auto farther = [](const Neighbor& n1, const Neighbor& n2) { return n1.distSqr < n2.distSqr; };
+
+    struct Entry {
+        uint32_t idx;
+        float distSqr;
+    };
+    std::array<Entry, 64> stack;
+    int stackIdx = 0;
+    stack[0] = Entry{ 0, boxDistSqr(nodes_[0].box) };
+    float worst = std::numeric_limits<float>::max();
+    while (stackIdx >= 0) {
+        const Entry entry = stack[stackIdx--];
+        if (entry.distSqr >= worst) {
+            continue;
+        }
+        const Node& node = nodes_[entry.idx];
+        if (isLeaf(entry.idx)) {
+            for (uint32_t i = node.start; i < node.end; ++i) {
+                const uint32_t pi = indices_[i];
+                const float distSqr = Pvl::normSqr(points_[pi] - point);
+                if (neighs.size() < k) {
+                    neighs.push_back(Neighbor{ pi, distSqr });
+                    std::push_heap(neighs.begin(), neighs.end(), farther);
+                } else if (distSqr < neighs.front().distSqr) {
+                    std::pop_heap(neighs.begin(), neighs.end(), farther);
+                    neighs.back() = Neighbor{ pi, distSqr };
+                    std::push_heap(neighs.begin(), neighs.end(), farther);
+                }
+                if (neighs.size() == k) {
+                    worst = neighs.front().distSqr;
+                }
+            }
+        } else {
+            uint32_t closer = 2 * entry.idx + 1;
+            uint32_t other = 2 * entry.idx + 2;
+            float distCloser = boxDistSqr(nodes_[closer].box);
+            float distOther = boxDistSqr(nodes_[other].box);
+            if (distOther < distCloser) {
+                std::swap(closer, other);
+                std::swap(distCloser, distOther);
+            }
+            if (distOther < worst) {
+                stack[++stackIdx] = Entry{ other, distOther };
+            }
+            if (distCloser < worst) {
+                stack[++stackIdx] = Entry{ closer, distCloser };
+            }
+        }
+    }
+    std::sort_heap(neighs.begin(), neighs.end(), farther);
+}
+
+} // namespace Mpcv
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "bvh.h"
+#include "pvl/Box.hpp"
+#include <cstdint>
+#include <vector>
+
+namespace Mpcv {
+
+/// \brief Balanced kd-tree over a set of points.
+///
+/// The tree does not copy the points, it only stores their permutation; the point array must therefore
+/// outlive the tree and must not be reallocated while the tree is in use.
+class KdTree {
+    struct Node {
+        Pvl::Box3f box;
+        uint32_t start;
+        uint32_t end;
+    };
+
+    const Pvl::Vec3f* points_ = nullptr;
+    std::size_t count_ = 0;
+    uint32_t leafSize_;
+    int depth_ = 0;
+
+    /// Permutation of point indices, points of each leaf are stored contiguously.
+    std::vector<uint32_t> indices_;
+
+    /// Nodes in implicit layout, children of node i are 2i+1 and 2i+2.
+    std::vector<Node> nodes_;
+
+public:
+    struct Neighbor {
+        ///< Index of the point (in the original array)
+        uint32_t index;
+
+        ///< Squared distance to the query point
+        float distSqr;
+    };
+
+    explicit KdTree(const uint32_t leafSize = 16)
+        : leafSize_(leafSize) {}
+
+    /// \brief Builds the tree for given points.
+    void build(const Pvl::Vec3f* points, std::size_t count);
+
+    bool empty() const {
+        return nodes_.empty();
+    }
+
+    /// \brief Finds the point closest to the ray origin among points inside a cone around the ray.
+    ///
+    /// \param ray Picking ray (direction must be normalized).
+    /// \param tanRadius Tangent of the half-angle of the cone, i.e. the screen-space picking radius.
+    /// \param index Index of the picked point (in the original array).
+    /// \param t Distance of the picked point along the ray.
+    bool pick(const Ray& ray, float tanRadius, uint32_t& index, float& t) const;
+
+    /// \brief Finds k points closest to given point, including the point itself if it is in the tree.
+    ///
+    /// Neighbors are sorted by their distance. The vector is cleared first; passing the same vector to repeated
+    /// queries avoids reallocations.
+    void kNearest(const Pvl::Vec3f& point, uint32_t k, std::vector<Neighbor>& neighs) const;
+
+private:
+    void buildNode(uint32_t nodeIdx, int depth, uint32_t start, uint32_t end);
+
+    bool isLeaf(uint32_t nodeIdx) const {
+        return 2 * nodeIdx + 1 >= nodes_.size();
+    }
+};
+
+} // namespace Mpcv
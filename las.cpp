@@ -6,7 +6,7 @@
 
 namespace Mpcv {
 
-TexturedMesh loadLas(std::string file, const Progress& prog) {
+TexturedMesh loadLas(std::string file, const Progress& prog, const LasAttributes& attributes) {
     LASreadOpener lasreadopener;
     lasreadopener.set_file_name(file.c_str());
     // lasreadopener.set_auto_reoffset(true);
@@ -54,67 +54,108 @@ TexturedMesh loadLas(std::string file, const Progress& prog) {
         }
     }
 
-    int i = 0;
-    int step = std::max(lasreader->npoints / 100, I64(100));
-    int nextProg = step;
-    float iToProg = 100.f / lasreader->npoints;
-    const int capacity = lasreader->npoints / stride;
-    mesh.vertices.reserve(capacity);
-    mesh.colors.reserve(capacity);
-    mesh.classes.reserve(capacity);
-    mesh.times.reserve(lasreader->npoints);
-    std::vector<uint8_t> extendedClasses;
-    extendedClasses.reserve(capacity);
-    bool hasColors = false;
-    bool hasClasses = false;
-    bool hasExtendedClasses = false;
-    while (lasreader->read_point()) {
-        const LASpoint& p = lasreader->point;
-        Coords coords(p.get_x(), p.get_y(), p.get_z());
-        Coords local = mesh.srs.worldToLocal(coords);
+    // exact size if no points are clipped, otherwise grow and shrink at the end
+    const bool clipped =
+        !globals.extents.contains(extents.lower()) || !globals.extents.contains(extents.upper());
+    const std::size_t capacity = clipped ? 0 : (lasreader->npoints + stride - 1) / stride;
+    const LASpoint& p = lasreader->point;
+    const bool loadColors = attributes.colors && p.have_rgb;
+    const bool loadClasses = attributes.classes;
+    const bool loadTimes = attributes.times && p.have_gps_time;
+    if (attributes.positions) {
+        mesh.vertices.reserve(capacity);
+    }
+    if (loadTimes) {
+        mesh.times.reserve(capacity);
+    }
 
-        Color color(p.get_R() >> 8, p.get_G() >> 8, p.get_B() >> 8);
-        uint8_t classIdx = p.get_classification();
-        uint8_t extClassIdx =
-            (p.is_extended_point_type()) ? p.get_extended_classification() : 0;
-        if ((i % stride == 0) && globals.extents.contains(coords)) {
-            mesh.vertices.push_back(vec3f(local));
+    // colors and classes are stored from the first non-zero value, preceding points are filled with zeros
+    auto pushColor = [&mesh, capacity](const std::size_t index, const Color& color) {
+        if (!mesh.colors.empty()) {
+            mesh.colors.push_back(color);
+        } else if (color != Color(0, 0, 0)) {
+            mesh.colors.reserve(std::max(capacity, index + 1));
+            mesh.colors.resize(index, Color(0, 0, 0));
             mesh.colors.push_back(color);
+        }
+    };
+    auto pushClass = [&mesh, capacity](const std::size_t index, const uint8_t classIdx) {
+        if (!mesh.classes.empty()) {
             mesh.classes.push_back(classIdx);
-            mesh.times.push_back(p.get_gps_time());
-            extendedClasses.push_back(extClassIdx);
+        } else if (classIdx != 0) {
+            mesh.classes.reserve(std::max(capacity, index + 1));
+            mesh.classes.resize(index, 0);
+            mesh.classes.push_back(classIdx);
+        }
+    };
+
+    I64 i = 0;
+    std::size_t count = 0;
+    const I64 step = std::max(lasreader->npoints / 100, I64(100));
+    I64 nextProg = step;
+    const float iToProg = 100.f / lasreader->npoints;
+    bool cancelled = false;
+    while (lasreader->read_point()) {
+        Coords coords(p.get_x(), p.get_y(), p.get_z());
+        if ((i % stride == 0) && globals.extents.contains(coords)) {
+            if (attributes.positions) {
+                mesh.vertices.push_back(vec3f(mesh.srs.worldToLocal(coords)));
+            }
+            if (loadColors) {
+                pushColor(count, Color(p.get_R() >> 8, p.get_G() >> 8, p.get_B() >> 8));
+            }
+            if (loadClasses) {
+                // classes above 31 are only stored in the extended classification
+                uint8_t classIdx = p.get_classification();
+                if (classIdx == 0 && p.is_extended_point_type()) {
+                    classIdx = p.get_extended_classification();
+                }
+                pushClass(count, classIdx);
+            }
+            if (loadTimes) {
+                mesh.times.push_back(p.get_gps_time());
+            }
+            ++count;
         }
-        hasColors |= (color != Color(0, 0, 0));
-        hasClasses |= (classIdx != 0);
-        hasExtendedClasses |= (extClassIdx != 0);
 
         i++;
         if (i == nextProg) {
             if (prog(i * iToProg)) {
-                return {}; // Pvl::NONE;
+                cancelled = true;
+                break;
             }
             nextProg += step;
         }
     }
-    mesh.vertices.shrink_to_fit();
-    mesh.classes.shrink_to_fit();
-    mesh.times.shrink_to_fit();
-    if (hasColors) {
-        mesh.colors.shrink_to_fit();
-    } else {
-        mesh.colors = {};
+    lasreader->close();
+    delete lasreader;
+    if (cancelled) {
+        return {};
     }
-    if (hasExtendedClasses && !hasClasses) {
-        std::cout << "Using extended point classifications" << std::endl;
-        // replace with extended classifications
-        mesh.classes = std::move(extendedClasses);
+
+    if (clipped) {
+        mesh.vertices.shrink_to_fit();
+        mesh.times.shrink_to_fit();
     }
-    std::cout << "Loaded " << i << " out of " << lasreader->npoints << " points" << std::endl;
+    mesh.colors.shrink_to_fit();
+    mesh.classes.shrink_to_fit();
 
-    lasreader->close();
-    delete lasreader;
+    std::cout << "Loaded " << count << " out of " << i << " points" << std::endl;
+    auto megabytes = [](const auto& column) {
+        using T = typename std::decay_t<decltype(column)>::value_type;
+        return double(column.size() * sizeof(T)) / (1 << 20);
+    };
+    std::cout << "Point attributes: positions " << megabytes(mesh.vertices) << " MB, colors "
+              << megabytes(mesh.colors) << " MB, classes " << megabytes(mesh.classes) << " MB, times "
+              << megabytes(mesh.times) << " MB" << std::endl;
     return mesh;
 }
 
+Column<double> loadLasTimes(const std::string& file, const Progress& prog) {
+    LasAttributes attributes;
+    attributes.positions = attributes.colors = attributes.classes = false;
+    attributes.times = true;
+    return std::move(loadLas(file, prog, attributes).times);
+}
 
 } // namespace Mpcv
@@ -4,6 +4,25 @@
 
 namespace Mpcv {
 
-TexturedMesh loadLas(std::string file, const Progress& prog);
+/// \brief Point attributes loaded from LAS files.
+struct LasAttributes {
+    bool positions = true;
+    bool colors = true;
+    bool classes = true;
+
+    ///< GPS times are only needed to estimate normals from a trajectory, see \ref loadLasTimes
+    bool times = false;
+};
+
+/// \brief Loads the points of a LAS/LAZ file within the global extents, taking every n-th point.
+///
+/// Colors and classes are only stored if the point format has them and at least one point has a non-zero
+/// value, otherwise the columns are left empty.
+TexturedMesh loadLas(std::string file, const Progress& prog, const LasAttributes& attributes = {});
+
+/// \brief Loads GPS times of the points loaded by \ref loadLas with the same global parameters.
+///
+/// \return Times of the points, or empty column if cancelled or the point format has no GPS times.
+Column<double> loadLasTimes(const std::string& file, const Progress& prog);
 
 }
@@ -0,0 +1,404 @@
+#include "lod.h"
+#include "decimation.h"
+#include "pvl/Box.hpp"
+#include "pvl/Utils.hpp"
+#include <iostream>
+#include <numeric>
+#include <tbb/tbb.h>
+
+namespace Mpcv {
+
+namespace {
+
+constexpr float INF = std::numeric_limits<float>::infinity();
+
+/// Splits the items at the median of their centers along the largest extent, until each part has at most
+/// maxSize items.
+void splitMedian(std::vector<uint32_t>& items,
+                 const std::vector<Pvl::Vec3f>& centers,
+                 const uint32_t first,
+                 const uint32_t last,
+                 const std::size_t maxSize,
+                 std::vector<FaceRange>& parts,
+                 tbb::mutex& mutex) {
+    if (last - first <= maxSize) {
+        tbb::mutex::scoped_lock lock(mutex);
+        parts.push_back(FaceRange{ first, last - first });
+        return;
+    }
+    Pvl::Box3f box;
+    for (uint32_t i = first; i < last; ++i) {
+        box.extend(centers[items[i]]);
+    }
+    const int splitDim = argMax(box.size());
+    const uint32_t mid = first + (last - first) / 2;
+    std::nth_element(items.begin() + first,
+        items.begin() + mid,
+        items.begin() + last,
+        [&centers, splitDim](uint32_t i1, uint32_t i2) {
+            return centers[i1][splitDim] < centers[i2][splitDim];
+        });
+
+    auto left = [&] { splitMedian(items, centers, first, mid, maxSize, parts, mutex); };
+    auto right = [&] { splitMedian(items, centers, mid, last, maxSize, parts, mutex); };
+    if (last - first > (1 << 16)) {
+        tbb::parallel_invoke(left, right);
+    } else {
+        left();
+        right();
+    }
+}
+
+/// Partitions the items into parts of at most maxSize items, ordered by their first item
+std::vector<FaceRange> partition(std::vector<uint32_t>& items,
+                                 const std::vector<Pvl::Vec3f>& centers,
+                                 const std::size_t maxSize) {
+    std::vector<FaceRange> parts;
+    tbb::mutex mutex;
+    splitMedian(items, centers, 0, uint32_t(items.size()), maxSize, parts, mutex);
+    std::sort(parts.begin(), parts.end(), [](const FaceRange& r1, const FaceRange& r2) {
+        return r1.first < r2.first;
+    });
+    return parts;
+}
+
+BoundingSphere boundingSphere(const std::vector<Pvl::Vec3f>& points) {
+    Pvl::Box3f box;
+    for (const Pvl::Vec3f& p : points) {
+        box.extend(p);
+    }
+    BoundingSphere sphere{ box.center(), 0.f };
+    for (const Pvl::Vec3f& p : points) {
+        sphere.radius = std::max(sphere.radius, Pvl::norm(p - sphere.center));
+    }
+    return sphere;
+}
+
+/// Returns a sphere enclosing all given spheres
+BoundingSphere boundingSphere(const std::vector<BoundingSphere>& spheres) {
+    Pvl::Box3f box;
+    for (const BoundingSphere& s : spheres) {
+        box.extend(s.center - Pvl::Vec3f(s.radius));
+        box.extend(s.center + Pvl::Vec3f(s.radius));
+    }
+    BoundingSphere sphere{ box.center(), 0.f };
+    for (const BoundingSphere& s : spheres) {
+        sphere.radius = std::max(sphere.radius, Pvl::norm(s.center - sphere.center) + s.radius);
+    }
+    return sphere;
+}
+
+BoundingSphere boundingSphere(const TexturedMesh& mesh, const LodHierarchy& lod, const FaceRange& range) {
+    std::vector<Pvl::Vec3f> points;
+    points.reserve(3 * range.count);
+    for (uint32_t fi = range.first; fi < range.first + range.count; ++fi) {
+        for (uint32_t vi : lod.face(mesh, fi)) {
+            points.push_back(mesh.vertices[vi]);
+        }
+    }
+    return boundingSphere(points);
+}
+
+template <typename T>
+uint32_t localIndex(const std::vector<T>& sorted, const T& value) {
+    return uint32_t(std::lower_bound(sorted.begin(), sorted.end(), value) - sorted.begin());
+}
+
+struct SimplifiedGroup {
+    ///< Faces of the group after simplification, ordered by new clusters
+    std::vector<TexturedMesh::Face> faces;
+    std::vector<TexturedMesh::Face> texIds;
+
+    ///< Clusters of the simplified faces, indexed from zero
+    std::vector<FaceRange> parts;
+
+    BoundingSphere bounds;
+    float error = 0.f;
+    bool simplified = false;
+};
+
+/// Merges faces of the clusters and simplifies them to half of the faces, keeping the group boundary
+void simplifyGroup(const TexturedMesh& mesh,
+                   const LodHierarchy& lod,
+                   const uint32_t* children,
+                   const std::size_t childCnt,
+                   const std::size_t clusterFaces,
+                   SimplifiedGroup& result) {
+    const bool hasUv = !mesh.texIds.empty();
+    std::vector<BoundingSphere> spheres;
+    std::vector<TexturedMesh::Face> faces, texIds;
+    std::vector<uint32_t> vertexIds, uvIds;
+    float childError = 0.f;
+    for (std::size_t i = 0; i < childCnt; ++i) {
+        const LodCluster& cluster = lod.clusters[children[i]];
+        spheres.push_back(cluster.bounds);
+        childError = std::max(childError, cluster.error);
+        for (uint32_t fi = cluster.faces.first; fi < cluster.faces.first + cluster.faces.count; ++fi) {
+            const TexturedMesh::Face& f = lod.face(mesh, fi);
+            faces.push_back(f);
+            vertexIds.insert(vertexIds.end(), f.begin(), f.end());
+            if (hasUv) {
+                const TexturedMesh::Face& t = lod.texId(mesh, fi);
+                texIds.push_back(t);
+                uvIds.insert(uvIds.end(), t.begin(), t.end());
+            }
+        }
+    }
+    std::sort(vertexIds.begin(), vertexIds.end());
+    vertexIds.erase(std::unique(vertexIds.begin(), vertexIds.end()), vertexIds.end());
+    std::sort(uvIds.begin(), uvIds.end());
+    uvIds.erase(std::unique(uvIds.begin(), uvIds.end()), uvIds.end());
+
+    // faces outside of the group are not included, so the group boundary is a mesh boundary and stays locked
+    TexturedMesh group;
+    for (uint32_t vi : vertexIds) {
+        group.vertices.push_back(mesh.vertices[vi]);
+        if (!mesh.colors.empty()) {
+            group.colors.push_back(mesh.colors[vi]);
+        }
+    }
+    for (uint32_t ti : uvIds) {
+        group.uv.push_back(mesh.uv[ti]);
+    }
+    for (std::size_t i = 0; i < faces.size(); ++i) {
+        TexturedMesh::Face f;
+        for (int j = 0; j < 3; ++j) {
+            f[j] = localIndex(vertexIds, faces[i][j]);
+        }
+        group.faces.push_back(f);
+        if (hasUv) {
+            for (int j = 0; j < 3; ++j) {
+                f[j] = localIndex(uvIds, texIds[i][j]);
+            }
+            group.texIds.push_back(f);
+        }
+    }
+
+    DecimationSettings settings;
+    settings.targetFaces = faces.size() / 2;
+    settings.clusterFaces = faces.size();
+    settings.passes = 1;
+    float error;
+    decimate(group, settings, [](float) { return false; }, &error);
+    if (4 * group.faces.size() > 3 * faces.size()) {
+        // mostly locked, keep the clusters as roots
+        return;
+    }
+
+    std::vector<Pvl::Vec3f> centroids(group.faces.size());
+    for (std::size_t fi = 0; fi < group.faces.size(); ++fi) {
+        centroids[fi] = group.centroid(uint32_t(fi));
+    }
+    std::vector<uint32_t> order(group.faces.size());
+    std::iota(order.begin(), order.end(), 0);
+    result.parts = partition(order, centroids, clusterFaces);
+    for (uint32_t fi : order) {
+        TexturedMesh::Face f;
+        for (int j = 0; j < 3; ++j) {
+            f[j] = vertexIds[group.faces[fi][j]];
+        }
+        result.faces.push_back(f);
+        if (hasUv) {
+            for (int j = 0; j < 3; ++j) {
+                f[j] = uvIds[group.texIds[fi][j]];
+            }
+            result.texIds.push_back(f);
+        }
+    }
+    // errors of simplifications add up, this keeps the error monotonic in the hierarchy
+    result.error = childError + error;
+    result.bounds = boundingSphere(spheres);
+    result.simplified = true;
+}
+
+} // namespace
+
+std::unique_ptr<LodHierarchy> LodHierarchy::build(TexturedMesh& mesh,
+                                                  const LodSettings& settings,
+                                                  std::function<bool(float)> progress) {
+    auto lod = std::make_unique<LodHierarchy>();
+    const std::size_t numFaces = mesh.faces.size();
+    const std::size_t clusterFaces = std::max<std::size_t>(settings.clusterFaces, 16);
+    const std::size_t groupSize = std::max<std::size_t>(settings.groupSize, 2);
+    const bool hasUv = !mesh.texIds.empty();
+
+    // finest level, reorder the faces so that the clusters are contiguous
+    std::vector<Pvl::Vec3f> centroids(numFaces);
+    tbb::parallel_for(std::size_t(0), numFaces, [&](std::size_t fi) { centroids[fi] = mesh.centroid(fi); });
+    std::vector<uint32_t> order(numFaces);
+    std::iota(order.begin(), order.end(), 0);
+    std::vector<FaceRange> parts = partition(order, centroids, clusterFaces);
+    centroids = {};
+    std::vector<TexturedMesh::Face> reordered(numFaces);
+    tbb::parallel_for(std::size_t(0), numFaces, [&](std::size_t i) { reordered[i] = mesh.faces[order[i]]; });
+    std::copy(reordered.begin(), reordered.end(), mesh.faces.begin());
+    if (hasUv) {
+        tbb::parallel_for(
+            std::size_t(0), numFaces, [&](std::size_t i) { reordered[i] = mesh.texIds[order[i]]; });
+        std::copy(reordered.begin(), reordered.end(), mesh.texIds.begin());
+    }
+    reordered = {};
+    order = {};
+
+    std::vector<uint32_t> level;
+    for (const FaceRange& range : parts) {
+        LodCluster cluster;
+        cluster.faces = range;
+        cluster.bounds = boundingSphere(mesh, *lod, range);
+        cluster.error = 0.f;
+        cluster.parentBounds = cluster.bounds;
+        cluster.parentError = INF;
+        level.push_back(uint32_t(lod->clusters.size()));
+        lod->clusters.push_back(cluster);
+    }
+
+    // each level has about half of the faces of the previous one
+    auto meter = Pvl::makeProgressMeter(2 * numFaces, std::move(progress));
+    tbb::atomic<bool> cancelled = false;
+    while (level.size() > 1) {
+        std::vector<Pvl::Vec3f> centers(level.size());
+        for (std::size_t i = 0; i < level.size(); ++i) {
+            centers[i] = lod->clusters[level[i]].bounds.center;
+        }
+        std::vector<uint32_t> groupOrder(level.size());
+        std::iota(groupOrder.begin(), groupOrder.end(), 0);
+        const std::vector<FaceRange> groups = partition(groupOrder, centers, groupSize);
+        for (uint32_t& i : groupOrder) {
+            i = level[i];
+        }
+
+        std::vector<SimplifiedGroup> results(groups.size());
+        tbb::parallel_for(std::size_t(0), groups.size(), [&](std::size_t gi) {
+            if (cancelled) {
+                return;
+            }
+            const FaceRange& group = groups[gi];
+            const uint32_t* children = groupOrder.data() + group.first;
+            simplifyGroup(mesh, *lod, children, group.count, clusterFaces, results[gi]);
+            for (std::size_t i = 0; i < group.count; ++i) {
+                for (uint32_t j = 0; j < lod->clusters[children[i]].faces.count; ++j) {
+                    if (meter.inc()) {
+                        cancelled = true;
+                        return;
+                    }
+                }
+            }
+        });
+        if (cancelled) {
+            return nullptr;
+        }
+
+        std::vector<uint32_t> nextLevel;
+        for (std::size_t gi = 0; gi < groups.size(); ++gi) {
+            const SimplifiedGroup& result = results[gi];
+            if (!result.simplified) {
+                continue;
+            }
+            for (uint32_t i = groups[gi].first; i < groups[gi].first + groups[gi].count; ++i) {
+                LodCluster& child = lod->clusters[groupOrder[i]];
+                child.parentBounds = result.bounds;
+                child.parentError = result.error;
+            }
+            const uint32_t offset = uint32_t(numFaces + lod->faces.size());
+            lod->faces.insert(lod->faces.end(), result.faces.begin(), result.faces.end());
+            lod->texIds.insert(lod->texIds.end(), result.texIds.begin(), result.texIds.end());
+            for (const FaceRange& part : result.parts) {
+                LodCluster cluster;
+                cluster.faces = FaceRange{ offset + part.first, part.count };
+                cluster.bounds = result.bounds;
+                cluster.error = result.error;
+                cluster.parentBounds = result.bounds;
+                cluster.parentError = INF;
+                nextLevel.push_back(uint32_t(lod->clusters.size()));
+                lod->clusters.push_back(cluster);
+            }
+        }
+        level = std::move(nextLevel);
+    }
+    std::cout << "Built LOD hierarchy with " << lod->clusters.size() << " clusters and " << lod->faces.size()
+              << " simplified faces" << std::endl;
+    return lod;
+}
+
+float selectClusters(const std::vector<const LodHierarchy*>& lods,
+                     const std::vector<Pvl::Vec3f>& eyes,
+                     const float pixelScale,
+                     const std::size_t budget,
+                     const float minError,
+                     std::vector<std::vector<FaceRange>>& ranges) {
+    // projected errors of the clusters and their parents
+    auto project = [pixelScale](const BoundingSphere& sphere, const float error, const Pvl::Vec3f& eye) {
+        if (error == 0.f || error == INF) {
+            return error;
+        }
+        const float dist = Pvl::norm(sphere.center - eye) - sphere.radius;
+        return dist > 0.f ? error * pixelScale / dist : INF;
+    };
+    std::vector<std::vector<std::pair<float, float>>> projected(lods.size());
+    for (std::size_t i = 0; i < lods.size(); ++i) {
+        const Column<LodCluster>& clusters = lods[i]->clusters;
+        projected[i].resize(clusters.size());
+        tbb::parallel_for(std::size_t(0), clusters.size(), [&](std::size_t ci) {
+            const LodCluster& c = clusters[ci];
+            projected[i][ci] = std::make_pair(
+                project(c.bounds, c.error, eyes[i]), project(c.parentBounds, c.parentError, eyes[i]));
+        });
+    }
+
+    // the number of faces decreases with the threshold
+    auto count = [&](const float threshold) {
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < lods.size(); ++i) {
+            for (std::size_t ci = 0; ci < projected[i].size(); ++ci) {
+                if (projected[i][ci].first <= threshold && projected[i][ci].second > threshold) {
+                    total += lods[i]->clusters[ci].faces.count;
+                }
+            }
+        }
+        return total;
+    };
+    float threshold = minError;
+    if (count(threshold) > budget) {
+        float lower = threshold;
+        float upper = 2.f * threshold;
+        while (count(upper) > budget && upper < 1.e9f) {
+            lower = upper;
+            upper *= 2.f;
+        }
+        for (int iter = 0; iter < 12; ++iter) {
+            const float mid = 0.5f * (lower + upper);
+            if (count(mid) > budget) {
+                lower = mid;
+            } else {
+                upper = mid;
+            }
+        }
+        threshold = upper;
+    }
+
+    ranges.resize(lods.size());
+    for (std::size_t i = 0; i < lods.size(); ++i) {
+        ranges[i].clear();
+        for (std::size_t ci = 0; ci < projected[i].size(); ++ci) {
+            if (projected[i][ci].first <= threshold && projected[i][ci].second > threshold) {
+                ranges[i].push_back(lods[i]->clusters[ci].faces);
+            }
+        }
+        std::sort(ranges[i].begin(), ranges[i].end(), [](const FaceRange& r1, const FaceRange& r2) {
+            return r1.first < r2.first;
+        });
+        std::size_t merged = 0;
+        for (std::size_t j = 0; j < ranges[i].size(); ++j) {
+            FaceRange& last = ranges[i][merged > 0 ? merged - 1 : 0];
+            if (merged > 0 && last.first + last.count == ranges[i][j].first) {
+                last.count += ranges[i][j].count;
+            } else {
+                ranges[i][merged++] = ranges[i][j];
+            }
+        }
+        ranges[i].resize(merged);
+    }
+    return threshold;
+}
+
+} // namespace Mpcv
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "mesh.h"
+#include <functional>
+#include <memory>
+
+namespace Mpcv {
+
+struct BoundingSphere {
+    Pvl::Vec3f center;
+    float radius;
+};
+
+/// \brief Contiguous range of faces drawn together.
+struct FaceRange {
+    uint32_t first;
+    uint32_t count;
+};
+
+struct LodCluster {
+    ///< Faces of the cluster; indices past the mesh faces refer to LodHierarchy::faces
+    FaceRange faces;
+
+    ///< Bounds and error of the cluster, shared by all clusters simplified from the same group
+    BoundingSphere bounds;
+    float error;
+
+    ///< Bounds and error of the simplified group replacing this cluster, infinite error for the roots
+    BoundingSphere parentBounds;
+    float parentError;
+};
+
+struct LodSettings {
+    ///< Maximal number of faces in a cluster
+    std::size_t clusterFaces = 1024;
+
+    ///< Number of clusters merged and simplified together
+    std::size_t groupSize = 4;
+};
+
+/// \brief Multi-resolution representation of a mesh, built from clusters of faces and their simplifications.
+///
+/// Neighboring clusters are grouped, simplified to half of the faces with the group boundary locked, and
+/// the result is split into new clusters, up to a few root clusters (Nanite-style cluster DAG). A cluster is
+/// drawn if its projected error is within the threshold while the error of its parent group is not; since all
+/// clusters of a group share the same parent bounds and error, the selected clusters form a cut of the DAG
+/// with no cracks.
+/// Simplification keeps the original vertices, so all levels index the vertices of the original mesh.
+class LodHierarchy {
+public:
+    ///< Faces of the simplified levels, indexed after the mesh faces
+    Column<TexturedMesh::Face> faces;
+    Column<TexturedMesh::Face> texIds;
+
+    Column<LodCluster> clusters;
+
+    /// \brief Builds the hierarchy in parallel.
+    ///
+    /// Faces of the mesh are reordered so that the finest clusters are contiguous ranges of mesh faces.
+    /// \return Null pointer if cancelled by the progress callback.
+    static std::unique_ptr<LodHierarchy> build(TexturedMesh& mesh,
+                                               const LodSettings& settings,
+                                               std::function<bool(float)> progress);
+
+    /// \brief Returns the face with given index, either from the mesh or from the simplified levels.
+    const TexturedMesh::Face& face(const TexturedMesh& mesh, const std::size_t fi) const {
+        return fi < mesh.faces.size() ? mesh.faces[fi] : faces[fi - mesh.faces.size()];
+    }
+
+    const TexturedMesh::Face& texId(const TexturedMesh& mesh, const std::size_t fi) const {
+        return fi < mesh.texIds.size() ? mesh.texIds[fi] : texIds[fi - mesh.texIds.size()];
+    }
+};
+
+/// \brief Selects clusters of the hierarchies to draw, keeping the total number of faces within the budget.
+///
+/// The error threshold is the smallest one (but at least minError pixels) giving at most budget faces.
+/// \param eyes Camera positions in local coordinates of each mesh.
+/// \param pixelScale Size of a unit at unit distance in pixels.
+/// \param ranges Selected faces of each hierarchy; adjacent ranges are merged.
+/// \return The error threshold in pixels.
+float selectClusters(const std::vector<const LodHierarchy*>& lods,
+                     const std::vector<Pvl::Vec3f>& eyes,
+                     float pixelScale,
+                     std::size_t budget,
+                     float minError,
+                     std::vector<std::vector<FaceRange>>& ranges);
+
+} // namespace Mpcv
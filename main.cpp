@@ -1,9 +1,12 @@
+#include "headless.h"
 #include "mainwindow.h"
 #include "parameters.h"
 #include <QStyleFactory>
 #include <iostream>
+#include <sstream>
 
 #include <QApplication>
+#include <QCoreApplication>
 
 void setPalette(QApplication& a) {
     a.setStyle(QStyleFactory::create("Fusion"));
@@ -55,12 +58,80 @@ void parseArgument(const std::string& arg, const std::string& param) {
         int res = std::stoi(param);
         std::cout << "Setting DSM resolution " << res << std::endl;
         Mpcv::Parameters::global().dsmResolution = res;
+    } else if (arg == "--aoRadius") {
+        float radius = std::stof(param);
+        std::cout << "Setting ambient occlusion radius to " << radius << std::endl;
+        Mpcv::Parameters::global().aoRadius = radius;
+    } else if (arg == "--simplifyError") {
+        float error = std::stof(param);
+        std::cout << "Setting simplification error to " << error << std::endl;
+        Mpcv::Parameters::global().simplifyError = error;
+    } else if (arg == "--lodBudget") {
+        int budget = std::stoi(param);
+        std::cout << "Setting LOD budget to " << budget << " faces" << std::endl;
+        Mpcv::Parameters::global().lodBudget = budget;
+    } else if (arg == "--smoothClasses") {
+        std::vector<uint8_t> classes;
+        std::stringstream ss(param);
+        std::string token;
+        while (std::getline(ss, token, ',')) {
+            classes.push_back(uint8_t(std::stoi(token)));
+        }
+        std::cout << "Restricting smoothing to " << classes.size() << " classes" << std::endl;
+        Mpcv::Parameters::global().smoothClasses = classes;
+    } else if (arg == "--repairVoxel") {
+        float size = std::stof(param);
+        std::cout << "Setting voxel size of mesh repair to " << size << std::endl;
+        Mpcv::Parameters::global().repairVoxelSize = size;
+    } else if (arg == "--repairMemory") {
+        int memory = std::stoi(param);
+        std::cout << "Setting memory limit of mesh repair to " << memory << " MB" << std::endl;
+        Mpcv::Parameters::global().repairMemory = memory;
+    } else if (arg == "--cache") {
+        bool use = std::stoi(param) != 0;
+        std::cout << (use ? "Enabling" : "Disabling") << " mesh cache" << std::endl;
+        Mpcv::Parameters::global().useCache = use;
+    } else if (arg == "--virtualTexture") {
+        int size = std::stoi(param);
+        std::cout << "Streaming tiles of textures larger than " << size << " pixels" << std::endl;
+        Mpcv::Parameters::global().virtualTextureSize = size;
+    } else if (arg == "--textureMemory") {
+        int memory = std::stoi(param);
+        std::cout << "Setting memory of streamed texture tiles to " << memory << " MB" << std::endl;
+        Mpcv::Parameters::global().textureMemory = memory;
     } else {
         std::cout << "Unknown parameter '" << arg << "'" << std::endl;
         exit(-1);
     }
 }
 
+std::vector<QString> parseArguments(const QStringList& args, Mpcv::HeadlessSettings* render) {
+    std::vector<QString> files;
+    for (int i = 1; i < args.size(); ++i) {
+        QString arg = args.at(i);
+        if (arg.size() > 2 && arg.left(2) == "--") {
+            if (i == args.size() - 1) {
+                std::cout << "Missing parameter of '" << arg.toStdString() << "'" << std::endl;
+                exit(-1);
+            }
+            const std::string name = arg.toStdString();
+            const std::string param = args.at(i + 1).toStdString();
+            try {
+                if (!render || !Mpcv::parseRenderArgument(name, param, *render)) {
+                    parseArgument(name, param);
+                }
+            } catch (const std::exception& e) {
+                std::cout << "Invalid parameter of '" << name << "': " << e.what() << std::endl;
+                exit(-1);
+            }
+            i++;
+        } else {
+            files.push_back(arg);
+        }
+    }
+    return files;
+}
+
 int main(int argc, char* argv[]) {
     if (argc == 2 && (argv[1] == std::string("-h") || argv[1] == std::string("--help"))) {
         std::cout << "Mesh and Point Cloud Viewer" << std::endl;
@@ -73,28 +144,68 @@ int main(int argc, char* argv[]) {
         std::cout << "--subset [street,aerial]      Loads only a specific category of points" << std::endl;
         std::cout << "--textureScale f              Resizes the loaded textures by given factor" << std::endl;
         std::cout << "--dsmResolution n             Resolution of the loaded GeoTIFF DSMs" << std::endl;
+        std::cout << "--aoRadius r                  Maximum distance of occluders in ambient occlusion, 0 for "
+                     "unlimited"
+                  << std::endl;
+        std::cout << "--simplifyError e             Maximum error of mesh simplification, 0 for unlimited"
+                  << std::endl;
+        std::cout << "--lodBudget n                 Maximum number of rendered faces; larger meshes get a LOD "
+                     "hierarchy, 0 to disable"
+                  << std::endl;
+        std::cout << "--smoothClasses c1,c2,...     Smooths only the mesh vertices of given classes" << std::endl;
+        std::cout << "--repairVoxel h               Voxel size of mesh repair, 0 to derive it from the mesh "
+                     "size"
+                  << std::endl;
+        std::cout << "--repairMemory mb             Memory limit of the volumes used by mesh repair"
+                  << std::endl;
+        std::cout << "--cache 0|1                   Caches loaded meshes in ~/.cache/mpcv for faster reopening, "
+                     "disabled by default"
+                  << std::endl;
+        std::cout << "--virtualTexture n            Streams tiles of textures larger than n pixels or than "
+                     "supported by the GPU, 0 to disable"
+                  << std::endl;
+        std::cout << "--textureMemory mb            Memory of the streamed texture tiles" << std::endl;
+        std::cout << std::endl << "Headless rendering:" << std::endl;
+        std::cout << "--render file                 Renders the meshes into given image (png, jpg, exr, pfm) "
+                     "without opening a window"
+                  << std::endl;
+        std::cout << "--camera ex,ey,ez:tx,ty,tz    Camera position and target in world coordinates"
+                  << std::endl;
+        std::cout << "--fov deg                     Vertical field of view" << std::endl;
+        std::cout << "--resolution WxH              Resolution of the rendered image" << std::endl;
+        std::cout << "--iters n                     Number of rendering passes" << std::endl;
+        std::cout << "--depth n                     Maximum number of bounces" << std::endl;
+        std::cout << "--adaptive e                  Samples pixels until their relative error is below e, "
+                     "iters is the maximum"
+                  << std::endl;
+        std::cout << "--sun x,y,z                   Direction to the sun" << std::endl;
+        std::cout << "--exposure ev                 Exposure of the tonemapped image in stops" << std::endl;
+        std::cout << "--checkpoint file             Saves the render state after each pass, resumes the render "
+                     "if the file exists"
+                  << std::endl;
         return 0;
     }
 
+    bool headless = false;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i] == std::string("--render")) {
+            headless = true;
+        }
+    }
+    if (headless) {
+        // no windows are created, so the application works without a display server
+        QCoreApplication a(argc, argv);
+        setlocale(LC_NUMERIC, "C");
+        Mpcv::HeadlessSettings settings;
+        std::vector<QString> files = parseArguments(a.arguments(), &settings);
+        return Mpcv::renderHeadless(settings, files);
+    }
+
     QApplication a(argc, argv);
     setlocale(LC_NUMERIC, "C"); // needed for sscanf
     setPalette(a);
 
-    QStringList args = a.arguments();
-    std::vector<QString> files;
-    for (int i = 1; i < args.size(); ++i) {
-        QString arg = args.at(i);
-        if (arg.size() > 2 && arg.left(2) == "--") {
-            if (i == args.size() - 1) {
-                std::cout << "Missing parameter of '" << arg.toStdString() << "'" << std::endl;
-                exit(-1);
-            }
-            parseArgument(arg.toStdString(), args.at(i + 1).toStdString());
-            i++;
-        } else {
-            files.push_back(arg);
-        }
-    }
+    std::vector<QString> files = parseArguments(a.arguments(), nullptr);
 
     MainWindow w;
 #ifdef NDEBUG
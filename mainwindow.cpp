@@ -1,5 +1,6 @@
 #include "mainwindow.h"
 #include "./ui_mainwindow.h"
+#include "cache.h"
 #include "dem.h"
 #include "e57.h"
 #include "las.h"
@@ -8,8 +9,10 @@
 #include "openglwidget.h"
 #include "sunwidget.h"
 #include "utils.h"
+#include "virtualtexture.h"
 #include <QClipboard>
 #include <QFileDialog>
+#include <QInputDialog>
 #include <QListWidget>
 #include <QListWidgetItem>
 #include <QMessageBox>
@@ -82,10 +85,15 @@ std::map<std::string, Coords> parseConfig() {
     return extents;
 }
 
-static std::map<std::string, Coords> config;
+static std::map<std::string, Coords>& extentsConfig() {
+    // parsed on first use, so that meshes can also be loaded without the main window
+    static std::map<std::string, Coords> config = parseConfig();
+    return config;
+}
 
 void geolocalize(TexturedMesh& mesh, const QString& file) {
     std::string basename = findBasename(QFileInfo(file).absoluteFilePath());
+    std::map<std::string, Coords>& config = extentsConfig();
     if (!basename.empty() && config.find(basename) != config.end()) {
         std::cout << "Setting srs to " << config[basename][0] << "," << config[basename][1] << std::endl;
         mesh.srs = Srs(config[basename]);
@@ -129,6 +137,7 @@ MainWindow::MainWindow(QWidget* parent)
     QMenu* menu = findChild<QMenu*>("menuMesh");
     QAction* repair = findChild<QAction*>("actionRepair");
     menu->removeAction(repair);
+    repair->setEnabled(false);
 #endif
 
     QShortcut* showAll = new QShortcut(QKeySequence(Qt::CTRL + Qt::Key_A), this);
@@ -252,7 +261,7 @@ MainWindow::MainWindow(QWidget* parent)
         checkMod = true;
     });
 
-    config = parseConfig();
+    extentsConfig();
 }
 
 MainWindow::~MainWindow() {
@@ -306,7 +315,7 @@ bool MainWindow::open(const QString& file, QProgressDialog* dialog) {
     try {
         QString ext = QFileInfo(file).suffix();
         if (ext != "ply" && ext != "obj" && ext != "xyz" && ext != "las" && ext != "laz" && ext != "e57" &&
-            ext != "tif") {
+            ext != "tif" && ext != "mpcv") {
             QMessageBox box(QMessageBox::Warning, "Error", "Unknown file format of file '" + file + "'");
             box.exec();
             return true; // continue opening files
@@ -318,21 +327,104 @@ bool MainWindow::open(const QString& file, QProgressDialog* dialog) {
             return dialog->wasCanceled();
         };
 
-        TexturedMesh mesh = loadMesh(file, callback);
-        if (dialog->wasCanceled()) {
-            return false;
+        // mpcv files are mapped directly, no need to cache them
+        const bool useCache = Parameters::global().useCache && ext != "mpcv";
+        const std::string cacheFile = useCache ? cachePath(file) : std::string();
+        const std::string cachedKey = useCache ? readMpcvKey(cacheFile) : std::string();
+        std::string key = cacheKey(file, cacheDependencies(cachedKey));
+        const std::string tilesFile = cachePath(file, ".tiles");
+
+        TexturedMesh mesh;
+        std::unique_ptr<LodHierarchy> lod;
+        bool cached = false;
+        bool textureTiles = false;
+        if (useCache && cachedKey == key) {
+            try {
+                mesh = loadMpcv(cacheFile, &lod, &textureTiles);
+                cached = true;
+                std::cout << "Loaded '" << file.toStdString() << "' from cache '" << cacheFile << "'"
+                          << std::endl;
+            } catch (const std::exception& e) {
+                std::cout << "Cannot read cache '" << cacheFile << "': " << e.what() << std::endl;
+            }
+        }
+        if (cached && textureTiles) {
+            // the texture of the cached mesh is stored in the tiles
+            mesh.pyramid = TexturePyramid::load(tilesFile, key);
+            if (!mesh.pyramid) {
+                std::cout << "Missing texture tiles of cached mesh, reloading" << std::endl;
+                mesh = TexturedMesh();
+                lod.reset();
+                cached = false;
+            }
+        }
+        if (!cached) {
+            mesh = loadMesh(file, callback);
+            if (dialog->wasCanceled()) {
+                return false;
+            }
+            key = cacheKey(file, mesh.dependencies);
         }
         if (mesh.vertices.empty()) {
             std::cout << "Skipping empty mesh '" << file.toStdString() << "'" << std::endl;
             return true; // continue opening files
         }
+        if ((ext == "las" || ext == "laz") && mesh.times.empty()) {
+            const std::string path = file.toStdString();
+            mesh.timesLoader = [path](const Progress& prog) { return loadLasTimes(path, prog); };
+        }
+
+        const int lodBudget = Parameters::global().lodBudget;
+        if (lodBudget <= 0) {
+            // the cached hierarchy is kept in the cache file, only not used
+            lod.reset();
+        }
+        bool lodBuilt = false;
+        if (!lod && lodBudget > 0 && mesh.faces.size() > std::size_t(lodBudget)) {
+            dialog->setLabelText("Building LOD of '" + QFileInfo(file).fileName() + "'");
+            lod = LodHierarchy::build(mesh, LodSettings{}, callback);
+            if (!lod) {
+                return false;
+            }
+            lodBuilt = true;
+        }
+
+        int virtualTextureSize = Parameters::global().virtualTextureSize;
+        if (virtualTextureSize > 0 && viewport_->maxTextureSize() > 0) {
+            // larger textures could not be uploaded at all
+            virtualTextureSize = std::min(virtualTextureSize, viewport_->maxTextureSize());
+        }
+        if (mesh.texture && virtualTextureSize > 0 &&
+            std::max(mesh.texture->size()[0], mesh.texture->size()[1]) > virtualTextureSize) {
+            mesh.pyramid = TexturePyramid::load(tilesFile, key);
+            if (!mesh.pyramid) {
+                dialog->setLabelText("Building texture tiles of '" + QFileInfo(file).fileName() + "'");
+                mesh.pyramid = TexturePyramid::build(*mesh.texture, tilesFile, key, callback);
+                if (!mesh.pyramid) {
+                    return false;
+                }
+            }
+            // the tiles replace the texture, also in the cache
+            mesh.texture.reset();
+        }
+
+        // written before viewing the mesh, the texture is released after uploading it to GPU
+        if (useCache && (!cached || lodBuilt)) {
+            dialog->setLabelText("Caching '" + QFileInfo(file).fileName() + "'");
+            QCoreApplication::processEvents();
+            try {
+                saveMpcv(cacheFile, mesh, lod.get(), key);
+            } catch (const std::exception& e) {
+                std::cout << "Cannot write cache '" << cacheFile << "': " << e.what() << std::endl;
+            }
+        }
 
         QFileInfo info(file);
         QString identifier = info.absoluteDir().dirName() + "/" + info.completeBaseName();
         QListWidgetItem* item = new QListWidgetItem(identifier, list_);
         list_->addItem(item);
 
-        viewport_->view(item, findBasename(file), std::move(mesh));
+        viewport_->view(item, findBasename(file), std::move(mesh), std::move(lod));
         item->setData(Qt::UserRole, info.absolutePath());
         item->setFlags(
             Qt::ItemIsEditable | Qt::ItemIsSelectable | Qt::ItemIsUserCheckable | Qt::ItemIsEnabled);
@@ -371,6 +463,8 @@ TexturedMesh MainWindow::loadMesh(const QString& file, std::function<bool(float)
         mesh = loadE57(file.toStdString(), callback);
     } else if (ext == "tif") {
         mesh = loadDem(file.toStdString(), callback);
+    } else if (ext == "mpcv") {
+        mesh = loadMpcv(file.toStdString());
     }
     return mesh;
 }
@@ -381,7 +475,7 @@ void MainWindow::on_actionOpenFile_triggered() {
         tr("Open mesh"),
         initialDir.path(),
         tr("all files (*);;.ply object (*.ply);;LAS point cloud (*.las *.laz);;E57 point cloud "
-           "(*.e57);;ASCII point cloud (*.xyz);;GeoTIFF (*.tif)"));
+           "(*.e57);;ASCII point cloud (*.xyz);;GeoTIFF (*.tif);;MPCV columns (*.mpcv)"));
     if (!names.empty()) {
         QFileInfo info(names.first());
         initialDir = info.dir();
@@ -438,11 +532,64 @@ void MainWindow::on_actionScreenshot_triggered() {
 }
 
 void MainWindow::on_actionLaplacian_smoothing_triggered() {
-    viewport_->laplacianSmooth();
+    bool ok;
+    const int iterations =
+        QInputDialog::getInt(this, "Smoothing", "Number of Taubin smoothing iterations", 10, 1, 1000, 1, &ok);
+    if (!ok) {
+        return;
+    }
+    SmoothingSettings settings;
+    settings.iterations = iterations;
+    settings.classes = Parameters::global().smoothClasses;
+    QProgressDialog* dialog = createProgressDialog("Smoothing meshes");
+    QCoreApplication::processEvents();
+    auto callback = [dialog](float prog) {
+        dialog->setValue(prog);
+        QCoreApplication::processEvents();
+        return dialog->wasCanceled();
+    };
+    viewport_->smooth(settings, callback);
+    dialog->close();
+}
+
+void MainWindow::on_actionSimplify_triggered() {
+    bool ok;
+    const double percent =
+        QInputDialog::getDouble(this, "Simplify", "Percentage of kept faces", 25., 0.01, 100., 2, &ok);
+    if (!ok) {
+        return;
+    }
+    QProgressDialog* dialog = createProgressDialog("Simplifying meshes");
+    QCoreApplication::processEvents();
+    auto callback = [dialog](float prog) {
+        dialog->setValue(prog);
+        QCoreApplication::processEvents();
+        return dialog->wasCanceled();
+    };
+    viewport_->simplify(percent / 100., Parameters::global().simplifyError, callback);
+    dialog->close();
 }
 
 void MainWindow::on_actionRepair_triggered() {
-    viewport_->repair();
+    RepairSettings settings;
+    settings.voxelSize = Parameters::global().repairVoxelSize;
+    settings.memoryLimit = std::max(Parameters::global().repairMemory, 1);
+    QProgressDialog* dialog = createProgressDialog("Repairing meshes");
+    QCoreApplication::processEvents();
+    auto callback = [dialog](float prog) {
+        dialog->setValue(prog);
+        QCoreApplication::processEvents();
+        return dialog->wasCanceled();
+    };
+    try {
+        viewport_->repair(settings, callback);
+    } catch (const std::exception& e) {
+        dialog->close();
+        QMessageBox box(QMessageBox::Warning, "Error", QString("Cannot repair the meshes\n") + e.what());
+        box.exec();
+        return;
+    }
+    dialog->close();
 }
 
 void MainWindow::on_actionQuit_triggered() {
@@ -451,8 +598,8 @@ void MainWindow::on_actionQuit_triggered() {
 
 void MainWindow::on_actionSave_triggered() {
     QDir& initialDir = saveFileDialogInitialDir();
-    QString file =
-        QFileDialog::getSaveFileName(this, tr("Save mesh"), initialDir.path(), tr(".ply object (*.ply)"));
+    QString file = QFileDialog::getSaveFileName(
+        this, tr("Save mesh"), initialDir.path(), tr(".ply object (*.ply);;MPCV columns (*.mpcv)"));
     if (!file.isEmpty()) {
         QFileInfo info(file);
         if (info.suffix().isEmpty()) {
@@ -465,6 +612,11 @@ void MainWindow::on_actionSave_triggered() {
                 handles.push_back(list_->item(i));
             }
         }
+        if (QFileInfo(file).suffix() == "mpcv" && handles.size() != 1) {
+            QMessageBox box(QMessageBox::Warning, "Error", "Select a single mesh to save in MPCV format");
+            box.exec();
+            return;
+        }
 
         QProgressDialog* dialog = createProgressDialog("Saving mesh to '" + file + "'");
         QCoreApplication::processEvents();
@@ -548,6 +700,28 @@ void MainWindow::on_actionRender_view_triggered() {
     }
 }
 
+void MainWindow::on_actionResume_render_triggered() {
+    QDir& initialDir = openFileDialogInitialDir();
+    QString file = QFileDialog::getOpenFileName(
+        this, tr("Open checkpoint"), initialDir.path(), tr("Render checkpoint (*.ckpt)"));
+    if (file.isEmpty()) {
+        return;
+    }
+    initialDir = QFileInfo(file).dir();
+    Mpcv::RenderBuffers buffers;
+    try {
+        buffers = Mpcv::loadCheckpoint(file.toStdString());
+    } catch (const std::exception& e) {
+        QMessageBox box(QMessageBox::Critical, "Error", e.what(), QMessageBox::Ok, this);
+        box.exec();
+        return;
+    }
+    if (!viewport_->renderView(std::move(buffers))) {
+        QMessageBox box(QMessageBox::Critical, "Error", "No meshes to render", QMessageBox::Ok, this);
+        box.exec();
+    }
+}
+
 void MainWindow::on_actionSun_setup_triggered() {
     static SunWidget* sun = new SunWidget(this);
     sun->setFunc([this](const Mpcv::RenderSettings& settings) {
@@ -598,7 +772,12 @@ void MainWindow::on_actionOrient_normals_triggered() {
             QCoreApplication::processEvents();
             return dialog->wasCanceled();
         };
-        viewport_->estimateNormals(file, callback);
+        try {
+            viewport_->estimateNormals(file, callback);
+        } catch (const std::exception& e) {
+            QMessageBox box(QMessageBox::Warning, "Error", e.what());
+            box.exec();
+        }
         dialog->close();
     }
 }
@@ -608,6 +787,11 @@ void MainWindow::on_actionClasses_triggered() {
     viewport_->classes(act->isChecked());
 }
 
+void MainWindow::on_actionEye_dome_lighting_triggered() {
+    QAction* act = this->findChild<QAction*>("actionEye_dome_lighting");
+    viewport_->eyeDomeLighting(act->isChecked());
+}
+
 void MainWindow::on_actionBuid_configuration_triggered() {
     QString text;
 #ifdef NDEBUG
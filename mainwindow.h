@@ -44,6 +44,8 @@ private slots:
 
     void on_actionLaplacian_smoothing_triggered();
 
+    void on_actionSimplify_triggered();
+
     void on_actionRepair_triggered();
 
     void on_actionQuit_triggered();
@@ -64,6 +66,8 @@ private slots:
 
     void on_actionRender_view_triggered();
 
+    void on_actionResume_render_triggered();
+
     void on_actionSun_setup_triggered();
 
     void on_actionControls_triggered();
@@ -74,6 +78,8 @@ private slots:
 
     void on_actionClasses_triggered();
 
+    void on_actionEye_dome_lighting_triggered();
+
     void on_actionBuid_configuration_triggered();
 
     void on_actionCameraUp_triggered();
@@ -1,34 +1,20 @@
 #include "mesh.h"
+#include "lod.h"
 #include "pvl/Box.hpp"
 #include "texture.h"
 #include "parameters.h"
 #include <QDir>
 #include <QFileInfo>
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 #include <vector>
 
 namespace Mpcv {
 
-inline std::vector<int> faceAoToVertexAo(const TexturedMesh& mesh) {
-    std::vector<int> ao(mesh.vertices.size(), 0);
-    std::vector<int> counts(mesh.vertices.size(), 0);
-    for (std::size_t fi = 0; fi < mesh.faces.size(); ++fi) {
-        for (int i = 0; i < 3; ++i) {
-            const int vi = mesh.faces[fi][i];
-            ao[vi] += mesh.ao[3 * fi + i];
-            counts[vi]++;
-        }
-    }
-    for (std::size_t vi = 0; vi < mesh.vertices.size(); ++vi) {
-        if (counts[vi] > 0) {
-            ao[vi] /= counts[vi];
-        }
-    }
-    return ao;
-}
-
 void savePly(std::ostream& out, const TexturedMesh& mesh) {
     out << "ply\n";
     out << "format ascii 1.0\n";
@@ -51,11 +37,6 @@ void savePly(std::ostream& out, const TexturedMesh& mesh) {
     out << "property list uchar int vertex_index\n";
     out << "end_header\n";
 
-    std::vector<int> ao;
-    if (!mesh.ao.empty()) {
-        // .ply format does not support per-face colors
-        ao = faceAoToVertexAo(mesh);
-    }
     for (std::size_t vi = 0; vi < mesh.vertices.size(); ++vi) {
         const Pvl::Vec3f& p = mesh.vertices[vi];
         out << p[0] << " " << p[1] << " " << p[2];
@@ -64,7 +45,7 @@ void savePly(std::ostream& out, const TexturedMesh& mesh) {
             out << " " << n[0] << " " << n[1] << " " << n[2];
         }
         if (!mesh.ao.empty()) {
-            const int a = ao[vi];
+            const int a = mesh.ao[vi];
             out << " " << a << " " << a << " " << a;
         } else if (!mesh.colors.empty()) {
             const Color& c = mesh.colors[vi];
@@ -119,11 +100,6 @@ void savePly(std::ostream& out, const std::vector<const TexturedMesh*>& meshes,
     for (const TexturedMesh* mesh : meshes) {
         SrsConv conv(mesh->srs, meshes[0]->srs); // translate to the SRS of the first mesh
 
-        std::vector<int> ao;
-        if (!mesh->ao.empty()) {
-            // .ply format does not support per-face colors
-            ao = faceAoToVertexAo(*mesh);
-        }
         for (std::size_t vi = 0; vi < mesh->vertices.size(); ++vi) {
             const Pvl::Vec3f p = conv(mesh->vertices[vi]);
             out << p[0] << " " << p[1] << " " << p[2];
@@ -140,7 +116,7 @@ void savePly(std::ostream& out, const std::vector<const TexturedMesh*>& meshes,
                     const Color& c = mesh->colors[vi];
                     out << " " << int(c[0]) << " " << int(c[1]) << " " << int(c[2]);
                 } else if (!mesh->ao.empty()) {
-                    const int a = ao[vi];
+                    const int a = mesh->ao[vi];
                     out << " " << a << " " << a << " " << a;
                 } else {
                     out << " 255 255 255";
@@ -399,13 +375,16 @@ TexturedMesh loadObj(const QString& file, const Progress& prog) {
         }
 
         std::cout << "opening mtl path = " << mtlPath << std::endl;
+        mesh.dependencies.push_back(mtlPath);
         std::ifstream mtlin(mtlPath);
         while (std::getline(mtlin, line)) {
             std::cout << "Processing mtl line " << line << std::endl;
             if (startsWith(line, "map_Kd")) {
                 std::string atlas = line.substr(7);
                 std::cout << "Referencing atlas " << atlas << std::endl;
-                mesh.texture = makeTexture(info.dir().path() + "/" + QString::fromStdString(atlas));
+                const QString texturePath = info.dir().path() + "/" + QString::fromStdString(atlas);
+                mesh.dependencies.push_back(texturePath.toStdString());
+                mesh.texture = makeTexture(texturePath);
                 std::cout << "Loaded texture " << mesh.texture->size()[0] << "x" << mesh.texture->size()[1]
                           << std::endl;
             }
@@ -422,4 +401,263 @@ TexturedMesh loadObj(const QString& file, const Progress& prog) {
     return mesh;
 }
 
+namespace {
+
+constexpr char MPCV_MAGIC[4] = { 'M', 'P', 'C', 'V' };
+constexpr uint32_t MPCV_VERSION = 3;
+
+///< Columns start at page boundaries, so they can be mapped and read ahead independently
+constexpr std::size_t MPCV_ALIGNMENT = 4096;
+
+enum class ColumnId : uint32_t {
+    VERTICES,
+    NORMALS,
+    COLORS,
+    TIMES,
+    FACES,
+    UV,
+    TEX_IDS,
+    AO,
+    CLASSES,
+    TEXTURE,
+    LOD_FACES,
+    LOD_TEX_IDS,
+    LOD_CLUSTERS,
+};
+
+struct MpcvHeader {
+    char magic[4];
+    uint32_t version;
+    double center[3];
+    uint32_t numColumns;
+    uint32_t numClassColors;
+    uint32_t keySize;
+    uint32_t flags;
+
+    ///< Layout of the pixels in the texture column
+    uint32_t textureFormat;
+    uint32_t textureWidth;
+    uint32_t textureHeight;
+    uint64_t textureBytesPerLine;
+};
+
+enum MpcvFlag : uint32_t {
+    ///< Texture of the mesh has been split into tiles, stored outside of the file
+    MPCV_TEXTURE_TILES = 1 << 0,
+};
+
+struct MpcvColumn {
+    uint32_t id;
+    uint32_t valueSize;
+    uint64_t count;
+    uint64_t offset;
+};
+
+struct MpcvClassColor {
+    int32_t id;
+    uint8_t color[4];
+};
+
+/// \brief Header and tables stored before the columns.
+struct MpcvTables {
+    MpcvHeader header;
+    std::vector<MpcvColumn> columns;
+    std::vector<MpcvClassColor> classColors;
+    std::string key;
+};
+
+template <typename TMesh, typename TFunc>
+void forEachColumn(TMesh& mesh, const TFunc& func) {
+    func(ColumnId::VERTICES, mesh.vertices);
+    func(ColumnId::NORMALS, mesh.normals);
+    func(ColumnId::COLORS, mesh.colors);
+    func(ColumnId::TIMES, mesh.times);
+    func(ColumnId::FACES, mesh.faces);
+    func(ColumnId::UV, mesh.uv);
+    func(ColumnId::TEX_IDS, mesh.texIds);
+    func(ColumnId::AO, mesh.ao);
+    func(ColumnId::CLASSES, mesh.classes);
+}
+
+template <typename TLod, typename TFunc>
+void forEachLodColumn(TLod& lod, const TFunc& func) {
+    func(ColumnId::LOD_FACES, lod.faces);
+    func(ColumnId::LOD_TEX_IDS, lod.texIds);
+    func(ColumnId::LOD_CLUSTERS, lod.clusters);
+}
+
+std::size_t alignUp(const std::size_t offset) {
+    return (offset + MPCV_ALIGNMENT - 1) / MPCV_ALIGNMENT * MPCV_ALIGNMENT;
+}
+
+MpcvTables readTables(const MappedFile& mapping, const std::string& file) {
+    const uint8_t* data = mapping.data();
+    const std::size_t fileSize = mapping.size();
+
+    MpcvTables tables;
+    MpcvHeader& header = tables.header;
+    if (fileSize < sizeof(header)) {
+        throw std::runtime_error("Invalid MPCV file '" + file + "'");
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (!std::equal(MPCV_MAGIC, MPCV_MAGIC + 4, header.magic)) {
+        throw std::runtime_error("Invalid MPCV file '" + file + "'");
+    }
+    if (header.version != MPCV_VERSION) {
+        throw std::runtime_error("Unsupported version " + std::to_string(header.version) + " of MPCV file '" +
+                                 file + "'");
+    }
+    const std::size_t tableSize = std::size_t(header.numColumns) * sizeof(MpcvColumn) +
+                                  std::size_t(header.numClassColors) * sizeof(MpcvClassColor) +
+                                  header.keySize;
+    if (fileSize < sizeof(header) + tableSize) {
+        throw std::runtime_error("Invalid MPCV file '" + file + "'");
+    }
+    const uint8_t* ptr = data + sizeof(header);
+    tables.columns.resize(header.numColumns);
+    std::memcpy(tables.columns.data(), ptr, tables.columns.size() * sizeof(MpcvColumn));
+    ptr += tables.columns.size() * sizeof(MpcvColumn);
+    tables.classColors.resize(header.numClassColors);
+    std::memcpy(tables.classColors.data(), ptr, tables.classColors.size() * sizeof(MpcvClassColor));
+    ptr += tables.classColors.size() * sizeof(MpcvClassColor);
+    tables.key.assign(reinterpret_cast<const char*>(ptr), header.keySize);
+    return tables;
+}
+
+} // namespace
+
+void saveMpcv(const std::string& file,
+              const TexturedMesh& mesh,
+              const LodHierarchy* lod,
+              const std::string& key) {
+    std::vector<MpcvColumn> columns;
+    std::vector<const void*> sources;
+    auto addColumn = [&columns, &sources](const ColumnId id, const auto& column) {
+        if (!column.empty()) {
+            using T = typename std::decay_t<decltype(column)>::value_type;
+            columns.push_back(MpcvColumn{ uint32_t(id), uint32_t(sizeof(T)), column.size(), 0 });
+            sources.push_back(column.data());
+        }
+    };
+    forEachColumn(mesh, addColumn);
+    if (lod) {
+        forEachLodColumn(*lod, addColumn);
+    }
+
+    MpcvHeader header;
+    std::memset(&header, 0, sizeof(header));
+    if (mesh.texture) {
+        ITexture& texture = *mesh.texture;
+        header.textureFormat = uint32_t(texture.format());
+        header.textureWidth = texture.size()[0];
+        header.textureHeight = texture.size()[1];
+        header.textureBytesPerLine = texture.bytesPerLine();
+        columns.push_back(MpcvColumn{
+            uint32_t(ColumnId::TEXTURE), 1, header.textureBytesPerLine * header.textureHeight, 0 });
+        sources.push_back(texture.data());
+    }
+    if (mesh.pyramid) {
+        header.flags |= MPCV_TEXTURE_TILES;
+    }
+
+    std::vector<MpcvClassColor> classColors;
+    for (const auto& p : mesh.classToColor) {
+        classColors.push_back(MpcvClassColor{ p.first, { p.second[0], p.second[1], p.second[2], 0 } });
+    }
+
+    std::copy(MPCV_MAGIC, MPCV_MAGIC + 4, header.magic);
+    header.version = MPCV_VERSION;
+    const Coords center = mesh.srs.localToWorld(Coords(0));
+    for (int i = 0; i < 3; ++i) {
+        header.center[i] = center[i];
+    }
+    header.numColumns = uint32_t(columns.size());
+    header.numClassColors = uint32_t(classColors.size());
+    header.keySize = uint32_t(key.size());
+
+    std::size_t offset = alignUp(sizeof(MpcvHeader) + columns.size() * sizeof(MpcvColumn) +
+                                 classColors.size() * sizeof(MpcvClassColor) + key.size());
+    for (MpcvColumn& column : columns) {
+        column.offset = offset;
+        offset = alignUp(offset + column.count * column.valueSize);
+    }
+
+    // written to a temporary file and renamed, so that the file can be overwritten while it is mapped
+    const std::string tempFile = file + ".tmp";
+    std::ofstream out;
+    out.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+    out.open(tempFile, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(columns.data()), columns.size() * sizeof(MpcvColumn));
+    out.write(reinterpret_cast<const char*>(classColors.data()), classColors.size() * sizeof(MpcvClassColor));
+    out.write(key.data(), key.size());
+    for (std::size_t i = 0; i < columns.size(); ++i) {
+        const std::size_t pos = out.tellp();
+        const std::vector<char> padding(columns[i].offset - pos, 0);
+        out.write(padding.data(), padding.size());
+        out.write(reinterpret_cast<const char*>(sources[i]), columns[i].count * columns[i].valueSize);
+    }
+    out.close();
+    if (std::rename(tempFile.c_str(), file.c_str()) != 0) {
+        throw std::runtime_error("Cannot write file '" + file + "'");
+    }
+}
+
+TexturedMesh loadMpcv(const std::string& file, std::unique_ptr<LodHierarchy>* lod, bool* textureTiles) {
+    std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>(file);
+    const MpcvTables tables = readTables(*mapping, file);
+    const MpcvHeader& header = tables.header;
+
+    auto mapColumn = [&](const ColumnId id, auto& column) {
+        using T = typename std::decay_t<decltype(column)>::value_type;
+        for (const MpcvColumn& entry : tables.columns) {
+            if (entry.id != uint32_t(id)) {
+                continue;
+            }
+            if (entry.valueSize != sizeof(T) || entry.offset % alignof(T) != 0 ||
+                entry.offset + entry.count * sizeof(T) > mapping->size()) {
+                throw std::runtime_error("Invalid column in MPCV file '" + file + "'");
+            }
+            column = Column<T>(mapping, entry.offset, entry.count);
+        }
+    };
+
+    TexturedMesh mesh;
+    mesh.srs = Srs(Coords(header.center[0], header.center[1], header.center[2]));
+    for (const MpcvClassColor& c : tables.classColors) {
+        mesh.classToColor[c.id] = Color(c.color[0], c.color[1], c.color[2]);
+    }
+    forEachColumn(mesh, mapColumn);
+
+    if (header.textureHeight > 0) {
+        Column<uint8_t> pixels;
+        mapColumn(ColumnId::TEXTURE, pixels);
+        mesh.texture = std::make_unique<ColumnTexture>(std::move(pixels),
+            Pvl::Vec2i(header.textureWidth, header.textureHeight),
+            ImageFormat(header.textureFormat),
+            header.textureBytesPerLine);
+    }
+
+    if (lod) {
+        *lod = std::make_unique<LodHierarchy>();
+        forEachLodColumn(**lod, mapColumn);
+        if ((*lod)->clusters.empty()) {
+            lod->reset();
+        }
+    }
+    if (textureTiles) {
+        *textureTiles = (header.flags & MPCV_TEXTURE_TILES) != 0;
+    }
+    return mesh;
+}
+
+std::string readMpcvKey(const std::string& file) {
+    try {
+        MappedFile mapping(file);
+        return readTables(mapping, file).key;
+    } catch (const std::exception&) {
+        return {};
+    }
+}
+
 } // namespace Mpcv
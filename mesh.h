@@ -1,5 +1,6 @@
 #pragma once
 
+#include "column.h"
 #include "coordinates.h"
 #include "pvl/Optional.hpp"
 #include "pvl/UniformGrid.hpp"
@@ -15,39 +16,50 @@ namespace Mpcv {
 
 using Color = Pvl::Vector<uint8_t, 3>;
 
+class TexturePyramid;
+
 struct TexturedMesh {
     using Face = std::array<uint32_t, 3>;
 
     ///< Vertex positions in local coords
-    std::vector<Pvl::Vec3f> vertices;
+    Column<Pvl::Vec3f> vertices;
 
     ///< Vertex normals (normalized)
-    std::vector<Pvl::Vec3f> normals;
+    Column<Pvl::Vec3f> normals;
 
     ///< Vertex colors
-    std::vector<Color> colors;
+    Column<Color> colors;
 
     ///< GPS times
-    std::vector<double> times;
+    Column<double> times;
+
+    ///< Loads GPS times on demand if they were not loaded with the mesh, may be empty
+    std::function<Column<double>(const std::function<bool(float)>&)> timesLoader;
 
     ///< Face indices
-    std::vector<Face> faces;
+    Column<Face> faces;
 
     ///< Vertex texture coordinates
-    std::vector<Pvl::Vec2f> uv;
+    Column<Pvl::Vec2f> uv;
 
     ///< Face indices in uv list
-    std::vector<Face> texIds;
+    Column<Face> texIds;
 
-    ///< AO color for each vertex of each face (3*faces.size() values)
-    std::vector<uint8_t> ao;
+    ///< AO color for each vertex
+    Column<uint8_t> ao;
 
     ///< Vertex classes
-    std::vector<uint8_t> classes;
+    Column<uint8_t> classes;
 
     ///< Texture image (deleted once transvered to OpenGL)
     std::unique_ptr<ITexture> texture;
 
+    ///< Tiles of a texture too large to be uploaded at once, used instead of the texture image
+    std::shared_ptr<TexturePyramid> pyramid;
+
+    ///< Files read besides the mesh file, e.g. the material and the texture image of OBJ
+    std::vector<std::string> dependencies;
+
     ///< Specifies the coordinates of the mesh
     Srs srs;
 
@@ -92,4 +104,31 @@ TexturedMesh loadXyz(const QString& file, const Progress& prog);
 
 TexturedMesh loadObj(const QString& file, const Progress& prog);
 
+class LodHierarchy;
+
+/// \brief Saves the mesh in the native columnar format (.mpcv).
+///
+/// Each attribute is stored as a raw array aligned to pages, so that the file can be memory-mapped. The
+/// texture pixels and the LOD hierarchy are saved as additional columns if present. The texture tiles of the
+/// mesh are not saved, the file only records that the mesh had them.
+/// \param key Arbitrary string identifying the source of the mesh, see \ref readMpcvKey.
+void saveMpcv(const std::string& file,
+              const TexturedMesh& mesh,
+              const LodHierarchy* lod = nullptr,
+              const std::string& key = {});
+
+/// \brief Maps a mesh saved by \ref saveMpcv.
+///
+/// Nothing is read besides the header; attributes are paged in from the file when accessed, and the pages are
+/// shared with other processes mapping the same file. Throws std::runtime_error if the file is not valid.
+/// \param lod If not null, set to the saved LOD hierarchy, or null pointer if the file has none.
+/// \param textureTiles If not null, set to true if the saved mesh had its texture split into tiles, which are
+///                     stored separately, see \ref TexturePyramid.
+TexturedMesh loadMpcv(const std::string& file,
+                      std::unique_ptr<LodHierarchy>* lod = nullptr,
+                      bool* textureTiles = nullptr);
+
+/// \brief Returns the key stored by \ref saveMpcv, or empty string if the file is missing or not valid.
+std::string readMpcvKey(const std::string& file);
+
 } // namespace Mpcv
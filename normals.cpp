@@ -0,0 +1,282 @@
+#include "normals.h"
+#include "pvl/Utils.hpp"
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <tbb/tbb.h>
+
+namespace Mpcv {
+
+Trajectory Trajectory::load(const std::string& file, std::function<bool(float)> progress) {
+    std::ifstream ifs(file);
+    if (!ifs) {
+        throw std::runtime_error("Cannot open trajectory file '" + file + "'");
+    }
+    ifs.seekg(0, std::ios::end);
+    const std::size_t fileSize = std::max<std::size_t>(ifs.tellg(), 1);
+    ifs.seekg(0, std::ios::beg);
+
+    Trajectory traj;
+    std::string line;
+    std::size_t lineCnt = 0;
+    while (std::getline(ifs, line)) {
+        // x,y,z,t separated by commas or whitespaces, other lines (e.g. header) are skipped
+        const char* s = line.c_str();
+        std::array<double, 4> values;
+        int parsed = 0;
+        for (; parsed < 4; ++parsed) {
+            while (*s == ',' || std::isspace(static_cast<unsigned char>(*s))) {
+                ++s;
+            }
+            char* end;
+            values[parsed] = std::strtod(s, &end);
+            if (end == s) {
+                break;
+            }
+            s = end;
+        }
+        if (parsed == 4) {
+            traj.samples_.push_back(Sample{ Coords(values[0], values[1], values[2]), values[3] });
+        }
+
+        if (++lineCnt % 10000 == 0) {
+            const std::size_t pos = ifs.tellg();
+            if (progress(pos * 100.f / fileSize)) {
+                return {};
+            }
+        }
+    }
+    std::sort(traj.samples_.begin(), traj.samples_.end(), [](const Sample& s1, const Sample& s2) {
+        return s1.t < s2.t;
+    });
+    return traj;
+}
+
+Coords Trajectory::position(const double t) const {
+    PVL_ASSERT(!samples_.empty());
+    auto iter = std::lower_bound(samples_.begin(), samples_.end(), t, [](const Sample& s, double t) {
+        return s.t < t;
+    });
+    if (iter == samples_.begin()) {
+        return samples_.front().p;
+    }
+    if (iter == samples_.end()) {
+        return samples_.back().p;
+    }
+    const Sample& s1 = *(iter - 1);
+    const Sample& s2 = *iter;
+    const double dt = s2.t - s1.t;
+    if (dt <= 0.) {
+        return s2.p;
+    }
+    const double w = (t - s1.t) / dt;
+    return s1.p * (1. - w) + s2.p * w;
+}
+
+namespace {
+
+/// Symmetric 3x3 matrix stored as xx, xy, xz, yy, yz, zz
+using SymMat33d = std::array<double, 6>;
+
+struct Eigen {
+    ///< Eigenvalues in ascending order
+    std::array<double, 3> values;
+
+    ///< Unit eigenvector of the smallest eigenvalue
+    Pvl::Vec3f normal;
+};
+
+/// \brief Analytic eigendecomposition of a symmetric 3x3 matrix, see "Eigenvalues of a symmetric 3x3 matrix"
+/// (Smith 1961).
+Eigen eigenDecomposition(const SymMat33d& m) {
+    const double xx = m[0], xy = m[1], xz = m[2], yy = m[3], yz = m[4], zz = m[5];
+    Eigen result;
+    const double p1 = xy * xy + xz * xz + yz * yz;
+    const double q = (xx + yy + zz) / 3.;
+    const double p2 = Pvl::sqr(xx - q) + Pvl::sqr(yy - q) + Pvl::sqr(zz - q) + 2. * p1;
+    if (p1 <= 1.e-20 * p2 || p2 == 0.) {
+        // diagonal matrix
+        std::array<std::pair<double, int>, 3> diag = { { { xx, 0 }, { yy, 1 }, { zz, 2 } } };
+        std::sort(diag.begin(), diag.end());
+        for (int i = 0; i < 3; ++i) {
+            result.values[i] = diag[i].first;
+        }
+        result.normal = Pvl::Vec3f(0.f);
+        result.normal[diag[0].second] = 1.f;
+        return result;
+    }
+    const double p = std::sqrt(p2 / 6.);
+    // B = (A - qI) / p
+    const double bxx = (xx - q) / p, byy = (yy - q) / p, bzz = (zz - q) / p;
+    const double bxy = xy / p, bxz = xz / p, byz = yz / p;
+    const double det =
+        bxx * (byy * bzz - byz * byz) - bxy * (bxy * bzz - byz * bxz) + bxz * (bxy * byz - byy * bxz);
+    const double r = std::max(std::min(0.5 * det, 1.), -1.);
+    const double phi = std::acos(r) / 3.;
+    result.values[2] = q + 2. * p * std::cos(phi);
+    result.values[0] = q + 2. * p * std::cos(phi + 2. * M_PI / 3.);
+    result.values[1] = 3. * q - result.values[0] - result.values[2];
+
+    // eigenvector is orthogonal to the rows of A - l0*I, take the most stable cross product
+    const double l0 = result.values[0];
+    const Pvl::Vec3d r0(xx - l0, xy, xz);
+    const Pvl::Vec3d r1(xy, yy - l0, yz);
+    const Pvl::Vec3d r2(xz, yz, zz - l0);
+    const std::array<Pvl::Vec3d, 3> candidates = {
+        Pvl::crossProd(r0, r1),
+        Pvl::crossProd(r0, r2),
+        Pvl::crossProd(r1, r2),
+    };
+    int best = 0;
+    for (int i = 1; i < 3; ++i) {
+        if (Pvl::normSqr(candidates[i]) > Pvl::normSqr(candidates[best])) {
+            best = i;
+        }
+    }
+    const double length = Pvl::norm(candidates[best]);
+    if (length > 0.) {
+        const Pvl::Vec3d n = candidates[best] / length;
+        result.normal = Pvl::Vec3f(float(n[0]), float(n[1]), float(n[2]));
+    } else {
+        // the two smallest eigenvalues are equal (points on a line), any vector orthogonal to it will do
+        const Pvl::Vec3d& row = Pvl::normSqr(r0) > Pvl::normSqr(r1) ? r0 : r1;
+        const Pvl::Vec3d axis =
+            std::abs(row[2]) < 0.9 * Pvl::norm(row) ? Pvl::Vec3d(0, 0, 1) : Pvl::Vec3d(1, 0, 0);
+        Pvl::Vec3d n = Pvl::crossProd(row, axis);
+        n = n / Pvl::norm(n);
+        result.normal = Pvl::Vec3f(float(n[0]), float(n[1]), float(n[2]));
+    }
+    return result;
+}
+
+struct PlaneFit {
+    Pvl::Vec3f normal = Pvl::Vec3f(0.f, 0.f, 1.f);
+    float variation = 0.f;
+    bool valid = false;
+};
+
+/// Fits planes to growing neighborhoods; selects the largest one that is still planar, or the most planar one
+/// if none of them is.
+PlaneFit fitPlane(const Column<Pvl::Vec3f>& points,
+                  const Pvl::Vec3f& center,
+                  const std::vector<KdTree::Neighbor>& neighs,
+                  const int minK,
+                  const int step,
+                  const float maxVariation) {
+    PlaneFit fit;
+    PlaneFit mostPlanar;
+    const int count = int(neighs.size());
+    const int firstK = std::max(std::min(minK, count), 3);
+    // sums are relative to the query point to keep the precision
+    Pvl::Vec3d sum(0.);
+    SymMat33d sumSqr = { 0., 0., 0., 0., 0., 0. };
+    for (int j = 0; j < count; ++j) {
+        const Pvl::Vec3f d = points[neighs[j].index] - center;
+        const Pvl::Vec3d dd(d[0], d[1], d[2]);
+        sum += dd;
+        sumSqr[0] += dd[0] * dd[0];
+        sumSqr[1] += dd[0] * dd[1];
+        sumSqr[2] += dd[0] * dd[2];
+        sumSqr[3] += dd[1] * dd[1];
+        sumSqr[4] += dd[1] * dd[2];
+        sumSqr[5] += dd[2] * dd[2];
+
+        const int k = j + 1;
+        if (k < firstK || ((k - firstK) % step != 0 && k != count)) {
+            continue;
+        }
+        const Pvl::Vec3d mean = sum / double(k);
+        const SymMat33d cov = {
+            sumSqr[0] / k - mean[0] * mean[0],
+            sumSqr[1] / k - mean[0] * mean[1],
+            sumSqr[2] / k - mean[0] * mean[2],
+            sumSqr[3] / k - mean[1] * mean[1],
+            sumSqr[4] / k - mean[1] * mean[2],
+            sumSqr[5] / k - mean[2] * mean[2],
+        };
+        const Eigen eigen = eigenDecomposition(cov);
+        const double total = std::max(eigen.values[0], 0.) + std::max(eigen.values[1], 0.) + eigen.values[2];
+        if (total <= 0.) {
+            // coincident points
+            continue;
+        }
+        PlaneFit current;
+        current.normal = eigen.normal;
+        current.variation = float(std::max(eigen.values[0], 0.) / total);
+        current.valid = true;
+        if (!mostPlanar.valid || current.variation < mostPlanar.variation) {
+            mostPlanar = current;
+        }
+        if (current.variation <= maxVariation) {
+            fit = current;
+        } else if (fit.valid) {
+            // the neighborhood crossed an edge, keep the last planar one
+            break;
+        }
+    }
+    return fit.valid ? fit : mostPlanar;
+}
+
+} // namespace
+
+bool estimateNormals(const Column<Pvl::Vec3f>& points,
+                     const KdTree& tree,
+                     const Column<double>& times,
+                     const Trajectory& trajectory,
+                     const Srs& srs,
+                     const NormalSettings& settings,
+                     NormalResult& result,
+                     std::function<bool(float)> progress) {
+    const std::size_t count = points.size();
+    result.normals.resize(count);
+    if (settings.curvature) {
+        result.curvature.resize(count);
+    }
+    if (settings.confidence) {
+        result.confidence.resize(count);
+    }
+    const bool useTrajectory = !trajectory.empty() && times.size() == count;
+    const int minK = std::max(settings.minNeighbors, 3);
+    const int maxK = std::max(settings.maxNeighbors, minK);
+    const int step = std::max(settings.neighborStep, 1);
+
+    auto meter = Pvl::makeProgressMeter(count, std::move(progress));
+    tbb::atomic<bool> cancelled = false;
+    auto estimate = [&](const tbb::blocked_range<std::size_t>& range) {
+        std::vector<KdTree::Neighbor> neighs;
+        neighs.reserve(maxK);
+        for (std::size_t i = range.begin(); i < range.end(); ++i) {
+            if (cancelled) {
+                return;
+            }
+            tree.kNearest(points[i], maxK, neighs);
+            const PlaneFit fit = fitPlane(points, points[i], neighs, minK, step, settings.maxVariation);
+
+            Pvl::Vec3f normal = fit.normal;
+            if (useTrajectory) {
+                const Pvl::Vec3f sensor = vec3f(srs.worldToLocal(trajectory.position(times[i])));
+                if (Pvl::dotProd(normal, sensor - points[i]) < 0.f) {
+                    normal = -normal;
+                }
+            } else if (normal[2] < 0.f) {
+                normal = -normal;
+            }
+            result.normals[i] = normal;
+            if (settings.curvature) {
+                result.curvature[i] = fit.variation;
+            }
+            if (settings.confidence) {
+                // the variation is at most 1/3 for isotropic neighborhoods
+                result.confidence[i] = fit.valid ? std::max(1.f - 3.f * fit.variation, 0.f) : 0.f;
+            }
+
+            if (meter.inc()) {
+                cancelled = true;
+            }
+        }
+    };
+    tbb::parallel_for(tbb::blocked_range<std::size_t>(0, count, 1024), estimate);
+    return !cancelled;
+}
+
+} // namespace Mpcv
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "column.h"
+#include "coordinates.h"
+#include "kdtree.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace Mpcv {
+
+/// \brief Sensor trajectory of a mobile scan, used to orient the normals towards the scanner.
+class Trajectory {
+    struct Sample {
+        Coords p;
+        double t;
+    };
+
+    ///< Samples sorted by time
+    std::vector<Sample> samples_;
+
+public:
+    /// \brief Loads the trajectory from a text file with lines 'x,y,z,t' (commas or whitespaces).
+    ///
+    /// Returns an empty trajectory if cancelled by the progress callback.
+    static Trajectory load(const std::string& file, std::function<bool(float)> progress);
+
+    bool empty() const {
+        return samples_.empty();
+    }
+
+    double startTime() const {
+        return samples_.front().t;
+    }
+
+    double endTime() const {
+        return samples_.back().t;
+    }
+
+    /// \brief Returns the sensor position at given time in world coordinates.
+    ///
+    /// The position is linearly interpolated between the neighboring samples; times outside of the trajectory
+    /// are clamped to the first or the last sample.
+    Coords position(double t) const;
+};
+
+struct NormalSettings {
+    ///< Minimal number of neighbors used to fit the tangent plane
+    int minNeighbors = 8;
+
+    ///< Maximal number of neighbors used to fit the tangent plane
+    int maxNeighbors = 32;
+
+    ///< Step of the neighborhood sizes tested between minNeighbors and maxNeighbors
+    int neighborStep = 4;
+
+    ///< Neighborhoods with larger surface variation are not considered planar
+    float maxVariation = 0.05f;
+
+    ///< Compute the surface variation of the selected neighborhood
+    bool curvature = false;
+
+    ///< Compute the confidence of the normals
+    bool confidence = false;
+};
+
+struct NormalResult {
+    ///< Unit normal of each point
+    std::vector<Pvl::Vec3f> normals;
+
+    ///< Surface variation l0/(l0+l1+l2) of the covariance eigenvalues, zero for planar neighborhoods
+    std::vector<float> curvature;
+
+    ///< Value in [0, 1], one for planar neighborhoods, zero for isotropic neighborhoods or isolated points
+    std::vector<float> confidence;
+};
+
+/// \brief Estimates normals of a point cloud by fitting a plane to the neighborhood of each point.
+///
+/// The neighborhood of each point grows from settings.minNeighbors to settings.maxNeighbors while it stays
+/// planar, i.e. the surface variation is below settings.maxVariation; large neighborhoods suppress the noise on
+/// flat surfaces, small ones keep the edges sharp. Normals are oriented in the same pass: towards the sensor
+/// position at the GPS time of the point if the trajectory and times are given, upwards otherwise.
+///
+/// \param points Points in local coordinates of given srs.
+/// \param tree Kd-tree built over the points, can be reused for other queries.
+/// \param times GPS times of the points, may be empty.
+/// \param trajectory Sensor trajectory, may be empty.
+/// \return False if cancelled by the progress callback.
+bool estimateNormals(const Column<Pvl::Vec3f>& points,
+                     const KdTree& tree,
+                     const Column<double>& times,
+                     const Trajectory& trajectory,
+                     const Srs& srs,
+                     const NormalSettings& settings,
+                     NormalResult& result,
+                     std::function<bool(float)> progress);
+
+} // namespace Mpcv
@@ -1,26 +1,67 @@
 #include "openglwidget.h"
+#include "decimation.h"
 #include "framebuffer.h"
-#include "pvl/CloudUtils.hpp"
-#include "pvl/QuadricDecimator.hpp"
-#include "pvl/Refinement.hpp"
-#include "pvl/Simplification.hpp"
-#include "pvl/TriangleMesh.hpp"
+#include "normals.h"
+#include "parameters.h"
 #include "renderer.h"
 #include <QPainter>
-#include <sstream>
+#include <QTimer>
+#include <chrono>
 #include <tbb/tbb.h>
 
-#ifdef HAS_OPENVDB
-#ifdef foreach
-#undef foreach // every time a programmer defines a macro, god kills a kitten
-#endif
-#include <openvdb/openvdb.h>
-#include <openvdb/tools/MeshToVolume.h>
-#include <openvdb/tools/VolumeToMesh.h>
-#endif
-
 using namespace Mpcv;
 
+struct HoverQuery {
+    // restarted on every mouse move, the query runs once the mouse stops for a moment
+    QTimer* timer;
+    QPoint pos;
+    tbb::task_group group;
+    std::atomic<bool> running{ false };
+
+    // guards the lazy construction of picking structures
+    tbb::mutex indexMutex;
+
+    // set while an operation modifies the meshes; progress callbacks process events, so the timer can fire
+    // in the middle of the operation
+    bool busy = false;
+};
+
+namespace {
+struct BusyGuard {
+    HoverQuery& hover;
+
+    explicit BusyGuard(HoverQuery& hover)
+        : hover(hover) {
+        hover.busy = true;
+    }
+
+    ~BusyGuard() {
+        hover.busy = false;
+    }
+};
+} // namespace
+
+OpenGLWidget::OpenGLWidget(QWidget* parent)
+    : QOpenGLWidget(parent)
+    , hover_(std::make_unique<HoverQuery>()) {
+    setMouseTracking(true);
+
+    hover_->timer = new QTimer(this);
+    hover_->timer->setSingleShot(true);
+    hover_->timer->setInterval(30);
+    QObject::connect(hover_->timer, &QTimer::timeout, this, [this] { startHoverQuery(); });
+}
+
+OpenGLWidget::~OpenGLWidget() {
+    waitForHoverQuery();
+    makeCurrent();
+    if (edl_.depth) {
+        glDeleteTextures(1, &edl_.depth);
+    }
+    edl_.program.reset();
+    doneCurrent();
+}
+
 void OpenGLWidget::resizeGL(const int width, const int height) {
     std::cout << "Resizing " << width << " " << height << std::endl;
     glViewport(0, 0, width, height);
@@ -105,6 +146,207 @@ void OpenGLWidget::initializeGL() {
     glPointSize(pointSize_);
 }
 
+void OpenGLWidget::selectLod() {
+    std::vector<MeshData*> lodMeshes;
+    std::vector<const LodHierarchy*> lods;
+    std::vector<Pvl::Vec3f> eyes;
+    const int budget = Parameters::global().lodBudget;
+    for (auto& p : meshes_) {
+        MeshData& data = p.second;
+        data.lodRanges.clear();
+        if (!data.enabled || !data.lod) {
+            continue;
+        }
+        if (budget <= 0) {
+            // LOD disabled, the full mesh is drawn
+            data.lodRanges.push_back(FaceRange{ 0, uint32_t(data.mesh.faces.size()) });
+            continue;
+        }
+        SrsConv conv(camera_.srs(), data.mesh.srs);
+        lodMeshes.push_back(&data);
+        lods.push_back(data.lod.get());
+        eyes.push_back(conv(camera_.eye()));
+    }
+    if (lods.empty()) {
+        return;
+    }
+    const float pixelScale = height() / (2.f * std::tan(0.5f * fov_));
+    std::vector<std::vector<FaceRange>> ranges;
+    selectClusters(lods, eyes, pixelScale, budget, 1.f, ranges);
+    for (std::size_t i = 0; i < lodMeshes.size(); ++i) {
+        lodMeshes[i]->lodRanges = std::move(ranges[i]);
+    }
+}
+
+void OpenGLWidget::drawFaces(const MeshData& data) {
+    if (!data.lod) {
+        glDrawArrays(GL_TRIANGLES, 0, data.mesh.faces.size() * 3);
+        return;
+    }
+    for (const FaceRange& range : data.lodRanges) {
+        glDrawArrays(GL_TRIANGLES, 3 * range.first, 3 * range.count);
+    }
+}
+
+void OpenGLWidget::streamTiles() {
+    ++frame_;
+    std::vector<MeshData*> pyramidMeshes;
+    for (auto& p : meshes_) {
+        MeshData& data = p.second;
+        if (data.enabled && data.mesh.pyramid && data.hasTexture() && enableTextures_) {
+            pyramidMeshes.push_back(&data);
+        }
+    }
+    if (pyramidMeshes.empty()) {
+        return;
+    }
+    const float pixelScale = height() / (2.f * std::tan(0.5f * fov_));
+    const float aspect = float(width()) / height();
+    const float halfDiagonalFov = std::atan(std::tan(0.5f * fov_) * std::sqrt(1.f + aspect * aspect));
+    const std::size_t tileBytes = std::size_t(TexturePyramid::PADDED_SIZE) * TexturePyramid::PADDED_SIZE * 3;
+    const std::size_t maxTiles = std::max<std::size_t>(
+        std::size_t(Parameters::global().textureMemory) * (1 << 20) / tileBytes / pyramidMeshes.size(), 2);
+    // uploads are slow, the rest is streamed in the following frames
+    const int maxUploads = 8;
+    int uploads = 0;
+    bool missing = false;
+
+    for (MeshData* data : pyramidMeshes) {
+        const TexturePyramid& pyramid = *data->mesh.pyramid;
+        SrsConv conv(camera_.srs(), data->mesh.srs);
+        const Pvl::Vec3f eye = conv(camera_.eye());
+        const Pvl::Vec3f dir = Pvl::normalize(camera_.direction());
+        const int coarsest = pyramid.levels() - 1;
+
+        // finest level with texels not smaller than pixels, coarsest level for nodes outside of the view
+        data->nodeTiles.resize(data->textureNodes.size());
+        for (std::size_t ni = 0; ni < data->textureNodes.size(); ++ni) {
+            const TextureNode& node = data->textureNodes[ni];
+            const int nodeLevel = pyramid.tileLevel(node.tile);
+            const Pvl::Vec3f offset = node.center - eye;
+            const float dist = Pvl::norm(offset);
+            int level = coarsest;
+            if (dist <= node.radius) {
+                level = nodeLevel;
+            } else if (std::acos(std::min(Pvl::dotProd(offset, dir) / dist, 1.f)) -
+                           std::asin(node.radius / dist) <
+                       halfDiagonalFov) {
+                const float pixelSize = (dist - node.radius) / pixelScale;
+                level = int(std::floor(std::log2(pixelSize / node.texelSize)));
+                level = std::min(std::max(level, nodeLevel), coarsest);
+            }
+            data->nodeTiles[ni] = pyramid.ancestor(node.tile, level);
+        }
+
+        // coarser tiles have larger indices, upload them first
+        std::vector<uint32_t> wanted = data->nodeTiles;
+        std::sort(wanted.begin(), wanted.end(), std::greater<uint32_t>());
+        wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+        for (const uint32_t tile : wanted) {
+            if (data->residentTiles.count(tile)) {
+                continue;
+            }
+            if (uploads < maxUploads) {
+                data->residentTiles[tile] = MeshData::ResidentTile{ uploadTile(pyramid, tile), frame_ };
+                ++uploads;
+            } else {
+                missing = true;
+            }
+        }
+
+        for (uint32_t& tile : data->nodeTiles) {
+            while (!data->residentTiles.count(tile)) {
+                tile = pyramid.ancestor(tile, pyramid.tileLevel(tile) + 1);
+            }
+            data->residentTiles[tile].lastUsed = frame_;
+        }
+
+        const uint32_t root = uint32_t(pyramid.numTiles() - 1);
+        while (data->residentTiles.size() > maxTiles) {
+            auto lru = data->residentTiles.end();
+            for (auto iter = data->residentTiles.begin(); iter != data->residentTiles.end(); ++iter) {
+                if (iter->first != root && iter->second.lastUsed < frame_ &&
+                    (lru == data->residentTiles.end() || iter->second.lastUsed < lru->second.lastUsed)) {
+                    lru = iter;
+                }
+            }
+            if (lru == data->residentTiles.end()) {
+                // all tiles are drawn in this frame
+                break;
+            }
+            glDeleteTextures(1, &lru->second.texture);
+            data->residentTiles.erase(lru);
+        }
+    }
+    if (missing) {
+        update();
+    }
+}
+
+GLuint OpenGLWidget::uploadTile(const TexturePyramid& pyramid, const uint32_t tile) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D,
+        0,
+        GL_RGB,
+        TexturePyramid::PADDED_SIZE,
+        TexturePyramid::PADDED_SIZE,
+        0,
+        GL_RGB,
+        GL_UNSIGNED_BYTE,
+        pyramid.tileData(tile));
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return texture;
+}
+
+void OpenGLWidget::drawTiles(const MeshData& data) {
+    const TexturePyramid& pyramid = *data.mesh.pyramid;
+    std::vector<FaceRange> allFaces;
+    if (!data.lod) {
+        allFaces.push_back(FaceRange{ 0, uint32_t(data.mesh.faces.size()) });
+    }
+    const std::vector<FaceRange>& ranges = data.lod ? data.lodRanges : allFaces;
+    const float padded = TexturePyramid::PADDED_SIZE;
+
+    // texture coordinates of the whole texture are mapped to the tile by the texture matrix
+    glMatrixMode(GL_TEXTURE);
+    uint32_t boundTile = uint32_t(-1);
+    for (const FaceRange& range : ranges) {
+        const uint32_t end = range.first + range.count;
+        auto run = std::partition_point(data.textureRuns.begin(),
+            data.textureRuns.end(),
+            [&range](const TextureRun& r) { return r.first + r.count <= range.first; });
+        for (; run != data.textureRuns.end() && run->first < end; ++run) {
+            const uint32_t tile = data.nodeTiles[run->node];
+            if (tile != boundTile) {
+                glBindTexture(GL_TEXTURE_2D, data.residentTiles.at(tile).texture);
+                const int level = pyramid.tileLevel(tile);
+                const Pvl::Vec2i coords = pyramid.tileCoords(tile);
+                // texels of coarser levels are averages of 2x2 texels, so the coordinates are scaled exactly
+                // by the power of two, not by the rounded-up size of the level
+                const float scale = 1.f / (1 << level);
+                const Pvl::Vec2f size(pyramid.size()[0] * scale, pyramid.size()[1] * scale);
+                glLoadIdentity();
+                glTranslatef((TexturePyramid::BORDER - coords[0] * TexturePyramid::TILE_SIZE) / padded,
+                    (TexturePyramid::BORDER - coords[1] * TexturePyramid::TILE_SIZE) / padded,
+                    0.f);
+                glScalef(size[0] / padded, size[1] / padded, 1.f);
+                boundTile = tile;
+            }
+            const uint32_t first = std::max(run->first, range.first);
+            const uint32_t last = std::min(run->first + run->count, end);
+            glDrawArrays(GL_TRIANGLES, 3 * first, 3 * (last - first));
+        }
+    }
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+}
+
 void OpenGLWidget::paintGL() {
     // std::cout << "Called paintGL" << std::endl;
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -126,8 +368,10 @@ void OpenGLWidget::paintGL() {
     glLoadIdentity();
 
     float dist = Pvl::norm(camera_.eye() - camera_.target());
+    const float zNear = 0.001f * dist;
+    const float zFar = 1000.f * dist;
 
-    gluPerspective(fov_ * 180.f / M_PI, float(width()) / height(), 0.001 * dist, 1000. * dist);
+    gluPerspective(fov_ * 180.f / M_PI, float(width()) / height(), zNear, zFar);
 
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
@@ -144,6 +388,8 @@ void OpenGLWidget::paintGL() {
 
     glEnable(GL_LIGHTING);
     glColor3f(0.75, 0.75, 0.75);
+    selectLod();
+    streamTiles();
     // glColor3f(0, 0, 0);
     // glEnable(GL_TEXTURE_2D);
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
@@ -162,7 +408,7 @@ void OpenGLWidget::paintGL() {
         bool useColors;
         if (mesh.pointCloud()) {
             // for point clouds, point colors are considered a texture here
-            useColors = mesh.hasColors() && enableTextures_;
+            useColors = (mesh.hasColors() && enableTextures_) || (enableAo_ && mesh.hasAo());
         } else {
             useColors = mesh.hasColors() || (enableAo_ && mesh.hasAo());
         }
@@ -183,7 +429,10 @@ void OpenGLWidget::paintGL() {
             glEnableClientState(GL_COLOR_ARRAY);
         }
         if (useTexture) {
-            glBindTexture(GL_TEXTURE_2D, mesh.texture);
+            // tiles of streamed textures are bound when drawing
+            if (!mesh.mesh.pyramid) {
+                glBindTexture(GL_TEXTURE_2D, mesh.texture);
+            }
             glEnableClientState(GL_TEXTURE_COORD_ARRAY);
         }
         glEnableClientState(GL_VERTEX_ARRAY);
@@ -236,8 +485,10 @@ void OpenGLWidget::paintGL() {
 
         if (mesh.pointCloud()) {
             glDrawArrays(GL_POINTS, 0, mesh.vis.vertices.size() / 3 / stride);
+        } else if (useTexture && mesh.mesh.pyramid) {
+            drawTiles(mesh);
         } else {
-            glDrawArrays(GL_TRIANGLES, 0, mesh.vis.vertices.size() / 3);
+            drawFaces(mesh);
         }
 
         glDisableClientState(GL_VERTEX_ARRAY);
@@ -262,6 +513,10 @@ void OpenGLWidget::paintGL() {
         }
     }
 
+    if (enableEdl_) {
+        drawEyeDomeLighting(zNear, zFar);
+    }
+
     glDisable(GL_LIGHTING);
     if (wireframe_ || dots_) {
         Pvl::Vec3f delta = -camera_.direction() * 5.e-4f * dist;
@@ -278,7 +533,7 @@ void OpenGLWidget::paintGL() {
             glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
             glEnableClientState(GL_VERTEX_ARRAY);
             glVertexPointer(3, GL_FLOAT, 0, (void*)0);
-            glDrawArrays(GL_TRIANGLES, 0, mesh.vis.vertices.size() / 3);
+            drawFaces(mesh);
             glDisableClientState(GL_VERTEX_ARRAY);
             glBindBuffer(GL_ARRAY_BUFFER, 0);
         }
@@ -448,13 +703,25 @@ inline Color classToColor(const TexturedMesh& mesh, int vi) {
     }
 }
 
-void OpenGLWidget::view(const void* handle, std::string basename, TexturedMesh&& mesh) {
+void OpenGLWidget::view(const void* handle,
+    std::string basename,
+    TexturedMesh&& mesh,
+    std::unique_ptr<LodHierarchy> lod) {
+    waitForHoverQuery();
     bool firstMesh = meshes_.empty();
     bool updateOnly = meshes_.find(handle) != meshes_.end();
     MeshData& data = meshes_[handle];
     data.mesh = std::move(mesh);
     data.basename = basename;
     data.vis = {};
+    data.bvh.reset();
+    data.kdTree.reset();
+    data.topology.reset();
+    if (lod || !updateOnly) {
+        // re-viewing a mesh with unchanged faces keeps its hierarchy
+        data.lod = std::move(lod);
+    }
+    data.lodRanges.clear();
 
     Srs refSrs;
     if (firstMesh) {
@@ -467,12 +734,13 @@ void OpenGLWidget::view(const void* handle, std::string basename, TexturedMesh&&
     if (data.pointCloud()) {
         bool hasNormals = !data.mesh.normals.empty();
         bool hasColors = !data.mesh.colors.empty();
+        bool hasAo = !data.mesh.ao.empty();
         bool hasClasses = !data.mesh.classes.empty();
         data.vis.vertices.reserve(data.mesh.vertices.size() * 3);
         if (hasNormals) {
             data.vis.normals.reserve(data.mesh.vertices.size() * 3);
         }
-        if (hasColors) {
+        if (hasAo || hasColors) {
             data.vis.vertexColors.reserve(data.mesh.vertices.size() * 3);
         }
         if (hasClasses) {
@@ -496,7 +764,12 @@ void OpenGLWidget::view(const void* handle, std::string basename, TexturedMesh&&
                 data.vis.classColors.push_back(c[1]);
                 data.vis.classColors.push_back(c[2]);
             }
-            if (hasColors) {
+            if (hasAo) {
+                uint8_t ao = data.mesh.ao[vi];
+                data.vis.vertexColors.push_back(ao);
+                data.vis.vertexColors.push_back(ao);
+                data.vis.vertexColors.push_back(ao);
+            } else if (hasColors) {
                 const Color& c = data.mesh.colors[vi];
                 data.vis.vertexColors.push_back(c[0]);
                 data.vis.vertexColors.push_back(c[1]);
@@ -510,21 +783,30 @@ void OpenGLWidget::view(const void* handle, std::string basename, TexturedMesh&&
         bool hasAo = !data.mesh.ao.empty();
         bool hasClasses = !data.mesh.classes.empty();
 
-        data.vis.vertices.reserve(data.mesh.faces.size() * 9);
-        data.vis.normals.reserve(data.mesh.faces.size() * 9);
+        if (hasTexture && data.mesh.pyramid) {
+            // reorders the faces, must be done before the buffers are filled
+            assignTiles(
+                *data.mesh.pyramid, data.mesh, data.lod.get(), data.textureRuns, data.textureNodes);
+        }
+
+        // faces of the simplified levels are stored after the mesh faces
+        const std::size_t numFaces = data.numDrawnFaces();
+        data.vis.vertices.reserve(numFaces * 9);
+        data.vis.normals.reserve(numFaces * 9);
         if (hasAo || hasColors) {
-            data.vis.vertexColors.reserve(data.mesh.faces.size() * 9);
+            data.vis.vertexColors.reserve(numFaces * 9);
         }
         if (hasClasses) {
-            data.vis.classColors.reserve(data.mesh.faces.size() * 9);
+            data.vis.classColors.reserve(numFaces * 9);
         }
         if (hasTexture) {
-            data.vis.uv.reserve(data.mesh.faces.size() * 6);
+            data.vis.uv.reserve(numFaces * 6);
         }
-        for (std::size_t fi = 0; fi < data.mesh.faces.size(); ++fi) {
-            Pvl::Vec3f normal = data.mesh.normal(fi);
+        for (std::size_t fi = 0; fi < numFaces; ++fi) {
+            const TexturedMesh::Face& face = data.drawnFace(fi);
+            Pvl::Vec3f normal = data.drawnNormal(fi);
             for (int i = 0; i < 3; ++i) {
-                Pvl::Vec3f vertex = conv(data.mesh.vertices[data.mesh.faces[fi][i]]);
+                Pvl::Vec3f vertex = conv(data.mesh.vertices[face[i]]);
                 data.vis.vertices.push_back(vertex[0]);
                 data.vis.vertices.push_back(vertex[1]);
                 data.vis.vertices.push_back(vertex[2]);
@@ -534,30 +816,34 @@ void OpenGLWidget::view(const void* handle, std::string basename, TexturedMesh&&
                 data.vis.normals.push_back(normal[2]);
 
                 if (hasAo) {
-                    uint8_t ao = data.mesh.ao[3 * fi + i];
+                    uint8_t ao = data.mesh.ao[face[i]];
                     data.vis.vertexColors.push_back(ao);
                     data.vis.vertexColors.push_back(ao);
                     data.vis.vertexColors.push_back(ao);
                 } else if (hasColors) {
-                    Color c = data.mesh.colors[data.mesh.faces[fi][i]];
+                    Color c = data.mesh.colors[face[i]];
                     data.vis.vertexColors.push_back(c[0]);
                     data.vis.vertexColors.push_back(c[1]);
                     data.vis.vertexColors.push_back(c[2]);
                 }
                 if (hasClasses) {
-                    Color c = classToColor(data.mesh, data.mesh.faces[fi][i]);
+                    Color c = classToColor(data.mesh, face[i]);
                     data.vis.classColors.push_back(c[0]);
                     data.vis.classColors.push_back(c[1]);
                     data.vis.classColors.push_back(c[2]);
                 }
                 if (hasTexture) {
-                    Pvl::Vec2f uv = data.mesh.uv[data.mesh.texIds[fi][i]];
+                    Pvl::Vec2f uv = data.mesh.uv[data.drawnTexIds(fi)[i]];
                     data.vis.uv.push_back(uv[0]);
                     data.vis.uv.push_back(1.f - uv[1]);
                 }
             }
         }
-        if (hasTexture && !updateOnly) {
+        if (hasTexture && !updateOnly && data.mesh.pyramid) {
+            data.texture = 0;
+            const uint32_t root = uint32_t(data.mesh.pyramid->numTiles() - 1);
+            data.residentTiles[root] = MeshData::ResidentTile{ uploadTile(*data.mesh.pyramid, root), 0 };
+        } else if (hasTexture && !updateOnly && data.mesh.texture) {
             /// \todo allow editing texture?
             glGenTextures(1, &data.texture);
             glBindTexture(GL_TEXTURE_2D, data.texture);
@@ -568,9 +854,7 @@ void OpenGLWidget::view(const void* handle, std::string basename, TexturedMesh&&
 
             ITexture& tex = *data.mesh.texture;
             Pvl::Vec2i size = tex.size();
-            int maxTextureSize;
-            glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
-            std::cout << "Max texture size = " << maxTextureSize << std::endl;
+            std::cout << "Max texture size = " << maxTextureSize() << std::endl;
             int format = toGlFormat(tex.format());
             int internal = tex.format() == ImageFormat::GRAY ? GL_LUMINANCE : GL_RGB;
             glTexImage2D(
@@ -629,6 +913,7 @@ void OpenGLWidget::deleteMesh(const void* handle) {
         // nothing?
         return;
     }
+    waitForHoverQuery();
     MeshData& mesh = meshes_.at(handle);
     if (vbos_) {
         glDeleteBuffers(1, &mesh.vbo);
@@ -636,6 +921,9 @@ void OpenGLWidget::deleteMesh(const void* handle) {
     if (meshes_.at(handle).hasTexture()) {
         glDeleteTextures(1, &mesh.texture);
     }
+    for (const auto& p : mesh.residentTiles) {
+        glDeleteTextures(1, &p.second.texture);
+    }
     meshes_.erase(handle);
     update();
 }
@@ -648,6 +936,122 @@ void OpenGLWidget::updateCamera() {
     camera_ = Camera(eye, target, up, fov_, srs, Pvl::Vec2i(width(), height()));
 }
 
+// Eye-dome lighting, see "Non photo-realistic lighting for the visualization of point clouds" (Boucheny 2009).
+// Each pixel is darkened by the log-depth differences to its closer neighbors, which gives the shape of
+// unlit point clouds without normals.
+static const char* edlFragmentShader = R"(
+#version 120
+uniform sampler2D depthMap;
+uniform vec2 pixelSize;
+uniform float zNear;
+uniform float zFar;
+uniform float strength;
+
+float logDepth(vec2 uv) {
+    float d = texture2D(depthMap, uv).r;
+    if (d >= 1.0) {
+        // background
+        return 1.e9;
+    }
+    float z = 2.0 * zNear * zFar / (zFar + zNear - (2.0 * d - 1.0) * (zFar - zNear));
+    return log2(z);
+}
+
+void main() {
+    vec2 uv = gl_TexCoord[0].st;
+    float center = logDepth(uv);
+    if (center > 1.e8) {
+        gl_FragColor = vec4(1.0);
+        return;
+    }
+    float response = 0.0;
+    for (int i = 0; i < 8; ++i) {
+        float phi = float(i) * 0.785398;
+        vec2 offset = 1.5 * vec2(cos(phi), sin(phi)) * pixelSize;
+        response += max(0.0, center - logDepth(uv + offset));
+    }
+    float shade = exp(-strength * response);
+    gl_FragColor = vec4(shade, shade, shade, 1.0);
+}
+)";
+
+void OpenGLWidget::drawEyeDomeLighting(const float zNear, const float zFar) {
+    if (!edl_.program) {
+        edl_.program = std::make_unique<QOpenGLShaderProgram>();
+        if (!edl_.program->addShaderFromSourceCode(QOpenGLShader::Fragment, edlFragmentShader) ||
+            !edl_.program->link()) {
+            std::cout << "Cannot compile eye-dome lighting shader: " << edl_.program->log().toStdString()
+                      << std::endl;
+            enableEdl_ = false;
+            edl_.program.reset();
+            return;
+        }
+    }
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    const Pvl::Vec2i size(viewport[2], viewport[3]);
+    if (!edl_.depth) {
+        glGenTextures(1, &edl_.depth);
+    }
+    glBindTexture(GL_TEXTURE_2D, edl_.depth);
+    if (size[0] != edl_.size[0] || size[1] != edl_.size[1]) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D,
+            0,
+            GL_DEPTH_COMPONENT24,
+            size[0],
+            size[1],
+            0,
+            GL_DEPTH_COMPONENT,
+            GL_FLOAT,
+            nullptr);
+        edl_.size = size;
+    }
+    // copies the depth buffer of the current frame, no need to render the scene into a separate target
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewport[0], viewport[1], size[0], size[1]);
+
+    // full-screen quad multiplying the frame by the shading factor
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_DST_COLOR, GL_ZERO);
+
+    edl_.program->bind();
+    edl_.program->setUniformValue("depthMap", 0);
+    edl_.program->setUniformValue("pixelSize", QVector2D(1.f / size[0], 1.f / size[1]));
+    edl_.program->setUniformValue("zNear", zNear);
+    edl_.program->setUniformValue("zFar", zFar);
+    edl_.program->setUniformValue("strength", 4.f);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0);
+    glVertex2f(-1, -1);
+    glTexCoord2f(1, 0);
+    glVertex2f(1, -1);
+    glTexCoord2f(1, 1);
+    glVertex2f(1, 1);
+    glTexCoord2f(0, 1);
+    glVertex2f(-1, 1);
+    glEnd();
+    edl_.program->release();
+
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+}
+
 void OpenGLWidget::resetCamera() {
     resetCamera(camera_.srs());
 }
@@ -717,6 +1121,10 @@ void OpenGLWidget::screenshot(const QString& file) {
 void OpenGLWidget::saveAsMesh(const QString& file,
     const std::vector<const void*>& handles,
     std::function<bool(float)> progress) {
+    if (QFileInfo(file).suffix() == "mpcv") {
+        saveMpcv(file.toStdString(), meshes_[handles.front()].mesh);
+        return;
+    }
     std::ofstream ofs(file.toStdString());
     std::vector<const TexturedMesh*> meshes;
     for (auto handle : handles) {
@@ -771,51 +1179,77 @@ void OpenGLWidget::mousePressEvent(QMouseEvent* event) {
 void OpenGLWidget::mouseDoubleClickEvent(QMouseEvent* event) {
     mouse_.pos0 = event->pos();
 
-    CameraRay ray = camera_.project(Pvl::Vec2f(mouse_.pos0.x(), mouse_.pos0.y()));
+    if (Pvl::Optional<PickResult> picked = pick(camera_, mouse_.pos0)) {
+        camera_.lookAt(picked.value().position);
+    }
+    update();
+}
 
-    const float t_inf = std::numeric_limits<float>::max();
-    float mesh_min = t_inf;
-    float pc_min = t_inf;
-    tbb::mutex mutex;
-    for (const auto& p : meshes_) {
-        if (!p.second.enabled) {
+void OpenGLWidget::buildPickIndex(MeshData& data) {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    const TexturedMesh& mesh = data.mesh;
+    if (data.pointCloud()) {
+        data.kdTree = std::make_unique<KdTree>();
+        data.kdTree->build(mesh.vertices.data(), mesh.vertices.size());
+    } else {
+        std::vector<BvhTriangle> triangles;
+        triangles.reserve(mesh.faces.size());
+        for (std::size_t fi = 0; fi < mesh.faces.size(); ++fi) {
+            const TexturedMesh::Face& f = mesh.faces[fi];
+            triangles.emplace_back(mesh.vertices[f[0]], mesh.vertices[f[1]], mesh.vertices[f[2]], int(fi));
+        }
+        data.bvh = std::make_unique<Bvh<BvhTriangle>>();
+        data.bvh->build(std::move(triangles));
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    std::cout << "Picking index built in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms"
+              << std::endl;
+}
+
+Pvl::Optional<OpenGLWidget::PickResult> OpenGLWidget::pick(const Camera& camera, const QPoint& pos) {
+    CameraRay ray = camera.project(Pvl::Vec2f(pos.x(), pos.y()));
+    // picking radius of points in pixels, converted to the angular size
+    const float radius = std::max(pointSize_, 4.f);
+    const float tanRadius = radius * 2.f * std::tan(0.5f * camera.fov()) / camera.dimensions()[1];
+
+    Pvl::Optional<PickResult> result;
+    float t_min = std::numeric_limits<float>::max();
+    for (auto& p : meshes_) {
+        MeshData& data = p.second;
+        if (!data.enabled || data.mesh.vertices.empty()) {
             continue;
         }
-        const TexturedMesh& mesh = p.second.mesh;
-        if (p.second.pointCloud()) {
-            std::vector<float> zs(mesh.vertices.size());
-            for (std::size_t i = 0; i < zs.size(); ++i) {
-                zs[i] = mesh.vertices[i][2];
+        {
+            // may be called from the hover query as well as from the GUI thread
+            tbb::mutex::scoped_lock lock(hover_->indexMutex);
+            if (!data.bvh && !data.kdTree) {
+                buildPickIndex(data);
             }
-            int q10 = zs.size() / 10;
-            std::nth_element(zs.begin(), zs.begin() + q10, zs.end());
-            float t = (zs[q10] - ray.origin[2]) / ray.dir[2];
-            if (t > 0 && t < pc_min) {
-                tbb::mutex::scoped_lock lock(mutex);
-                pc_min = t;
+        }
+        // SRSs differ only by translation, so the ray parameter is the same in both
+        SrsConv conv(camera.srs(), data.mesh.srs);
+        Ray localRay(conv(ray.origin), ray.dir);
+        float t;
+        uint32_t index;
+        if (data.pointCloud()) {
+            if (!data.kdTree->pick(localRay, tanRadius, index, t)) {
+                continue;
             }
         } else {
-            SrsConv conv(camera_.srs(), mesh.srs);
-            CameraRay localRay{ conv(ray.origin), ray.dir };
-            tbb::parallel_for<std::size_t>(0, mesh.faces.size(), [&](std::size_t fi) {
-                Triangle tri;
-                for (int i = 0; i < 3; ++i) {
-                    tri[i] = mesh.vertices[mesh.faces[fi][i]];
-                }
-                float t;
-                if (intersection(localRay, tri, t) && t > 0 && t < mesh_min) {
-                    tbb::mutex::scoped_lock lock(mutex);
-                    mesh_min = t;
-                }
-            });
+            IntersectionInfo is;
+            if (!data.bvh->getFirstIntersection(localRay, is)) {
+                continue;
+            }
+            t = is.t;
+            index = is.object->userData;
+        }
+        if (t < t_min) {
+            t_min = t;
+            result = PickResult{ p.first, ray.origin + ray.dir * t, index };
         }
     }
-    float t_min = (mesh_min < t_inf) ? mesh_min : pc_min;
-    if (t_min != t_inf) {
-        Pvl::Vec3f target = ray.origin + ray.dir * t_min;
-        camera_.lookAt(target);
-    }
-    update();
+    return result;
 }
 
 void OpenGLWidget::mouseMoveEvent(QMouseEvent* ev) {
@@ -837,200 +1271,199 @@ void OpenGLWidget::mouseMoveEvent(QMouseEvent* ev) {
     }
 
     if (mouseMotionCallback) {
-        QPoint p = ev->pos();
-        CameraRay ray = camera_.project(Pvl::Vec2f(p.x(), p.y()));
-        // intersection with z=0
-        if (std::abs(ray.dir[2]) < 1.e-6) {
-            mouseMotionCallback("Coordinate: N/A");
-        } else {
-            double t = -ray.origin[2] / ray.dir[2];
-            Coords p = camera_.srs().localToWorld(coords(ray.origin + t * ray.dir));
-            mouseMotionCallback(
-                "Coordinate: " + QString::number(p[0], 'f') + ", " + QString::number(p[1], 'f'));
-        }
+        hover_->pos = ev->pos();
+        hover_->timer->start();
     }
 }
 
-template <typename MeshFunc>
-void OpenGLWidget::meshOperation(const MeshFunc& meshFunc) {
-    std::vector<std::pair<const void*, MeshData*>> meshData;
-    // cannot erase from meshes_ while iterating, so add it to a vector
-    for (auto& p : meshes_) {
-        if (!p.second.pointCloud()) {
-            meshData.emplace_back(p.first, &p.second);
-        }
+void OpenGLWidget::startHoverQuery() {
+    if (!mouseMotionCallback || meshes_.empty()) {
+        return;
     }
-    // also backup camera
-    auto cameraState = camera_;
-
-    for (const auto& p : meshData) {
-        const void* handle = p.first;
-        TexturedMesh mesh = std::move(p.second->mesh);
-        std::string basename = p.second->basename;
-        deleteMesh(handle);
-        Pvl::TriangleMesh<Pvl::Vec3f> trimesh;
-        for (const Pvl::Vec3f& p : mesh.vertices) {
-            trimesh.addVertex();
-            trimesh.points.push_back(p);
-        }
-        /// \todo external point storage?
-        mesh.vertices = {}; // free memory
-        for (const TexturedMesh::Face& f : mesh.faces) {
-            trimesh.addFace(Pvl::VertexHandle(f[0]), Pvl::VertexHandle(f[1]), Pvl::VertexHandle(f[2]));
-        }
-        mesh.faces = {};
-
-        meshFunc(trimesh);
-
-        for (const Pvl::Vec3f& p : trimesh.points) {
-            mesh.vertices.push_back(p);
-        }
-        for (Pvl::FaceHandle fh : trimesh.faceRange()) {
-            if (!trimesh.valid(fh)) {
-                continue;
-            }
-            auto face = trimesh.faceVertices(fh);
-            mesh.faces.push_back(TexturedMesh::Face{ face[0].index(), face[1].index(), face[2].index() });
-        }
-        view(handle, basename, std::move(mesh));
+    if (hover_->running || hover_->busy) {
+        // previous query not finished yet or the meshes are being modified, try again later
+        hover_->timer->start();
+        return;
     }
-
-    camera_ = cameraState;
-    update();
-}
-
-void OpenGLWidget::laplacianSmooth() {
-    meshOperation([](Pvl::TriangleMesh<Pvl::Vec3f>& mesh) { Pvl::laplacianSmoothing(mesh, true, 0.f); });
-}
-
-void OpenGLWidget::simplify() {
-    meshOperation([](Pvl::TriangleMesh<Pvl::Vec3f>& mesh) {
-        // decimate to 1/4 faces
-        Pvl::PreventFaceFoldDecorator<Pvl::QuadricDecimator<Pvl::TriangleMesh<Pvl::Vec3f>>> decimator(mesh);
-        Pvl::simplify(mesh, decimator, Pvl::FaceCountStop(3 * mesh.numFaces() / 4));
+    hover_->running = true;
+    Camera camera = camera_;
+    QPoint pos = hover_->pos;
+    hover_->group.run([this, camera, pos] {
+        QString text = describePick(camera, pos);
+        hover_->running = false;
+        QMetaObject::invokeMethod(
+            this,
+            [this, text] {
+                if (mouseMotionCallback) {
+                    mouseMotionCallback(text);
+                }
+            },
+            Qt::QueuedConnection);
     });
 }
 
-#ifdef HAS_OPENVDB
-
-namespace {
-class MeshAdapter {
-    TexturedMesh& mesh_;
-    openvdb::math::Transform::Ptr tr_;
-
-
-public:
-    MeshAdapter(TexturedMesh& mesh, openvdb::math::Transform::Ptr tr)
-        : mesh_(mesh)
-        , tr_(tr) {}
-
-    size_t polygonCount() const {
-        return mesh_.faces.size();
+QString OpenGLWidget::describePick(const Camera& camera, const QPoint& pos) {
+    Pvl::Optional<PickResult> picked = pick(camera, pos);
+    if (!picked) {
+        return "Coordinate: N/A";
     }
-    size_t pointCount() const {
-        return mesh_.vertices.size();
+    const MeshData& data = meshes_.at(picked.value().handle);
+    const TexturedMesh& mesh = data.mesh;
+    uint32_t vi;
+    Coords p;
+    if (data.pointCloud()) {
+        vi = picked.value().index;
+        p = mesh.srs.localToWorld(coords(mesh.vertices[vi]));
+    } else {
+        // report the attributes of the closest vertex of the face
+        SrsConv conv(camera.srs(), mesh.srs);
+        const Pvl::Vec3f hit = conv(picked.value().position);
+        const TexturedMesh::Face& f = mesh.faces[picked.value().index];
+        vi = f[0];
+        for (int i = 1; i < 3; ++i) {
+            if (Pvl::norm(mesh.vertices[f[i]] - hit) < Pvl::norm(mesh.vertices[vi] - hit)) {
+                vi = f[i];
+            }
+        }
+        p = mesh.srs.localToWorld(coords(hit));
     }
-    size_t vertexCount(size_t) const {
-        return 3;
+    QString text = "Coordinate: " + QString::number(p[0], 'f', 3) + ", " + QString::number(p[1], 'f', 3) +
+                   ", " + QString::number(p[2], 'f', 3);
+    if (data.hasClasses()) {
+        text += "   Class: " + QString::number(mesh.classes[vi]);
     }
-
-    void getIndexSpacePoint(size_t n, size_t v, openvdb::Vec3d& pos) const {
-        const Pvl::Vec3f& p = mesh_.vertices[mesh_.faces[n][v]];
-        pos = openvdb::Vec3d(p[0], p[1], p[2]);
-        pos = tr_->worldToIndex(pos);
+    if (!mesh.times.empty()) {
+        text += "   GPS time: " + QString::number(mesh.times[vi], 'f', 6);
     }
-};
-} // namespace
-
-void repairMesh(TexturedMesh& mesh) {
-    openvdb::initialize();
-
-    Pvl::Box3f box;
-    for (const Pvl::Vec3f& p : mesh.vertices) {
-        box.extend(p);
+    if (data.hasColors()) {
+        const Color& c = mesh.colors[vi];
+        text += "   Color: " + QString::number(c[0]) + ", " + QString::number(c[1]) + ", " +
+                QString::number(c[2]);
     }
-    float size = std::max({ box.size()[0], box.size()[1], box.size()[2] });
-    openvdb::math::Transform::Ptr tr = openvdb::math::Transform::createLinearTransform(0.000666 * size);
-    MeshAdapter adapter(mesh, tr);
-
-    std::cout << "converting to volume" << std::endl;
-    openvdb::FloatGrid::Ptr grid = openvdb::tools::meshToVolume<openvdb::FloatGrid>(adapter, *tr, 1., 1.);
-    std::cout << "Created volume with " << grid->activeVoxelCount() << " active voxels" << std::endl;
-    std::cout << "converting to mesh" << std::endl;
-    std::vector<openvdb::Vec3s> points;
-    std::vector<openvdb::Vec3I> triangles;
-    std::vector<openvdb::Vec4I> quads;
-    openvdb::tools::volumeToMesh(*grid, points, triangles, quads);
+    return text;
+}
 
-    mesh = {};
-    for (auto p : points) {
-        mesh.vertices.emplace_back(p.x(), p.y(), p.z());
-    }
-    for (auto& f : triangles) {
-        mesh.faces.emplace_back(TexturedMesh::Face{ f[0], f[2], f[1] });
-    }
-    for (auto& f : quads) {
-        mesh.faces.emplace_back(TexturedMesh::Face{ f[0], f[2], f[1] });
-        mesh.faces.emplace_back(TexturedMesh::Face{ f[0], f[3], f[2] });
-    }
+void OpenGLWidget::waitForHoverQuery() {
+    // meshes must not be modified while the query is running
+    hover_->group.wait();
+}
 
-    openvdb::uninitialize();
+namespace {
+enum class MeshChange {
+    GEOMETRY, ///< Only vertex positions have been modified
+    TOPOLOGY, ///< Faces have been modified
+};
 }
 
-void OpenGLWidget::repair() {
-    std::vector<std::pair<const void*, MeshData*>> meshData;
-    // cannot erase from meshes_ while iterating, so add it to a vector
-    for (auto& p : meshes_) {
-        if (!p.second.pointCloud()) {
-            meshData.emplace_back(p.first, &p.second);
+void OpenGLWidget::updateGeometry(const void* handle) {
+    MeshData& data = meshes_[handle];
+    data.bvh.reset();
+    data.box = Pvl::Box3f{};
+    for (const Pvl::Vec3f& p : data.mesh.vertices) {
+        data.box.extend(p);
+    }
+    // same layout as in view, faces are unchanged so the buffer sizes are the same
+    SrsConv conv(data.mesh.srs, camera_.srs());
+    tbb::parallel_for(std::size_t(0), data.numDrawnFaces(), [&](std::size_t fi) {
+        const TexturedMesh::Face& face = data.drawnFace(fi);
+        const Pvl::Vec3f normal = data.drawnNormal(fi);
+        for (int i = 0; i < 3; ++i) {
+            const Pvl::Vec3f vertex = conv(data.mesh.vertices[face[i]]);
+            for (int j = 0; j < 3; ++j) {
+                data.vis.vertices[9 * fi + 3 * i + j] = vertex[j];
+                data.vis.normals[9 * fi + 3 * i + j] = normal[j];
+            }
         }
+    });
+    if (vbos_) {
+        const int numVert = data.vis.vertices.size();
+        const int numNorm = data.vis.normals.size();
+        glBindBuffer(GL_ARRAY_BUFFER, data.vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, numVert * sizeof(float), data.vis.vertices.data());
+        glBufferSubData(
+            GL_ARRAY_BUFFER, numVert * sizeof(float), numNorm * sizeof(float), data.vis.normals.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
-    // also backup camera
-    auto cameraState = camera_;
+}
 
-    for (const auto& p : meshData) {
+template <typename MeshFunc>
+void OpenGLWidget::meshOperation(const MeshFunc& meshFunc) {
+    waitForHoverQuery();
+    BusyGuard guard(*hover_);
+    for (auto& p : meshes_) {
         const void* handle = p.first;
-        TexturedMesh mesh = std::move(p.second->mesh);
-        std::string basename = p.second->basename;
-        deleteMesh(handle);
-        repairMesh(mesh);
-        view(handle, basename, std::move(mesh));
+        MeshData& data = p.second;
+        if (data.pointCloud()) {
+            continue;
+        }
+        // the mesh is modified in place, including all attributes
+        const MeshChange change = meshFunc(data);
+        if (change == MeshChange::TOPOLOGY) {
+            // the hierarchy refers to the old faces
+            data.lod.reset();
+            TexturedMesh mesh = std::move(data.mesh);
+            view(handle, data.basename, std::move(mesh));
+        } else {
+            updateGeometry(handle);
+        }
     }
-
-    camera_ = cameraState;
     update();
 }
 
-#else
-void OpenGLWidget::repair() {}
-
-#endif
-
-void OpenGLWidget::estimateNormals(std::function<bool(std::string, float)> progress) {
-    estimateNormals({}, progress);
+bool OpenGLWidget::smooth(const SmoothingSettings& settings, std::function<bool(float)> progress) {
+    bool cancelled = false;
+    meshOperation([&](MeshData& data) {
+        // all iterations run on the cached topology, the buffers are updated once at the end
+        if (!cancelled && !Mpcv::smooth(data.mesh, data.getTopology(), settings, progress)) {
+            cancelled = true;
+        }
+        return MeshChange::GEOMETRY;
+    });
+    return !cancelled;
 }
 
-struct TrajPoint {
-    Coords p;
-    double t;
-
-    TrajPoint() = default;
-
-    TrajPoint(const Coords& p, double t)
-        : p(p)
-        , t(t) {}
+bool OpenGLWidget::simplify(const float faceRatio, const float maxError, std::function<bool(float)> progress) {
+    bool cancelled = false;
+    meshOperation([&](MeshData& data) {
+        TexturedMesh& mesh = data.mesh;
+        DecimationSettings settings;
+        settings.targetFaces = std::size_t(faceRatio * mesh.faces.size());
+        if (maxError > 0.f) {
+            settings.maxError = maxError;
+        }
+        if (!cancelled && !decimate(mesh, settings, progress)) {
+            cancelled = true;
+        }
+        removeUnreferencedVertices(mesh);
+        std::cout << "Simplified mesh '" << data.basename << "' to " << mesh.faces.size() << " faces" << std::endl;
+        return MeshChange::TOPOLOGY;
+    });
+    return !cancelled;
+}
 
-    bool operator<(const TrajPoint& other) const {
-        return t < other.t;
-    }
-};
+bool OpenGLWidget::repair(const RepairSettings& settings, std::function<bool(float)> progress) {
+    bool cancelled = false;
+    meshOperation([&](MeshData& data) {
+        if (cancelled) {
+            return MeshChange::GEOMETRY;
+        }
+        if (!repairMesh(data.mesh, settings, progress)) {
+            // the mesh is unchanged
+            cancelled = true;
+            return MeshChange::GEOMETRY;
+        }
+        return MeshChange::TOPOLOGY;
+    });
+    return !cancelled;
+}
 
-static std::size_t filesize(const std::string& filename) {
-    std::ifstream in(filename, std::ifstream::ate | std::ifstream::binary);
-    return in.tellg();
+void OpenGLWidget::estimateNormals(std::function<bool(std::string, float)> progress) {
+    estimateNormals({}, progress);
 }
 
 void OpenGLWidget::estimateNormals(const QString& trajectory, std::function<bool(std::string, float)> progress) {
+    waitForHoverQuery();
+    BusyGuard guard(*hover_);
     std::vector<std::pair<const void*, MeshData*>> meshData;
     // cannot erase from meshes_ while iterating, so add it to a vector
     for (auto& p : meshes_) {
@@ -1041,81 +1474,59 @@ void OpenGLWidget::estimateNormals(const QString& trajectory, std::function<bool
     // also backup camera
     auto cameraState = camera_;
 
-    std::vector<TrajPoint> traj;
+    Trajectory traj;
     if (!trajectory.isEmpty()) {
-        std::ifstream ifs(trajectory.toStdString());
-        std::string line;
-        double t_min = 1.e20;
-        double t_max = 0;
-        int lineCnt = 0;
-        std::size_t finalPos = filesize(trajectory.toStdString());
-        while (std::getline(ifs, line)) {
-            // commas -> whitespaces
-            for (char& c : line) {
-                if (c == ',') {
-                    c = ' ';
-                }
-            }
-            std::stringstream ss(line);
-            double x, y, z, t;
-            ss >> x >> y >> z >> t;
-            traj.emplace_back(Coords(x, y, z), t);
-            t_min = std::min(t_min, t);
-            t_max = std::max(t_max, t);
-
-            lineCnt++;
-            if (lineCnt % 100 == 0) {
-                std::size_t pos = ifs.tellg();
-                if (progress("Parsing trajectory", pos * 100.f / finalPos)) {
-                    return;
-                }
-            }
+        traj = Trajectory::load(
+            trajectory.toStdString(), [progress](float p) { return progress("Parsing trajectory", p); });
+        if (traj.empty()) {
+            return;
         }
-        std::sort(traj.begin(), traj.end());
-        std::cout << "Trajectory time extent = " << t_min << " " << t_max << std::endl;
+        std::cout << "Trajectory time extent = " << traj.startTime() << " " << traj.endTime() << std::endl;
     }
 
     for (const auto& p : meshData) {
-        /// \todo only update? (add normals)
         const void* handle = p.first;
-
-        std::vector<Pvl::Vec3f>& points = p.second->mesh.vertices;
-        std::vector<double>& times = p.second->mesh.times;
-        std::vector<Pvl::Vec3f>& normals = p.second->mesh.normals;
-        normals = Pvl::estimateNormals<Pvl::ParallelTag>(points, [progress](float p) {
-            return progress("Estimating normals", p);
-        });
-
-        if (!traj.empty() && !times.empty()) {
-            std::size_t count = points.size();
-            double t_min = 1.e20;
-            double t_max = 0;
-            for (std::size_t i = 0; i < count; ++i) {
-                auto iter =
-                    std::lower_bound(traj.begin(), traj.end(), times[i], [](const TrajPoint& tr, double t) {
-                        return tr.t < t;
-                    });
-                Coords sensor;
-                if (iter != traj.end()) {
-                    sensor = iter->p;
-                } else {
-                    sensor = traj.back().p;
-                }
-                sensor = p.second->mesh.srs.worldToLocal(sensor);
-                float dot = Pvl::dotProd(normals[i], vec3f(sensor) - points[i]);
-                if (dot < 0) {
-                    normals[i] *= -1;
-                }
-                t_min = std::min(t_min, times[i]);
-                t_max = std::max(t_max, times[i]);
+        MeshData& data = *p.second;
+        TexturedMesh& cloud = data.mesh;
+
+        // the picking index is reused, the points do not move
+        if (!data.kdTree) {
+            // built aside and published at once, picking must not see a partially built tree
+            progress("Building kd-tree", 0.f);
+            std::unique_ptr<KdTree> kdTree = std::make_unique<KdTree>();
+            kdTree->build(cloud.vertices.data(), cloud.vertices.size());
+            tbb::mutex::scoped_lock lock(hover_->indexMutex);
+            data.kdTree = std::move(kdTree);
+        }
+        if (!traj.empty() && cloud.times.empty() && cloud.timesLoader) {
+            cloud.times = cloud.timesLoader([progress](float p) { return progress("Loading GPS times", p); });
+            if (cloud.times.size() != cloud.vertices.size()) {
+                std::cout << "Cannot load GPS times of '" << data.basename << "', orienting normals upwards"
+                          << std::endl;
+                cloud.times.clear();
             }
-            std::cout << "Lidar time extents = " << t_min << " " << t_max << std::endl;
         }
+        NormalResult result;
+        const bool finished = Mpcv::estimateNormals(cloud.vertices,
+            *data.kdTree,
+            cloud.times,
+            traj,
+            cloud.srs,
+            NormalSettings{},
+            result,
+            [progress](float p) { return progress("Estimating normals", p); });
+        if (!finished) {
+            break;
+        }
+        cloud.normals = std::move(result.normals);
 
-        TexturedMesh mesh = std::move(p.second->mesh);
-        std::string basename = p.second->basename;
+        // moving the mesh keeps the vertex array, so the tree stays valid
+        std::unique_ptr<KdTree> kdTree = std::move(data.kdTree);
+        TexturedMesh mesh = std::move(cloud);
+        std::string basename = data.basename;
         deleteMesh(handle);
         view(handle, basename, std::move(mesh));
+        meshes_[handle].kdTree = std::move(kdTree);
     }
 
     camera_ = cameraState;
@@ -1123,32 +1534,99 @@ void OpenGLWidget::estimateNormals(const QString& trajectory, std::function<bool
 }
 
 void OpenGLWidget::computeAmbientOcclusion(std::function<bool(float)> progress) {
-    std::vector<TexturedMesh> meshes;
-    std::map<const void*, int> handleIndexMap;
+    waitForHoverQuery();
+    BusyGuard guard(*hover_);
+    std::vector<TexturedMesh*> meshes;
+    std::vector<const void*> handles;
+    std::vector<TexturedMesh*> clouds;
+    std::vector<const void*> cloudHandles;
     for (auto& p : meshes_) {
-        const void* handle = p.first;
-        if (p.second.pointCloud() || !p.second.enabled || !p.second.vis.vertexColors.empty()) {
-            // pc, not visible or already computed
+        if (!p.second.enabled) {
             continue;
         }
-        handleIndexMap[handle] = meshes.size();
-        meshes.emplace_back(std::move(p.second.mesh));
+        if (p.second.pointCloud()) {
+            if (!p.second.hasAo()) {
+                cloudHandles.push_back(p.first);
+                clouds.push_back(&p.second.mesh);
+            }
+        } else if (p.second.vis.vertexColors.empty()) {
+            handles.push_back(p.first);
+            meshes.push_back(&p.second.mesh);
+        }
     }
+    AoSettings settings;
+    settings.radius = Parameters::global().aoRadius;
+    bool finished = true;
     if (!meshes.empty()) {
-        if (!ambientOcclusion(meshes, progress)) {
-            return;
+        // shows the intermediate results after each round
+        auto roundFinished = [this, &handles] {
+            for (const void* handle : handles) {
+                updateAo(handle);
+            }
+            enableAo(true);
+        };
+        finished = ambientOcclusion(meshes, progress, settings, roundFinished);
+        for (const void* handle : handles) {
+            // rebuilds the vertex colors, or removes the partial result if cancelled
+            MeshData& data = meshes_[handle];
+            TexturedMesh mesh = std::move(data.mesh);
+            view(handle, data.basename, std::move(mesh));
         }
-        for (auto& p : meshes_) {
-            const void* handle = p.first;
-            if (handleIndexMap.find(handle) != handleIndexMap.end()) {
-                view(handle, p.second.basename, std::move(meshes[handleIndexMap[handle]]));
+    }
+    if (finished && !clouds.empty()) {
+        finished = pointCloudOcclusion(clouds, progress, settings);
+        if (finished) {
+            for (const void* handle : cloudHandles) {
+                MeshData& data = meshes_[handle];
+                TexturedMesh mesh = std::move(data.mesh);
+                view(handle, data.basename, std::move(mesh));
             }
         }
     }
-    enableAo(true);
+    if (finished) {
+        enableAo(true);
+    }
 }
 
-bool OpenGLWidget::renderView() {
+void OpenGLWidget::updateAo(const void* handle) {
+    MeshData& data = meshes_[handle];
+    if (data.vis.vertexColors.empty()) {
+        // first preview, the buffer does not have space for the colors yet
+        TexturedMesh mesh = std::move(data.mesh);
+        view(handle, data.basename, std::move(mesh));
+        return;
+    }
+    // same layout as in view, including the faces of the simplified levels
+    tbb::parallel_for(std::size_t(0), data.numDrawnFaces(), [&](std::size_t fi) {
+        const TexturedMesh::Face& f = data.drawnFace(fi);
+        for (int i = 0; i < 3; ++i) {
+            const uint8_t ao = data.mesh.ao[f[i]];
+            for (int j = 0; j < 3; ++j) {
+                data.vis.vertexColors[9 * fi + 3 * i + j] = ao;
+            }
+        }
+    });
+    if (vbos_) {
+        const int numVert = data.vis.vertices.size();
+        const int numNorm = data.vis.normals.size();
+        glBindBuffer(GL_ARRAY_BUFFER, data.vbo);
+        glBufferSubData(GL_ARRAY_BUFFER,
+            (numVert + numNorm) * sizeof(float),
+            data.vis.vertexColors.size() * sizeof(uint8_t),
+            data.vis.vertexColors.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+int OpenGLWidget::maxTextureSize() {
+    if (maxTextureSize_ == 0 && isValid()) {
+        makeCurrent();
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize_);
+    }
+    return maxTextureSize_;
+}
+
+bool OpenGLWidget::renderView(RenderBuffers buffers) {
     std::vector<TexturedMesh*> meshesToRender;
     for (auto& p : meshes_) {
         if (p.second.pointCloud() || !p.second.enabled) {
@@ -1159,9 +1637,14 @@ bool OpenGLWidget::renderView() {
     if (meshesToRender.empty()) {
         return false;
     }
+    Pvl::Vec2i resolution = renderSettings_.resolution;
+    if (buffers.passes > 0) {
+        resolution = buffers.color.dimension();
+    }
     FrameBufferWidget* frame = new FrameBufferWidget(this);
+    frame->buffers() = std::move(buffers);
     frame->show();
-    frame->run([this, frame, meshesToRender] {
+    frame->run([this, frame, meshesToRender, resolution] {
         RenderWire wire = RenderWire::NOTHING;
         if (wireframe_) {
             wire = RenderWire::EDGES;
@@ -1169,13 +1652,11 @@ bool OpenGLWidget::renderView() {
             wire = RenderWire::DOTS;
         }
         renderSettings_.wire = wire;
-        Camera renderCamera(camera_.eye(),
-                            camera_.target(),
-                            camera_.up(),
-                            camera_.fov(),
-                            camera_.srs(),
-                            renderSettings_.resolution);
-        renderMeshes(frame, meshesToRender, renderCamera, renderSettings_);
+        RenderSettings settings = renderSettings_;
+        settings.resolution = resolution;
+        Camera renderCamera(
+            camera_.eye(), camera_.target(), camera_.up(), camera_.fov(), camera_.srs(), resolution);
+        renderMeshes(frame, frame->buffers(), meshesToRender, renderCamera, settings);
     });
     return true;
 }
@@ -1,20 +1,30 @@
 #pragma once
 
+#include "bvh.h"
 #include "camera.h"
 #include "coordinates.h"
+#include "kdtree.h"
 #include "mesh.h"
 #include "pvl/Box.hpp"
 #include "pvl/Optional.hpp"
 #include "quaternion.h"
 #include "renderer.h"
+#include "lod.h"
+#include "repair.h"
+#include "smoothing.h"
+#include "topology.h"
+#include "virtualtexture.h"
 #include <GL/glu.h>
 #include <QFileInfo>
 #include <QImageWriter>
 #include <QMouseEvent>
 #include <QOpenGLFunctions>
+#include <QOpenGLShaderProgram>
 #include <QOpenGLWidget>
 #include <QWheelEvent>
 
+struct HoverQuery;
+
 class OpenGLWidget : public QOpenGLWidget, public QOpenGLFunctions {
     Q_OBJECT
 
@@ -35,6 +45,64 @@ class OpenGLWidget : public QOpenGLWidget, public QOpenGLFunctions {
         GLuint texture;
         GLuint vbo;
 
+        // acceleration structures used for picking, built on demand
+        std::unique_ptr<Mpcv::Bvh<Mpcv::BvhTriangle>> bvh;
+        std::unique_ptr<Mpcv::KdTree> kdTree;
+
+        // connectivity used by mesh operations, built on demand and kept until the faces change
+        std::unique_ptr<Mpcv::MeshTopology> topology;
+
+        // multi-resolution representation of large meshes, built on load
+        std::unique_ptr<Mpcv::LodHierarchy> lod;
+
+        // faces of the hierarchy selected for the current frame
+        std::vector<Mpcv::FaceRange> lodRanges;
+
+        // faces grouped by the tiles of the texture pyramid, if the texture is streamed
+        std::vector<Mpcv::TextureRun> textureRuns;
+        std::vector<Mpcv::TextureNode> textureNodes;
+
+        // tile drawn for each node in the current frame
+        std::vector<uint32_t> nodeTiles;
+
+        struct ResidentTile {
+            GLuint texture;
+            uint64_t lastUsed;
+        };
+
+        // uploaded tiles of the texture pyramid, the coarsest tile is always resident
+        std::map<uint32_t, ResidentTile> residentTiles;
+
+        std::size_t numDrawnFaces() const {
+            return mesh.faces.size() + (lod ? lod->faces.size() : 0);
+        }
+
+        const Mpcv::TexturedMesh::Face& drawnFace(const std::size_t fi) const {
+            return lod ? lod->face(mesh, fi) : mesh.faces[fi];
+        }
+
+        const Mpcv::TexturedMesh::Face& drawnTexIds(const std::size_t fi) const {
+            return lod ? lod->texId(mesh, fi) : mesh.texIds[fi];
+        }
+
+        Pvl::Vec3f drawnNormal(const std::size_t fi) const {
+            if (fi < mesh.faces.size()) {
+                return mesh.normal(fi);
+            }
+            const Mpcv::TexturedMesh::Face& f = drawnFace(fi);
+            const Pvl::Vec3f n = Pvl::crossProd(
+                mesh.vertices[f[1]] - mesh.vertices[f[0]], mesh.vertices[f[2]] - mesh.vertices[f[0]]);
+            const float len = Pvl::norm(n);
+            return len > 1.e-20f ? n / len : Pvl::Vec3f(0, 0, 1);
+        }
+
+        const Mpcv::MeshTopology& getTopology() {
+            if (!topology) {
+                topology = std::make_unique<Mpcv::MeshTopology>(mesh);
+            }
+            return *topology;
+        }
+
         bool pointCloud() const {
             return mesh.faces.empty();
         }
@@ -58,6 +126,14 @@ class OpenGLWidget : public QOpenGLWidget, public QOpenGLFunctions {
     };
     // Pvl::Optional<Triangle> selected;
 
+    struct PickResult {
+        const void* handle;
+        // picked position in camera SRS
+        Pvl::Vec3f position;
+        // index of the face (for meshes) or vertex (for point clouds)
+        uint32_t index;
+    };
+
     Mpcv::Camera camera_;
     float fov_ = M_PI / 4.f;
     float pointSize_ = 2.f;
@@ -68,6 +144,14 @@ class OpenGLWidget : public QOpenGLWidget, public QOpenGLFunctions {
     bool enableAo_ = false;
     bool enableTextures_ = true;
     bool enableClasses_ = false;
+    bool enableEdl_ = false;
+
+    // eye-dome lighting pass
+    struct {
+        std::unique_ptr<QOpenGLShaderProgram> program;
+        GLuint depth = 0;
+        Pvl::Vec2i size = Pvl::Vec2i(0, 0);
+    } edl_;
 
     std::map<const void*, MeshData> meshes_;
     bool wireframe_ = false;
@@ -75,6 +159,12 @@ class OpenGLWidget : public QOpenGLWidget, public QOpenGLFunctions {
     bool bboxes_ = false;
     bool vbos_ = true;
 
+    // frame counter used to find the least recently used texture tiles
+    uint64_t frame_ = 0;
+
+    // queried once the GL context exists
+    int maxTextureSize_ = 0;
+
     struct {
         QPoint pos0;
         Mpcv::ArcBall ab;
@@ -83,13 +173,14 @@ class OpenGLWidget : public QOpenGLWidget, public QOpenGLFunctions {
 
     Mpcv::RenderSettings renderSettings_;
 
+    std::unique_ptr<HoverQuery> hover_;
+
 public:
     std::function<void(const QString& text)> mouseMotionCallback;
 
-    OpenGLWidget(QWidget* parent)
-        : QOpenGLWidget(parent) {
-        setMouseTracking(true);
-    }
+    OpenGLWidget(QWidget* parent);
+
+    ~OpenGLWidget();
 
     virtual void initializeGL() override;
 
@@ -97,7 +188,10 @@ public:
 
     virtual void paintGL() override;
 
-    void view(const void* handle, std::string basename, Mpcv::TexturedMesh&& mesh);
+    void view(const void* handle,
+        std::string basename,
+        Mpcv::TexturedMesh&& mesh,
+        std::unique_ptr<Mpcv::LodHierarchy> lod = nullptr);
 
     void toggle(const void* handle, bool on) {
         meshes_[handle].enabled = on;
@@ -124,13 +218,28 @@ public:
         update();
     }
 
+    void eyeDomeLighting(const bool on) {
+        enableEdl_ = on;
+        update();
+    }
+
     void deleteMesh(const void* handle);
 
-    void laplacianSmooth();
+    /// \brief Smooths all meshes in place, keeping their faces and attributes.
+    ///
+    /// \return False if cancelled by the progress callback.
+    bool smooth(const Mpcv::SmoothingSettings& settings, std::function<bool(float)> progress);
 
-    void simplify();
+    /// \brief Simplifies all meshes to given fraction of faces, keeping texture coordinates and colors.
+    ///
+    /// \param maxError Maximal error of the simplification, zero for unlimited.
+    /// \return False if cancelled by the progress callback.
+    bool simplify(float faceRatio, float maxError, std::function<bool(float)> progress);
 
-    void repair();
+    /// \brief Replaces all meshes by the surfaces of their distance fields, closing holes.
+    ///
+    /// \return False if cancelled by the progress callback.
+    bool repair(const Mpcv::RepairSettings& settings, std::function<bool(float)> progress);
 
     void estimateNormals(std::function<bool(std::string, float)> progress);
 
@@ -175,7 +284,14 @@ public:
         renderSettings_ = settings;
     }
 
-    bool renderView();
+    /// \brief Renders the current view in a new window.
+    ///
+    /// \param buffers State of a previous render, e.g. loaded from a checkpoint. If it contains finished
+    ///                passes, the render continues with its resolution; the view is expected to be the same.
+    bool renderView(Mpcv::RenderBuffers buffers = {});
+
+    /// \brief Returns the largest texture supported by the GL context, or 0 if it is not initialized yet.
+    int maxTextureSize();
 
     virtual void wheelEvent(QWheelEvent* event) override;
 
@@ -188,6 +304,42 @@ public:
 private:
     void updateCamera();
 
+    /// \brief Darkens the rendered frame based on the depth differences of neighboring pixels.
+    void drawEyeDomeLighting(float zNear, float zFar);
+
+    Pvl::Optional<PickResult> pick(const Mpcv::Camera& camera, const QPoint& pos);
+
+    void buildPickIndex(MeshData& data);
+
+    void startHoverQuery();
+
+    QString describePick(const Mpcv::Camera& camera, const QPoint& pos);
+
+    void waitForHoverQuery();
+
+    /// \brief Updates the displayed AO of a mesh while it is being computed.
+    void updateAo(const void* handle);
+
+    /// \brief Uploads modified vertex positions of a mesh, the faces and attributes must be unchanged.
+    void updateGeometry(const void* handle);
+
+    /// \brief Selects the clusters of LOD hierarchies drawn in this frame.
+    void selectLod();
+
+    void drawFaces(const MeshData& mesh);
+
+    /// \brief Selects the tiles of the texture pyramids needed for the current view.
+    ///
+    /// Missing tiles are uploaded, coarse ones first, with a limited number per frame; the faces are drawn
+    /// with the finest uploaded ancestor meanwhile. Least recently used tiles are released to keep the memory
+    /// within the budget.
+    void streamTiles();
+
+    GLuint uploadTile(const Mpcv::TexturePyramid& pyramid, uint32_t tile);
+
+    /// \brief Draws the faces with the tiles selected by \ref streamTiles.
+    void drawTiles(const MeshData& mesh);
+
     template <typename MeshFunc>
     void meshOperation(const MeshFunc& meshFunc);
 };
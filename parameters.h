@@ -2,7 +2,9 @@
 
 #include "coordinates.h"
 #include "pvl/Box.hpp"
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace Mpcv {
 
@@ -18,6 +20,15 @@ struct Parameters {
     CloudSubset subset;
     float textureScale;
     int dsmResolution;
+    float aoRadius;
+    float simplifyError;
+    int lodBudget;
+    std::vector<uint8_t> smoothClasses;
+    float repairVoxelSize;
+    int repairMemory;
+    bool useCache;
+    int virtualTextureSize;
+    int textureMemory;
 
     Parameters() {
         extents.lower() = Coords(std::numeric_limits<double>::lowest());
@@ -26,6 +37,14 @@ struct Parameters {
         subset = CloudSubset::ALL;
         textureScale = 1.f;
         dsmResolution = 1000;
+        aoRadius = 0.f;
+        simplifyError = 0.f;
+        lodBudget = 10000000;
+        repairVoxelSize = 0.f;
+        repairMemory = 4096;
+        useCache = false;
+        virtualTextureSize = 16384;
+        textureMemory = 1024;
     }
 
     static Parameters& global() {
@@ -2,14 +2,17 @@
 #include "QCoreApplication"
 #include "bvh.h"
 #include "coordinates.h"
-#include "framebuffer.h"
 #include "pvl/Box.hpp"
 #include "pvl/UniformGrid.hpp"
 #include "pvl/Utils.hpp"
+#include "sampler.h"
+#include <QFileInfo>
 #include <QImage>
 #include <QProgressDialog>
 #include <chrono>
-#include <random>
+#include <cstdio>
+#include <fstream>
+#include <tbb/tbb.h>
 #ifdef HAS_OIDN
 #include <OpenImageDenoise/oidn.hpp>
 #endif
@@ -34,29 +37,140 @@ struct MonoSunSky {
     }
 };
 
+/// \brief Hosek-Wilkie sky model baked into a lat-long radiance table.
+///
+/// The table is rebuilt whenever the sun direction changes. Besides the bilinear lookup, it provides
+/// importance sampling of the sky proportional to the luminance.
 struct HosekWilkieSunSky {
     SSLib::cSunSkyHosek hosek;
     float units = 5.e-4f;
 
+    static constexpr int tableWidth = 512;
+    static constexpr int tableHeight = 256;
+
     void update(const Pvl::Vec3f& sunDir) {
         Vec3f dirToSun(sunDir[0], sunDir[1], sunDir[2]);
         hosek.Update(dirToSun, 2.5f);
+        // the sun disc is small, the color is evaluated for its center only
+        Vec3f sun = SSLib::SunRGB(sunDir[2]);
+        sun_ = units * Pvl::Vec3f(toGamut(sun[0]), toGamut(sun[1]), toGamut(sun[2]));
+
+        sky_.resize(tableWidth * tableHeight);
+        tbb::parallel_for(0, tableHeight, [this](int j) {
+            for (int i = 0; i < tableWidth; ++i) {
+                Pvl::Vec3f dir = direction((i + 0.5f) / tableWidth, (j + 0.5f) / tableHeight);
+                Vec3f sky = hosek.SkyRGB(Vec3f(dir[0], dir[1], dir[2]));
+                sky_[j * tableWidth + i] = units * Pvl::Vec3f(toGamut(sky[0]), toGamut(sky[1]), toGamut(sky[2]));
+            }
+        });
+
+        // texels are sampled proportionally to their luminance and solid angle
+        conditionalCdf_.resize(tableHeight * (tableWidth + 1));
+        marginalCdf_.resize(tableHeight + 1);
+        marginalCdf_[0] = 0.f;
+        for (int j = 0; j < tableHeight; ++j) {
+            const float sinTheta = std::sin(M_PI * (j + 0.5f) / tableHeight);
+            float* cdf = &conditionalCdf_[j * (tableWidth + 1)];
+            cdf[0] = 0.f;
+            for (int i = 0; i < tableWidth; ++i) {
+                cdf[i + 1] = cdf[i] + luminance(sky_[j * tableWidth + i]) * sinTheta;
+            }
+            marginalCdf_[j + 1] = marginalCdf_[j] + cdf[tableWidth];
+            normalizeCdf(cdf, tableWidth);
+        }
+        normalizeCdf(marginalCdf_.data(), tableHeight);
     }
 
     Pvl::Vec3f evalSky(const Pvl::Vec3f& dir) const {
-        Vec3f sky = hosek.SkyRGB(Vec3f(dir[0], dir[1], dir[2]));
-        return units * Pvl::Vec3f(toGamut(sky[0]), toGamut(sky[1]), toGamut(sky[2]));
+        float u, v;
+        toTable(dir, u, v);
+        const float x = u * tableWidth - 0.5f;
+        const float y = std::min(std::max(v * tableHeight - 0.5f, 0.f), float(tableHeight - 1));
+        const int i0 = int(std::floor(x));
+        const int j0 = std::min(int(y), tableHeight - 2);
+        const float fx = x - i0;
+        const float fy = y - j0;
+        // wraps around in azimuth
+        const int i1 = (i0 + 1) % tableWidth;
+        const int i0w = (i0 + tableWidth) % tableWidth;
+        auto texel = [this](int i, int j) { return sky_[j * tableWidth + i]; };
+        return (1.f - fy) * ((1.f - fx) * texel(i0w, j0) + fx * texel(i1, j0)) +
+               fy * ((1.f - fx) * texel(i0w, j0 + 1) + fx * texel(i1, j0 + 1));
     }
 
-    Pvl::Vec3f evalSun(const Pvl::Vec3f& dirToSun) const {
-        Vec3f sun = SSLib::SunRGB(dirToSun[2]);
-        return units * Pvl::Vec3f(toGamut(sun[0]), toGamut(sun[1]), toGamut(sun[2]));
+    Pvl::Vec3f evalSun(const Pvl::Vec3f&) const {
+        return sun_;
+    }
+
+    /// \brief Samples a direction to the sky, returns the direction and its pdf (in solid angle).
+    Pvl::Vec3f sampleSky(const Pvl::Vec2f& sample, float& pdf) const {
+        float du, dv;
+        const int j = sampleCdf(marginalCdf_.data(), tableHeight, sample[1], dv);
+        const int i = sampleCdf(&conditionalCdf_[j * (tableWidth + 1)], tableWidth, sample[0], du);
+        const Pvl::Vec3f dir = direction((i + du) / tableWidth, (j + dv) / tableHeight);
+        pdf = texelPdf(i, j, dir);
+        return dir;
+    }
+
+    /// \brief Returns the pdf of sampleSky generating given direction.
+    float pdfSky(const Pvl::Vec3f& dir) const {
+        float u, v;
+        toTable(dir, u, v);
+        const int i = std::min(int(u * tableWidth), tableWidth - 1);
+        const int j = std::min(int(v * tableHeight), tableHeight - 1);
+        return texelPdf(i, j, dir);
     }
 
 private:
+    std::vector<Pvl::Vec3f> sky_;
+    std::vector<float> marginalCdf_;
+    std::vector<float> conditionalCdf_;
+    Pvl::Vec3f sun_;
+
     inline float toGamut(const float x) const {
         return std::max(x, 0.f);
     }
+
+    static Pvl::Vec3f direction(const float u, const float v) {
+        const float phi = 2.f * M_PI * u;
+        const float theta = M_PI * v;
+        const float sinTheta = std::sin(theta);
+        return Pvl::Vec3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), std::cos(theta));
+    }
+
+    static void toTable(const Pvl::Vec3f& dir, float& u, float& v) {
+        float phi = std::atan2(dir[1], dir[0]);
+        if (phi < 0.f) {
+            phi += 2.f * M_PI;
+        }
+        u = std::min(phi / float(2.f * M_PI), 1.f);
+        v = std::acos(std::min(std::max(dir[2], -1.f), 1.f)) / float(M_PI);
+    }
+
+    static void normalizeCdf(float* cdf, const int n) {
+        const float total = cdf[n];
+        for (int i = 1; i <= n; ++i) {
+            // uniform distribution if everything is black
+            cdf[i] = total > 0.f ? cdf[i] / total : float(i) / n;
+        }
+    }
+
+    static int sampleCdf(const float* cdf, const int n, const float u, float& offset) {
+        const int idx = std::min(std::max(int(std::upper_bound(cdf, cdf + n + 1, u) - cdf) - 1, 0), n - 1);
+        const float width = cdf[idx + 1] - cdf[idx];
+        offset = width > 0.f ? std::min((u - cdf[idx]) / width, 1.f) : 0.5f;
+        return idx;
+    }
+
+    float texelPdf(const int i, const int j, const Pvl::Vec3f& dir) const {
+        const float sinTheta = std::sqrt(std::max(1.f - dir[2] * dir[2], 0.f));
+        if (sinTheta == 0.f) {
+            return 0.f;
+        }
+        const float* cdf = &conditionalCdf_[j * (tableWidth + 1)];
+        const float p = (marginalCdf_[j + 1] - marginalCdf_[j]) * (cdf[i + 1] - cdf[i]);
+        return p * tableWidth * tableHeight / (2.f * M_PI * M_PI * sinTheta);
+    }
 };
 
 
@@ -141,18 +255,6 @@ struct Scene {
       }*/
 };
 
-struct Rng {
-    std::mt19937 gen;
-    std::uniform_real_distribution<float> dist;
-    Rng(std::size_t seed)
-        : gen(seed)
-        , dist(0, 1) {}
-
-    float operator()() {
-        return dist(gen);
-    }
-};
-
 /// \todo deduplicate
 inline Pvl::Vec3f sampleUnitHemiSphere(float x, float y) {
     const float phi = x * 2.f * M_PI;
@@ -161,10 +263,16 @@ inline Pvl::Vec3f sampleUnitHemiSphere(float x, float y) {
     return Pvl::Vec3f(u * std::cos(phi), u * std::sin(phi), z);
 }
 
+inline Pvl::Vec3f sampleCosineHemiSphere(float x, float y) {
+    const float phi = x * 2.f * M_PI;
+    const float r = std::sqrt(y);
+    return Pvl::Vec3f(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(1.f - y, 0.f)));
+}
+
 inline Pvl::Vec2f sampleUnitDisc(float x, float y) {
     float r = std::sqrt(x);
     float phi = 2.f * M_PI * y;
-    return Pvl::Vec2f(r * cos(phi), r * cos(phi));
+    return Pvl::Vec2f(r * std::cos(phi), r * std::sin(phi));
 }
 
 inline Pvl::Vec3f barycentric(const Pvl::Vec3f& p, const std::array<Pvl::Vec3f, 3>& tri) {
@@ -216,23 +324,42 @@ inline float vertexShader(const Pvl::Vec3f& v, const std::array<Pvl::Vec3f, 3>&
     return 1.f;
 }
 
-std::pair<Pvl::Vec3f, Pvl::Vec3f>
-radiance(const Scene& scene,
-         const Mpcv::Ray& ray,
-         const Mpcv::Bvh<Mpcv::BvhTriangle>& bvh,
-         Rng& rng,
-         const RenderWire wire,
-         const int depth = 0) {
-    float eps = 0.01f;
-    Mpcv::IntersectionInfo is;
-    if (bvh.getFirstIntersection(ray, is)) {
+/// \brief Computes the radiance along the ray and the normal of the first hit (zero if the ray escapes).
+///
+/// Iterative path tracer; the sun is sampled explicitly at each vertex and paths are terminated using Russian
+/// roulette after the first bounce.
+std::pair<Pvl::Vec3f, Pvl::Vec3f> radiance(const Scene& scene,
+    const Mpcv::Ray& cameraRay,
+    const Mpcv::Bvh<Mpcv::BvhTriangle>& bvh,
+    Sampler& sampler,
+    const RenderWire wire,
+    const int maxDepth) {
+    const float eps = 0.01f;
+    Pvl::Vec3f result(0.f);
+    Pvl::Vec3f throughput(1.f);
+    Pvl::Vec3f firstNormal(0.f);
+    float bsdfPdf = 0.f;
+    const Pvl::Mat33f sunRotator = Pvl::getRotatorTo(scene.sunDir);
+    Mpcv::Ray ray = cameraRay;
+    for (int depth = 0;; ++depth) {
+        Mpcv::IntersectionInfo is;
+        if (!bvh.getFirstIntersection(ray, is)) {
+            float weight = 1.f;
+            if (depth > 0) {
+                // the sky is also sampled explicitly, use the power heuristic
+                const float skyPdf = scene.sunSky.pdfSky(ray.direction());
+                weight = Pvl::sqr(bsdfPdf) / (Pvl::sqr(bsdfPdf) + Pvl::sqr(skyPdf));
+            }
+            result += weight * throughput * scene.skyMult * scene.sunSky.evalSky(ray.direction());
+            break;
+        }
         const Mpcv::BvhTriangle* tri = static_cast<const Mpcv::BvhTriangle*>(is.object);
         const Pvl::Vec3f pos = ray.origin() + is.t * ray.direction();
-
         const Pvl::Vec3f normal = tri->normal();
-        Pvl::Vec3f result(0.f);
+        if (depth == 0) {
+            firstNormal = normal;
+        }
 
-        // Pvl::Vec3f uvw = barycentric(pos, tri->getTriangle());
         float albedo = scene.albedo;
         switch (wire) {
         case RenderWire::DOTS:
@@ -244,34 +371,27 @@ radiance(const Scene& scene,
         case RenderWire::NOTHING:
             break;
         }
-        // GI
-        if (depth == 0) {
-            Pvl::Mat33f rotator = Pvl::getRotatorTo(normal);
-            int numGiSamples = 10;
-            for (int i = 0; i < numGiSamples; ++i) {
-                Pvl::Vec3f outDir =
-                    Pvl::prod(rotator, sampleUnitHemiSphere(rng(), rng()));
-                Pvl::Vec3f gi;
-                std::tie(gi, std::ignore) =
-                    radiance(scene,
-                             Mpcv::Ray(pos + eps * outDir, outDir),
-                             bvh,
-                             rng,
-                             wire,
-                             depth + 1);
-                float bsdfCos =
-                    albedo * std::max(Pvl::dotProd(outDir, normal), 0.f);
-                result += gi * bsdfCos / numGiSamples;
-            }
-        }
 
         // direct lighting
-        Pvl::Mat33f rotator = Pvl::getRotatorTo(scene.sunDir);
-        Pvl::Vec2f xy = scene.sunRadius * sampleUnitDisc(rng(), rng());
-        Pvl::Vec3f dirToSun = Pvl::prod(rotator, Pvl::normalize(Pvl::Vec3f(xy[0], xy[1], 1.f)));
-        if (!bvh.isOccluded(Mpcv::Ray(pos + eps * dirToSun, dirToSun))) {
-            result += albedo * scene.sunMult * scene.sunSky.evalSun(dirToSun) *
-                      std::max(Pvl::dotProd(normal, dirToSun), 0.f);
+        const Pvl::Vec2f sunSample = sampler.get2D();
+        Pvl::Vec2f xy = scene.sunRadius * sampleUnitDisc(sunSample[0], sunSample[1]);
+        Pvl::Vec3f dirToSun = Pvl::prod(sunRotator, Pvl::normalize(Pvl::Vec3f(xy[0], xy[1], 1.f)));
+        const float sunCos = Pvl::dotProd(normal, dirToSun);
+        if (sunCos > 0.f && !bvh.isOccluded(Mpcv::Ray(pos + eps * dirToSun, dirToSun))) {
+            result += throughput * albedo * scene.sunMult * scene.sunSky.evalSun(dirToSun) * sunCos;
+        }
+
+        float skyPdf;
+        const Pvl::Vec3f dirToSky = scene.sunSky.sampleSky(sampler.get2D(), skyPdf);
+        const float skyCos = Pvl::dotProd(normal, dirToSky);
+        if (skyCos > 0.f && skyPdf > 0.f && !bvh.isOccluded(Mpcv::Ray(pos + eps * dirToSky, dirToSky))) {
+            // the last vertex does not sample the sky by the BSDF
+            const float skyBsdfPdf = skyCos / float(M_PI);
+            const float weight =
+                depth == maxDepth ? 1.f : Pvl::sqr(skyPdf) / (Pvl::sqr(skyPdf) + Pvl::sqr(skyBsdfPdf));
+            const float bsdf = albedo / float(2.f * M_PI); // same normalization as the GI below
+            const Pvl::Vec3f sky = scene.skyMult * scene.sunSky.evalSky(dirToSky);
+            result += weight * throughput * bsdf * skyCos * sky / skyPdf;
         }
 
         for (const Scene::Light& light : scene.lights) {
@@ -280,21 +400,37 @@ radiance(const Scene& scene,
                 continue;
             }
             const Pvl::Vec3f dirToLight = (light.pos - pos) / distToLight;
-            /// \todo range-limited occlusion instead
-            bool hit = bvh.getFirstIntersection(Mpcv::Ray(pos + eps * dirToLight, dirToLight), is);
-            bool visible = !hit || is.t > distToLight - 1.f;
+            // only the segment up to the light can occlude it
+            const Mpcv::Ray shadowRay(pos + eps * dirToLight, dirToLight, 0.f, distToLight - 1.f);
+            bool visible = !bvh.isOccluded(shadowRay);
             bool illuminates = dirToLight[2] > 0; // light.cosAngle;
             if (visible && illuminates) {
                 Pvl::Vec3f intensity = light.intensity * std::pow(dirToLight[2], 20.f);
-                result += albedo * intensity * std::max(Pvl::dotProd(normal, dirToLight), 0.f);
+                result += throughput * albedo * intensity * std::max(Pvl::dotProd(normal, dirToLight), 0.f);
             }
         }
-        return std::make_pair(result, normal);
-    } else {
-        Pvl::Vec3f result =
-            scene.skyMult * scene.sunSky.evalSky(ray.direction());
-        return std::make_pair(result, Pvl::Vec3f(0));
+
+        if (depth == maxDepth) {
+            break;
+        }
+
+        // GI, the cosine is cancelled by the pdf; the weight keeps the normalization of the former
+        // estimator with uniformly sampled hemisphere (albedo * cos / (2 pi * pdf))
+        throughput *= 0.5f * albedo;
+        if (depth > 0) {
+            const float survival = std::min(std::max(throughput[0], std::max(throughput[1], throughput[2])), 0.95f);
+            if (sampler.get1D() >= survival) {
+                break;
+            }
+            throughput /= survival;
+        }
+        const Pvl::Vec2f dirSample = sampler.get2D();
+        const Pvl::Vec3f localDir = sampleCosineHemiSphere(dirSample[0], dirSample[1]);
+        const Pvl::Vec3f outDir = Pvl::prod(Pvl::getRotatorTo(normal), localDir);
+        bsdfPdf = localDir[2] / float(M_PI);
+        ray = Mpcv::Ray(pos + eps * outDir, outDir);
     }
+    return std::make_pair(result, firstNormal);
 }
 
 #ifdef HAS_OIDN
@@ -356,7 +492,197 @@ void denoise(FrameBuffer& colorBuffer, FrameBuffer& normalBuffer) {
 void denoise(FrameBuffer&, FrameBuffer&) {}
 #endif
 
-void renderMeshes(FrameBufferWidget* frame,
+namespace {
+
+Image toImage(const FrameBuffer& buffer) {
+    const Pvl::Vec2i dims = buffer.dimension();
+    Image image(dims);
+    Pvl::ParallelFor<Pvl::ParallelTag>()(0, dims[1], [&](int y) {
+        for (int x = 0; x < dims[0]; ++x) {
+            Pvl::Vec2i pix(x, y);
+            image(pix) = buffer(pix).color;
+        }
+    });
+    return image;
+}
+
+} // namespace
+
+void saveRenderBuffers(const std::string& file, const RenderBuffers& buffers) {
+    const Pvl::Vec2i dims = buffers.color.dimension();
+    QString ext = QFileInfo(QString::fromStdString(file)).suffix().toLower();
+    if (ext == "pfm") {
+        savePfm(file, toImage(buffers.color));
+        return;
+    }
+    if (ext != "exr") {
+        throw std::runtime_error("Unsupported HDR format '" + ext.toStdString() + "'");
+    }
+    std::vector<float> variance(dims[0] * dims[1]);
+    std::vector<float> samples(dims[0] * dims[1]);
+    for (int y = 0; y < dims[1]; ++y) {
+        for (int x = 0; x < dims[0]; ++x) {
+            const Pixel& pixel = buffers.color(Pvl::Vec2i(x, y));
+            variance[y * dims[0] + x] = pixel.weight > 1 ? pixel.variance() : 0.f;
+            samples[y * dims[0] + x] = float(pixel.weight);
+        }
+    }
+    const float* color = &buffers.color(Pvl::Vec2i(0, 0)).color[0];
+    const float* normal = &buffers.normal(Pvl::Vec2i(0, 0)).color[0];
+    const int stride = sizeof(Pixel) / sizeof(float);
+    saveExr(file,
+        dims,
+        {
+            ImageChannel{ "R", color, stride },
+            ImageChannel{ "G", color + 1, stride },
+            ImageChannel{ "B", color + 2, stride },
+            ImageChannel{ "normal.X", normal, stride },
+            ImageChannel{ "normal.Y", normal + 1, stride },
+            ImageChannel{ "normal.Z", normal + 2, stride },
+            ImageChannel{ "variance", variance.data(), 1 },
+            ImageChannel{ "samples", samples.data(), 1 },
+        });
+}
+
+namespace {
+
+const char CHECKPOINT_MAGIC[8] = { 'M', 'P', 'C', 'V', 'C', 'K', 'P', 'T' };
+const int32_t CHECKPOINT_VERSION = 1;
+
+template <typename T>
+void writeValue(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+void readValue(std::istream& in, T& value) {
+    in.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+void writeBuffer(std::ostream& out, const FrameBuffer& buffer) {
+    const Pvl::Vec2i dims = buffer.dimension();
+    for (int y = 0; y < dims[1]; ++y) {
+        for (int x = 0; x < dims[0]; ++x) {
+            // written field by field, independently of the padding of Pixel
+            const Pixel& pixel = buffer(Pvl::Vec2i(x, y));
+            writeValue(out, pixel.color[0]);
+            writeValue(out, pixel.color[1]);
+            writeValue(out, pixel.color[2]);
+            writeValue(out, int32_t(pixel.weight));
+            writeValue(out, pixel.m2);
+        }
+    }
+}
+
+void readBuffer(std::istream& in, FrameBuffer& buffer) {
+    const Pvl::Vec2i dims = buffer.dimension();
+    for (int y = 0; y < dims[1]; ++y) {
+        for (int x = 0; x < dims[0]; ++x) {
+            Pixel& pixel = buffer(Pvl::Vec2i(x, y));
+            int32_t weight;
+            readValue(in, pixel.color[0]);
+            readValue(in, pixel.color[1]);
+            readValue(in, pixel.color[2]);
+            readValue(in, weight);
+            readValue(in, pixel.m2);
+            pixel.weight = weight;
+        }
+    }
+}
+
+} // namespace
+
+void saveCheckpoint(const std::string& file, const RenderBuffers& buffers) {
+    // written into a temporary file first, so that an interrupted save keeps the previous checkpoint
+    const std::string tempFile = file + ".tmp";
+    {
+        std::ofstream out(tempFile, std::ios::binary);
+        out.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        writeValue(out, CHECKPOINT_VERSION);
+        writeValue(out, int32_t(buffers.color.dimension()[0]));
+        writeValue(out, int32_t(buffers.color.dimension()[1]));
+        writeValue(out, int32_t(buffers.passes));
+        writeBuffer(out, buffers.color);
+        writeBuffer(out, buffers.normal);
+        if (!out) {
+            throw std::runtime_error("Cannot write checkpoint '" + tempFile + "'");
+        }
+    }
+    // replaces the previous checkpoint atomically
+    if (std::rename(tempFile.c_str(), file.c_str()) != 0) {
+        throw std::runtime_error("Cannot write checkpoint '" + file + "'");
+    }
+}
+
+RenderBuffers loadCheckpoint(const std::string& file) {
+    std::ifstream in(file, std::ios::binary);
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || !std::equal(magic, magic + sizeof(magic), CHECKPOINT_MAGIC)) {
+        throw std::runtime_error("File '" + file + "' is not a render checkpoint");
+    }
+    int32_t version, width, height, passes;
+    readValue(in, version);
+    if (version != CHECKPOINT_VERSION) {
+        throw std::runtime_error("Unsupported checkpoint version " + std::to_string(version));
+    }
+    readValue(in, width);
+    readValue(in, height);
+    readValue(in, passes);
+    if (!in || width <= 0 || height <= 0) {
+        throw std::runtime_error("Invalid checkpoint '" + file + "'");
+    }
+    RenderBuffers buffers;
+    buffers.color = FrameBuffer(Pvl::Vec2i(width, height));
+    buffers.normal = FrameBuffer(Pvl::Vec2i(width, height));
+    buffers.passes = passes;
+    readBuffer(in, buffers.color);
+    readBuffer(in, buffers.normal);
+    if (!in) {
+        throw std::runtime_error("Checkpoint '" + file + "' is truncated");
+    }
+    return buffers;
+}
+
+namespace {
+
+///< Size of the blocks of pixels sampled until all of them converge in adaptive mode
+constexpr int CONVERGENCE_BLOCK = 8;
+
+struct Tile {
+    Pvl::Vec2i offset;
+    Pvl::Vec2i size;
+};
+
+std::vector<Tile> makeTiles(const Pvl::Vec2i& dims, const int tileSize) {
+    std::vector<Tile> tiles;
+    for (int y = 0; y < dims[1]; y += tileSize) {
+        for (int x = 0; x < dims[0]; x += tileSize) {
+            Pvl::Vec2i size(std::min(tileSize, dims[0] - x), std::min(tileSize, dims[1] - y));
+            tiles.push_back(Tile{ Pvl::Vec2i(x, y), size });
+        }
+    }
+    // render from the center of the image outwards, so that the interesting part is displayed first
+    auto distToCenter = [&dims](const Tile& tile) {
+        float dx = tile.offset[0] + 0.5f * tile.size[0] - 0.5f * dims[0];
+        float dy = tile.offset[1] + 0.5f * tile.size[1] - 0.5f * dims[1];
+        return dx * dx + dy * dy;
+    };
+    std::stable_sort(tiles.begin(), tiles.end(), [&distToCenter](const Tile& t1, const Tile& t2) {
+        return distToCenter(t1) < distToCenter(t2);
+    });
+    return tiles;
+}
+
+/// Per-thread data reused by all tiles rendered by the thread.
+struct TileContext {
+    Image image;
+};
+
+} // namespace
+
+void renderMeshes(IRenderOutput* frame,
+                  RenderBuffers& buffers,
                   const std::vector<TexturedMesh*>& meshes,
                   const Camera camera,
                   const RenderSettings& settings) {
@@ -397,63 +723,161 @@ void renderMeshes(FrameBufferWidget* frame,
     triangles = {};
 
     Pvl::Vec2i dims = settings.resolution;
-    std::random_device rd;
-    tbb::enumerable_thread_specific<Rng> threadRng([&rd] { return rd(); });
+    const std::vector<Tile> tiles = makeTiles(dims, settings.tileSize);
+    tbb::enumerable_thread_specific<TileContext> threadContext;
+
+    const bool resume = buffers.passes > 0 && buffers.color.dimension()[0] == dims[0] &&
+                        buffers.color.dimension()[1] == dims[1];
+    // a checkpoint of a discarded render must not be overwritten by a new one
+    const bool saveCheckpoints = !settings.checkpoint.empty() && (resume || buffers.passes == 0);
+    if (!resume && buffers.passes > 0) {
+        std::cout << "Cannot resume the render, resolution differs" << std::endl;
+    }
+    if (!resume) {
+        buffers.color = FrameBuffer(dims);
+        buffers.normal = FrameBuffer(dims);
+        buffers.passes = 0;
+    }
+    FrameBuffer& colorBuffer = buffers.color;
+    FrameBuffer& normalBuffer = buffers.normal;
+    frame->setResolution(dims);
+    if (resume) {
+        std::cout << "Resuming the render after " << buffers.passes << " passes" << std::endl;
+        frame->setTile(Pvl::Vec2i(0, 0), toImage(colorBuffer));
+    }
+    auto checkpoint = [&settings, &buffers, saveCheckpoints] {
+        if (!saveCheckpoints) {
+            return;
+        }
+        try {
+            saveCheckpoint(settings.checkpoint, buffers);
+        } catch (const std::exception& e) {
+            std::cout << e.what() << std::endl;
+        }
+    };
 
-    FrameBuffer colorBuffer(dims);
-    FrameBuffer normalBuffer(dims);
-    int numPasses = settings.numIters;
-    for (int pass = 0; pass < numPasses; ++pass) {
-        /*QProgressDialog dialog("Rendering - iteration " + QString::number(pass
-        + 1), "Cancel", 0, 100, frame);
-        dialog.setWindowModality(Qt::WindowModal); dialog.show();*/
-        auto meter = Pvl::makeProgressMeter(dims[0] * dims[1],
-                                            [&frame, pass](float prog) {
-                                                // dialog.setValue(prog);
-                                                // QCoreApplication::processEvents();
-                                                // return dialog.wasCanceled();
-                                                frame->setProgress(pass, prog);
-                                                return frame->cancelled();
-                                            });
-
-        Pvl::ParallelFor<Pvl::ParallelTag>()(0, dims[1], [&](int y) {
-            if (frame->cancelled()) {
-                return;
-            }
-            Rng& rng = threadRng.local();
-            for (int x = 0; x < dims[0]; ++x) {
-                if (meter.inc()) {
-                    return;
+    auto samplePixel = [&](const Pvl::Vec2i& pix) {
+        // indexed by the number of samples, so that adaptive sampling continues the sequence of the pixel
+        Sampler sampler(pix, colorBuffer(pix).weight);
+        const Pvl::Vec2f jitter = sampler.get2D();
+        CameraRay cameraRay = camera.project(Pvl::Vec2f(pix[0] + jitter[0], pix[1] + jitter[1]));
+        Mpcv::Ray ray(cameraRay.origin, cameraRay.dir);
+        Pvl::Vec3f color, normal;
+        std::tie(color, normal) = radiance(scene, ray, bvh, sampler, settings.wire, settings.maxDepth);
+        colorBuffer(pix).add(color);
+        normalBuffer(pix).add(normal);
+    };
+    auto blockConverged = [&](const Pvl::Vec2i& offset, const Pvl::Vec2i& size) {
+        for (int y = 0; y < size[1]; ++y) {
+            for (int x = 0; x < size[0]; ++x) {
+                const Pixel& pixel = colorBuffer(offset + Pvl::Vec2i(x, y));
+                if (!pixel.converged(settings.errorThreshold, settings.minSamples)) {
+                    return false;
                 }
-                Pvl::Vec2i pix(x, y);
-                float dx = rng();
-                float dy = rng();
-                CameraRay cameraRay =
-                    camera.project(Pvl::Vec2f(x + dx, y + dy));
-                Mpcv::Ray ray(cameraRay.origin, cameraRay.dir);
-                Pvl::Vec3f color, normal;
-                std::tie(color, normal) =
-                    radiance(scene, ray, bvh, rng, settings.wire);
-                colorBuffer(pix).add(color);
-                normalBuffer(pix).add(normal);
             }
+        }
+        return true;
+    };
+
+    tbb::task_arena arena;
+    // tiles with all pixels converged, each tile is only accessed by a single task during the pass
+    std::vector<uint8_t> tileConverged(tiles.size(), 0);
+    tbb::atomic<std::size_t> totalSamples = 0;
+    int numPasses = settings.numIters;
+    for (int pass = buffers.passes; pass < numPasses; ++pass) {
+        auto meter = Pvl::makeProgressMeter(tiles.size(), [&frame, pass](float prog) {
+            frame->setProgress(pass, prog);
+            return frame->cancelled();
+        });
+
+        // tiles are small compared to the image, so the work stealing balances tiles with sky and with
+        // dense geometry
+        arena.execute([&] {
+            tbb::parallel_for(
+                tbb::blocked_range<std::size_t>(0, tiles.size(), 1),
+                [&](const tbb::blocked_range<std::size_t>& range) {
+                    TileContext& context = threadContext.local();
+                    for (std::size_t ti = range.begin(); ti != range.end(); ++ti) {
+                        if (frame->cancelled()) {
+                            return;
+                        }
+                        if (tileConverged[ti]) {
+                            if (meter.inc()) {
+                                return;
+                            }
+                            continue;
+                        }
+                        const Tile& tile = tiles[ti];
+                        Image& tileImage = context.image;
+                        if (tileImage.dimension()[0] != tile.size[0] ||
+                            tileImage.dimension()[1] != tile.size[1]) {
+                            tileImage = Image(tile.size);
+                        }
+                        // convergence is judged for blocks of pixels, all pixels of a block are sampled
+                        // until the last one converges; a pixel alone could stop early after a few similar
+                        // samples, while the whole tile would keep sampling converged regions
+                        bool converged = settings.adaptive;
+                        std::size_t samples = 0;
+                        for (int by = 0; by < tile.size[1]; by += CONVERGENCE_BLOCK) {
+                            for (int bx = 0; bx < tile.size[0]; bx += CONVERGENCE_BLOCK) {
+                                const Pvl::Vec2i blockOffset = tile.offset + Pvl::Vec2i(bx, by);
+                                const Pvl::Vec2i blockSize(std::min(CONVERGENCE_BLOCK, tile.size[0] - bx),
+                                    std::min(CONVERGENCE_BLOCK, tile.size[1] - by));
+                                if (settings.adaptive && blockConverged(blockOffset, blockSize)) {
+                                    for (int y = by; y < by + blockSize[1]; ++y) {
+                                        for (int x = bx; x < bx + blockSize[0]; ++x) {
+                                            tileImage(Pvl::Vec2i(x, y)) =
+                                                colorBuffer(tile.offset + Pvl::Vec2i(x, y)).color;
+                                        }
+                                    }
+                                    continue;
+                                }
+                                for (int y = by; y < by + blockSize[1]; ++y) {
+                                    for (int x = bx; x < bx + blockSize[0]; ++x) {
+                                        const Pvl::Vec2i pix = tile.offset + Pvl::Vec2i(x, y);
+                                        samplePixel(pix);
+                                        tileImage(Pvl::Vec2i(x, y)) = colorBuffer(pix).color;
+                                        ++samples;
+                                    }
+                                }
+                                converged = converged && blockConverged(blockOffset, blockSize);
+                            }
+                        }
+                        tileConverged[ti] = converged;
+                        totalSamples += samples;
+                        frame->setTile(tile.offset, tileImage);
+                        if (meter.inc()) {
+                            return;
+                        }
+                    }
+                },
+                tbb::simple_partitioner());
         });
         if (frame->cancelled()) {
+            // the unfinished pass only adds samples to some pixels, the state is still valid
+            checkpoint();
             return;
         }
+        buffers.passes = pass + 1;
+        checkpoint();
+        const bool allConverged =
+            settings.adaptive && std::all_of(tileConverged.begin(), tileConverged.end(), [](uint8_t c) {
+                return c != 0;
+            });
+        if (allConverged) {
+            std::cout << "All pixels converged after " << pass + 1 << " passes" << std::endl;
+            numPasses = pass + 1;
+        }
         if (settings.denoise && pass == numPasses - 1) {
             bvh.clear();
-            denoise(colorBuffer, normalBuffer);
+            // keeps the accumulated buffers intact, so that the render can be continued
+            FrameBuffer denoised = colorBuffer;
+            denoise(denoised, normalBuffer);
+            frame->setTile(Pvl::Vec2i(0, 0), toImage(denoised));
         }
-        Image image(dims);
-        Pvl::ParallelFor<Pvl::ParallelTag>()(0, dims[1], [&](int y) {
-            for (int x = 0; x < dims[0]; ++x) {
-                Pvl::Vec2i pix(x, y);
-                image(pix) = colorBuffer(pix).color;
-            }
-        });
-        frame->setImage(std::move(image));
     }
+    std::cout << "Rendered " << float(totalSamples) / (dims[0] * dims[1]) << " samples per pixel on average"
+              << std::endl;
     // set complete
     frame->setProgress(settings.numIters, 100);
 }
@@ -473,31 +897,28 @@ void renderMeshes(FrameBufferWidget* frame,
     return Pvl::Vec3f(u * std::cos(phi), u * std::sin(phi), z);
 }*/
 
-bool ambientOcclusion(std::vector<TexturedMesh>& meshes,
+bool ambientOcclusion(const std::vector<TexturedMesh*>& meshes,
                       std::function<bool(float)> progress,
-                      int sampleCntX,
-                      int sampleCntY) {
+                      const AoSettings& settings,
+                      std::function<void()> roundFinished) {
     Mpcv::Bvh<Mpcv::BvhTriangle> bvh(10);
-    Srs referenceSrs = meshes.front().srs;
+    Srs referenceSrs = meshes.front()->srs;
 
     float scale = 0.f;
     progress(0);
     std::vector<Mpcv::BvhTriangle> triangles;
-    std::size_t totalFaces = 0;
-    for (const TexturedMesh& mesh : meshes) {
-        totalFaces += mesh.faces.size();
-
+    for (const TexturedMesh* mesh : meshes) {
         Pvl::Box3f box;
-        SrsConv meshToRef(mesh.srs, referenceSrs);
-        for (const TexturedMesh::Face& f : mesh.faces) {
-            Pvl::Vec3f v1 = meshToRef(mesh.vertices[f[0]]);
-            Pvl::Vec3f v2 = meshToRef(mesh.vertices[f[1]]);
-            Pvl::Vec3f v3 = meshToRef(mesh.vertices[f[2]]);
+        SrsConv meshToRef(mesh->srs, referenceSrs);
+        for (const TexturedMesh::Face& f : mesh->faces) {
+            Pvl::Vec3f v1 = meshToRef(mesh->vertices[f[0]]);
+            Pvl::Vec3f v2 = meshToRef(mesh->vertices[f[1]]);
+            Pvl::Vec3f v3 = meshToRef(mesh->vertices[f[2]]);
             triangles.emplace_back(v1, v2, v3);
 
             if (scale == 0.f) {
                 // compute box from the first mesh only
-                box.extend(mesh.vertices[f[0]]);
+                box.extend(mesh->vertices[f[0]]);
             }
         }
         if (scale == 0.f) {
@@ -512,58 +933,323 @@ bool ambientOcclusion(std::vector<TexturedMesh>& meshes,
     const float eps = 1.e-3f * scale;
     std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
 
-    auto meter = Pvl::makeProgressMeter(totalFaces, std::move(progress));
-    tbb::atomic<bool> cancelled = false;
-    for (TexturedMesh& mesh : meshes) {
+    struct VertexState {
+        Pvl::Vec3f origin;
+        Pvl::Mat33f rotator;
+        uint16_t samples = 0;
+        uint16_t unoccluded = 0;
+        bool converged = false;
+    };
+    std::vector<std::vector<VertexState>> states(meshes.size());
+    std::size_t totalVertices = 0;
+    for (std::size_t mi = 0; mi < meshes.size(); ++mi) {
+        TexturedMesh& mesh = *meshes[mi];
         SrsConv meshToRef(mesh.srs, referenceSrs);
+        totalVertices += mesh.vertices.size();
 
-        mesh.ao.resize(3 * mesh.faces.size());
-
-        tbb::parallel_for(std::size_t(0), mesh.faces.size(), [&](std::size_t fi) {
-            if (cancelled) {
+        // area-weighted normals, vertices shared by faces are sampled only once
+        std::vector<Pvl::Vec3f> normals(mesh.vertices.size(), Pvl::Vec3f(0.f));
+        for (const TexturedMesh::Face& f : mesh.faces) {
+            const Pvl::Vec3f n = Pvl::crossProd(
+                mesh.vertices[f[1]] - mesh.vertices[f[0]], mesh.vertices[f[2]] - mesh.vertices[f[0]]);
+            for (int i = 0; i < 3; ++i) {
+                normals[f[i]] += n;
+            }
+        }
+        std::vector<VertexState>& meshStates = states[mi];
+        meshStates.resize(mesh.vertices.size());
+        mesh.ao.resize(mesh.vertices.size());
+        tbb::parallel_for(std::size_t(0), mesh.vertices.size(), [&](std::size_t vi) {
+            VertexState& state = meshStates[vi];
+            const float length = Pvl::norm(normals[vi]);
+            if (length == 0.f) {
+                // not referenced by any face (or degenerated)
+                state.converged = true;
+                mesh.ao[vi] = 255;
                 return;
             }
-            Pvl::Vec3f n = mesh.normal(fi);
-            Pvl::Vec3f centroid = mesh.centroid(fi);
-            Pvl::Mat33f rotator = Pvl::getRotatorTo(n);
-            for (int i = 0; i < 3; ++i) {
-                int nonOccludedCnt = 0;
-
-                int vi = mesh.faces[fi][i];
-                for (int x = 0; x < sampleCntX; ++x) {
-                    for (int y = 0; y < sampleCntY; ++y) {
-                        Pvl::Vec3f dir =
-                            sampleUnitHemiSphere((x + 0.5f) / sampleCntX, (y + 0.5f) / sampleCntY);
-                        dir = Pvl::prod(rotator, dir);
-                        Pvl::Vec3f origin = meshToRef(0.99 * mesh.vertices[vi] + 0.01 * centroid);
-                        Mpcv::Ray ray(origin + eps * n, dir);
-                        if (!bvh.isOccluded(ray)) {
-                            nonOccludedCnt++;
+            const Pvl::Vec3f n = normals[vi] / length;
+            state.rotator = Pvl::getRotatorTo(n);
+            state.origin = meshToRef(mesh.vertices[vi]) + eps * n;
+            mesh.ao[vi] = 0;
+        });
+    }
+
+    const float maxDist = settings.radius > 0.f ? settings.radius : INFINITY;
+    const int maxSamples = std::min(settings.maxSamples, int(std::numeric_limits<uint16_t>::max()));
+    const int numRounds = (maxSamples + settings.samplesPerRound - 1) / settings.samplesPerRound;
+    auto meter = Pvl::makeProgressMeter(totalVertices * numRounds, std::move(progress));
+    tbb::atomic<bool> cancelled = false;
+    int round = 0;
+    for (; round < numRounds; ++round) {
+        tbb::atomic<std::size_t> active = 0;
+        for (std::size_t mi = 0; mi < meshes.size(); ++mi) {
+            TexturedMesh& mesh = *meshes[mi];
+            std::vector<VertexState>& meshStates = states[mi];
+            tbb::parallel_for(std::size_t(0), mesh.vertices.size(), [&](std::size_t vi) {
+                if (cancelled) {
+                    return;
+                }
+                VertexState& state = meshStates[vi];
+                if (!state.converged) {
+                    const int count = std::min(settings.samplesPerRound, maxSamples - state.samples);
+                    for (int i = 0; i < count; ++i) {
+                        // each vertex has its own scrambling of the sequence, i.e. a random rotation of the
+                        // pattern, and the consecutive rounds keep the samples stratified
+                        Sampler sampler(Pvl::Vec2i(int(vi), int(mi)), state.samples + i);
+                        const Pvl::Vec2f u = sampler.get2D();
+                        const Pvl::Vec3f dir = Pvl::prod(state.rotator, sampleUnitHemiSphere(u[0], u[1]));
+                        if (!bvh.isOccluded(Mpcv::Ray(state.origin, dir, 0.f, maxDist))) {
+                            state.unoccluded++;
                         }
                     }
+                    state.samples += count;
+
+                    const float ratio = float(state.unoccluded) / state.samples;
+                    mesh.ao[vi] = uint8_t(ratio * 255);
+                    if (state.samples >= maxSamples) {
+                        state.converged = true;
+                    } else if (state.samples >= settings.minSamples) {
+                        const bool uniform = state.unoccluded == 0 || state.unoccluded == state.samples;
+                        const float error = std::sqrt(ratio * (1.f - ratio) / state.samples);
+                        state.converged = uniform || error < settings.tolerance;
+                    }
+                    if (!state.converged) {
+                        ++active;
+                    }
                 }
 
-                float rati = float(nonOccludedCnt) / (sampleCntX * sampleCntY);
-                uint8_t value = uint8_t(rati * 255);
-                mesh.ao[3 * fi + i] = value;
+                if (meter.inc()) {
+                    cancelled = true;
+                }
+            });
+            if (cancelled) {
+                for (TexturedMesh* m : meshes) {
+                    m->ao = {};
+                }
+                return false;
             }
+        }
+        if (active == 0) {
+            ++round;
+            break;
+        }
+        if (roundFinished) {
+            roundFinished();
+        }
+    }
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    std::cout << "AO calculated in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms, " << round
+              << " rounds" << std::endl;
+    return true;
+}
+
+namespace {
+
+/// \brief Bit grid marking the voxels that contain at least one point.
+class OccupancyGrid {
+    Pvl::Vec3f lower_;
+    float voxel_;
+    std::array<int, 3> dims_;
+    std::vector<tbb::atomic<uint32_t>> words_;
+
+public:
+    OccupancyGrid(const Pvl::Box3f& box, const float voxel)
+        : lower_(box.lower())
+        , voxel_(voxel) {
+        std::size_t count = 1;
+        for (int i = 0; i < 3; ++i) {
+            dims_[i] = std::max(int(std::ceil(box.size()[i] / voxel)), 1);
+            count *= dims_[i];
+        }
+        words_.resize((count + 31) / 32);
+    }
+
+    /// \brief Marks the voxel containing given point, can be called concurrently.
+    void insert(const Pvl::Vec3f& p) {
+        std::array<int, 3> c;
+        for (int i = 0; i < 3; ++i) {
+            c[i] = Pvl::clamp(int((p[i] - lower_[i]) / voxel_), 0, dims_[i] - 1);
+        }
+        const std::size_t idx = index(c);
+        tbb::atomic<uint32_t>& word = words_[idx / 32];
+        const uint32_t bit = 1u << (idx % 32);
+        uint32_t old = word;
+        while (!(old & bit)) {
+            const uint32_t prev = word.compare_and_swap(old | bit, old);
+            if (prev == old) {
+                break;
+            }
+            old = prev;
+        }
+    }
+
+    /// \brief Returns true if the segment of given length passes through an occupied voxel.
+    bool isOccluded(const Pvl::Vec3f& origin, const Pvl::Vec3f& dir, const float maxDist) const {
+        // traversal in voxel units, see "A Fast Voxel Traversal Algorithm for Ray Tracing" (Amanatides, Woo)
+        const Pvl::Vec3f p = (origin - lower_) / voxel_;
+        float t = 0.f;
+        float tEnd = maxDist / voxel_;
+        for (int i = 0; i < 3; ++i) {
+            if (dir[i] == 0.f) {
+                if (p[i] < 0.f || p[i] >= dims_[i]) {
+                    return false;
+                }
+                continue;
+            }
+            float t0 = -p[i] / dir[i];
+            float t1 = (dims_[i] - p[i]) / dir[i];
+            if (t0 > t1) {
+                std::swap(t0, t1);
+            }
+            t = std::max(t, t0);
+            tEnd = std::min(tEnd, t1);
+        }
+        if (t >= tEnd) {
+            return false;
+        }
+
+        std::array<int, 3> c, step;
+        std::array<float, 3> tNext, tDelta;
+        for (int i = 0; i < 3; ++i) {
+            const float x = p[i] + t * dir[i];
+            c[i] = Pvl::clamp(int(std::floor(x)), 0, dims_[i] - 1);
+            if (dir[i] > 0.f) {
+                step[i] = 1;
+                tNext[i] = t + (c[i] + 1 - x) / dir[i];
+                tDelta[i] = 1.f / dir[i];
+            } else if (dir[i] < 0.f) {
+                step[i] = -1;
+                tNext[i] = t + (c[i] - x) / dir[i];
+                tDelta[i] = -1.f / dir[i];
+            } else {
+                step[i] = 0;
+                tNext[i] = INFINITY;
+                tDelta[i] = INFINITY;
+            }
+        }
+        while (t < tEnd) {
+            if (occupied(c)) {
+                return true;
+            }
+            const int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+            t = tNext[axis];
+            c[axis] += step[axis];
+            if (c[axis] < 0 || c[axis] >= dims_[axis]) {
+                return false;
+            }
+            tNext[axis] += tDelta[axis];
+        }
+        return false;
+    }
+
+private:
+    std::size_t index(const std::array<int, 3>& c) const {
+        return (std::size_t(c[2]) * dims_[1] + c[1]) * dims_[0] + c[0];
+    }
+
+    bool occupied(const std::array<int, 3>& c) const {
+        const std::size_t idx = index(c);
+        return (words_[idx / 32] & (1u << (idx % 32))) != 0;
+    }
+};
+
+} // namespace
+
+bool pointCloudOcclusion(const std::vector<TexturedMesh*>& clouds,
+                         std::function<bool(float)> progress,
+                         const AoSettings& settings) {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    progress(0);
+    Srs referenceSrs = clouds.front()->srs;
+    Pvl::Box3f box;
+    std::size_t totalPoints = 0;
+    for (const TexturedMesh* cloud : clouds) {
+        SrsConv cloudToRef(cloud->srs, referenceSrs);
+        for (const Pvl::Vec3f& p : cloud->vertices) {
+            box.extend(cloudToRef(p));
+        }
+        totalPoints += cloud->vertices.size();
+    }
+    if (totalPoints == 0) {
+        return true;
+    }
+
+    // voxel of about twice the point spacing, assuming the points sample a 2.5D surface
+    const Pvl::Vec3f size = box.size();
+    const float area = std::max({ size[0] * size[1], size[0] * size[2], size[1] * size[2] });
+    float voxel = std::max(2.f * std::sqrt(area / totalPoints), 1.e-3f * std::max(Pvl::maxElement(size), 1.f));
+    // limit the grid to 32MB
+    const double maxCells = double(1 << 28);
+    while (true) {
+        const double cells =
+            double(size[0] / voxel + 1) * double(size[1] / voxel + 1) * double(size[2] / voxel + 1);
+        if (cells <= maxCells) {
+            break;
+        }
+        voxel *= 1.01f * float(std::cbrt(cells / maxCells));
+    }
+
+    OccupancyGrid grid(box, voxel);
+    for (const TexturedMesh* cloud : clouds) {
+        SrsConv cloudToRef(cloud->srs, referenceSrs);
+        tbb::parallel_for(std::size_t(0), cloud->vertices.size(), [&](std::size_t vi) {
+            grid.insert(cloudToRef(cloud->vertices[vi]));
+        });
+    }
+    std::cout << "Occupancy grid with voxel " << voxel << " built in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin)
+                     .count()
+              << "ms" << std::endl;
+
+    const float maxDist = settings.radius > 0.f ? settings.radius : 16.f * voxel;
+    const int numSamples = std::max(settings.pointSamples, 1);
+    auto meter = Pvl::makeProgressMeter(totalPoints, std::move(progress));
+    tbb::atomic<bool> cancelled = false;
+    for (std::size_t mi = 0; mi < clouds.size(); ++mi) {
+        TexturedMesh& cloud = *clouds[mi];
+        SrsConv cloudToRef(cloud.srs, referenceSrs);
+        const bool hasNormals = !cloud.normals.empty();
+        cloud.ao.resize(cloud.vertices.size());
+        tbb::parallel_for(std::size_t(0), cloud.vertices.size(), [&](std::size_t vi) {
+            if (cancelled) {
+                return;
+            }
+            Pvl::Vec3f n(0.f, 0.f, 1.f);
+            if (hasNormals && Pvl::norm(cloud.normals[vi]) > 0.f) {
+                n = Pvl::normalize(cloud.normals[vi]);
+            }
+            const Pvl::Mat33f rotator = Pvl::getRotatorTo(n);
+            // move the origin out of the voxels occupied by the surface itself
+            const Pvl::Vec3f origin = cloudToRef(cloud.vertices[vi]) + 1.5f * voxel * n;
+            int unoccluded = 0;
+            for (int i = 0; i < numSamples; ++i) {
+                Sampler sampler(Pvl::Vec2i(int(vi), int(mi)), i);
+                const Pvl::Vec2f u = sampler.get2D();
+                const Pvl::Vec3f dir = Pvl::prod(rotator, sampleCosineHemiSphere(u[0], u[1]));
+                if (!grid.isOccluded(origin, dir, maxDist)) {
+                    ++unoccluded;
+                }
+            }
+            cloud.ao[vi] = uint8_t(255 * unoccluded / numSamples);
 
             if (meter.inc()) {
                 cancelled = true;
-                mesh.ao = {};
-                return;
             }
         });
-
         if (cancelled) {
+            for (TexturedMesh* c : clouds) {
+                c->ao = {};
+            }
             return false;
         }
     }
 
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-    std::cout << "AO calculated in "
-              << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms"
-              << std::endl;
+    std::cout << "Point cloud AO calculated in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms" << std::endl;
     return true;
 }
 
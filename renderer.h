@@ -1,27 +1,74 @@
 #pragma once
 
 #include "camera.h"
+#include "image.h"
 #include "mesh.h"
 #include "pvl/UniformGrid.hpp"
+#include <algorithm>
+#include <cmath>
 #include <functional>
-
-class FrameBufferWidget;
+#include <limits>
+#include <string>
 
 namespace Mpcv {
 
+inline float luminance(const Pvl::Vec3f& color) {
+    return 0.2126f * color[0] + 0.7152f * color[1] + 0.0722f * color[2];
+}
+
 struct Pixel {
     Pvl::Vec3f color = Pvl::Vec3f(0);
     int weight = 0;
 
+    ///< Sum of squared differences of luminance from the mean (Welford's algorithm)
+    float m2 = 0.f;
+
     void add(const Pvl::Vec3f& c) {
+        const float oldMean = luminance(color);
         color = (weight * color + c) / (weight + 1);
         ++weight;
+        const float value = luminance(c);
+        m2 += (value - oldMean) * (value - luminance(color));
+    }
+
+    /// \brief Sample variance of the luminance.
+    float variance() const {
+        return weight > 1 ? m2 / (weight - 1) : std::numeric_limits<float>::infinity();
+    }
+
+    /// \brief Returns true if the standard error of the mean is below given fraction of the mean.
+    bool converged(const float threshold, const int minSamples) const {
+        if (weight < std::max(minSamples, 2)) {
+            return false;
+        }
+        const float error = std::sqrt(variance() / weight);
+        return error <= threshold * (luminance(color) + 1.e-3f);
     }
 };
 
 
 using FrameBuffer = Pvl::UniformGrid<Pixel, 2>;
 
+/// \brief Accumulated state of the renderer, allows to continue the rendering with more passes.
+struct RenderBuffers {
+    FrameBuffer color;
+    FrameBuffer normal;
+
+    ///< Number of finished passes
+    int passes = 0;
+};
+
+/// \brief Saves the radiance, normals, variance and sample counts into an EXR file.
+///
+/// PFM files contain the radiance only.
+void saveRenderBuffers(const std::string& file, const RenderBuffers& buffers);
+
+/// \brief Saves the complete accumulation state, so that the render can be resumed later.
+void saveCheckpoint(const std::string& file, const RenderBuffers& buffers);
+
+/// \brief Loads the accumulation state saved by saveCheckpoint.
+RenderBuffers loadCheckpoint(const std::string& file);
+
 enum class RenderWire {
     NOTHING,
     DOTS,
@@ -31,19 +78,94 @@ enum class RenderWire {
 struct RenderSettings {
     Pvl::Vec2i resolution = Pvl::Vec2i(1024, 768);
     int numIters = 10;
+    ///< Maximum number of bounces of a path
+    int maxDepth = 4;
     Pvl::Vec3f dirToSun = Pvl::normalize(Pvl::Vec3f(1.f, 1.f, 4.f));
     RenderWire wire = RenderWire::NOTHING;
     bool denoise = false;
+    int tileSize = 32;
+
+    ///< If true, numIters is the maximum number of passes; blocks of 8x8 pixels are sampled only until all
+    ///< their pixels converge
+    bool adaptive = false;
+    ///< Relative standard error of a converged pixel
+    float errorThreshold = 0.02f;
+    ///< Minimal number of samples of each pixel in adaptive mode
+    int minSamples = 2;
+
+    ///< If not empty, the accumulation state is saved into this file after each pass
+    std::string checkpoint;
 };
 
-void renderMeshes(FrameBufferWidget* widget,
+/// \brief Receives the progress and the results of the renderer.
+class IRenderOutput {
+public:
+    virtual ~IRenderOutput() = default;
+
+    virtual void setNumIters(int numIters) = 0;
+
+    /// \brief Called before the first tile is rendered.
+    virtual void setResolution(const Pvl::Vec2i& resolution) = 0;
+
+    virtual void setProgress(int pass, int prog) = 0;
+
+    /// \brief Called once a tile is finished, with the current (accumulated) values of its pixels.
+    ///
+    /// Called concurrently from worker threads, tiles of a single pass never overlap.
+    virtual void setTile(const Pvl::Vec2i& offset, const Image& tile) = 0;
+
+    virtual bool cancelled() const = 0;
+};
+
+/// \brief Renders the meshes, accumulating samples into given buffers.
+///
+/// If the buffers already contain finished passes of the same resolution (e.g. loaded from a checkpoint), the
+/// rendering continues until the total number of passes is settings.numIters.
+void renderMeshes(IRenderOutput* output,
+                  RenderBuffers& buffers,
                   const std::vector<TexturedMesh*>& meshes,
                   const Camera camera,
                   const RenderSettings& settings);
 
-bool ambientOcclusion(std::vector<TexturedMesh>& meshes,
+struct AoSettings {
+    ///< Number of samples added to each unconverged vertex in a single round
+    int samplesPerRound = 16;
+
+    ///< Maximum number of samples per vertex
+    int maxSamples = 256;
+
+    ///< Vertex is not considered converged before it has at least this many samples
+    int minSamples = 32;
+
+    ///< Vertex is converged if the standard error of the unoccluded ratio is below this value
+    float tolerance = 0.025f;
+
+    ///< Occluders farther than this distance are ignored; zero means unlimited distance
+    float radius = 0.f;
+
+    ///< Number of directions sampled for each point of a point cloud
+    int pointSamples = 16;
+};
+
+/// \brief Computes the ambient occlusion of each vertex of the meshes, stored in TexturedMesh::ao.
+///
+/// Samples are added progressively in rounds; after each round, the current estimate is stored in the meshes
+/// and roundFinished is called from the calling thread. Vertices that are fully open or fully occluded (or
+/// converged otherwise) are not sampled further. Returns false if cancelled by the progress callback, in which
+/// case the AO of all meshes is cleared.
+bool ambientOcclusion(const std::vector<TexturedMesh*>& meshes,
                       std::function<bool(float)> progress,
-                      int sampleCntX = 20,
-                      int sampleCntY = 10);
+                      const AoSettings& settings = {},
+                      std::function<void()> roundFinished = nullptr);
+
+/// \brief Computes the ambient occlusion of each point of the point clouds, stored in TexturedMesh::ao.
+///
+/// Points are splatted into a voxel occupancy grid, occlusion rays are then marched through the grid, so no
+/// triangulation or normals are needed. Rays sample the hemisphere around the point normal if the cloud has
+/// normals, or the upper hemisphere otherwise. If the radius is not set, it defaults to 16 voxels. Returns false
+/// if cancelled by the progress callback, in which case the AO of all clouds is cleared.
+bool pointCloudOcclusion(const std::vector<TexturedMesh*>& clouds,
+                         std::function<bool(float)> progress,
+                         const AoSettings& settings = {});
 
 } // namespace Mpcv
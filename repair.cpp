@@ -0,0 +1,522 @@
+#include "repair.h"
+#include "pvl/Box.hpp"
+#include "pvl/Utils.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <numeric>
+#include <tbb/tbb.h>
+
+#ifdef HAS_OPENVDB
+#ifdef foreach
+#undef foreach // every time a programmer defines a macro, god kills a kitten
+#endif
+#include <openvdb/openvdb.h>
+#include <openvdb/tools/MeshToVolume.h>
+#include <openvdb/tools/VolumeToMesh.h>
+#endif
+
+namespace Mpcv {
+
+#ifdef HAS_OPENVDB
+
+namespace {
+
+/// Rough memory estimate per unit area (in voxels) of the surface in a tile: one leaf node of the distance
+/// and the index grid (~5kB) per 8x8 voxels of the surface, plus the extracted mesh.
+constexpr float BYTES_PER_AREA = 160.f;
+
+/// Tiles are not split below this size (in voxels), the overlap would dominate the work.
+constexpr float MIN_TILE_SIZE = 32.f;
+
+struct Tile {
+    ///< Voxels owned by the tile, in index coordinates
+    Pvl::Box3f core;
+
+    ///< Faces overlapping the core extended by the margin
+    std::vector<uint32_t> faces;
+};
+
+/// Part of the repaired surface extracted from a single tile.
+struct Patch {
+    std::vector<Pvl::Vec3f> vertices;
+    std::vector<Color> colors;
+    std::vector<uint8_t> classes;
+    std::vector<TexturedMesh::Face> faces;
+
+    ///< Texture coordinates of face corners, three per face
+    std::vector<Pvl::Vec2f> uv;
+};
+
+class TileAdapter {
+    const TexturedMesh& mesh_;
+    const std::vector<uint32_t>& faces_;
+    const openvdb::math::Transform& tr_;
+
+public:
+    TileAdapter(const TexturedMesh& mesh,
+                const std::vector<uint32_t>& faces,
+                const openvdb::math::Transform& tr)
+        : mesh_(mesh)
+        , faces_(faces)
+        , tr_(tr) {}
+
+    size_t polygonCount() const {
+        return faces_.size();
+    }
+    size_t pointCount() const {
+        return mesh_.vertices.size();
+    }
+    size_t vertexCount(size_t) const {
+        return 3;
+    }
+
+    void getIndexSpacePoint(size_t n, size_t v, openvdb::Vec3d& pos) const {
+        const Pvl::Vec3f& p = mesh_.vertices[mesh_.faces[faces_[n]][v]];
+        pos = tr_.worldToIndex(openvdb::Vec3d(p[0], p[1], p[2]));
+    }
+};
+
+void initializeOpenVdb() {
+    static std::once_flag flag;
+    std::call_once(flag, [] { openvdb::initialize(); });
+}
+
+Pvl::Box3f faceBox(const TexturedMesh& mesh, const uint32_t fi, const float voxelSize) {
+    Pvl::Box3f box;
+    for (int i = 0; i < 3; ++i) {
+        box.extend(mesh.vertices[mesh.faces[fi][i]] / voxelSize);
+    }
+    return box;
+}
+
+bool overlaps(const Pvl::Box3f& box1, const Pvl::Box3f& box2) {
+    for (int i = 0; i < 3; ++i) {
+        if (box1.lower()[i] > box2.upper()[i] || box2.lower()[i] > box1.upper()[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Pvl::Box3f extended(const Pvl::Box3f& box, const float margin) {
+    return Pvl::Box3f(box.lower() - Pvl::Vec3f(margin), box.upper() + Pvl::Vec3f(margin));
+}
+
+/// Splits the tile in halves along the largest extent until the surface in each tile fits into maxArea.
+void splitTiles(const TexturedMesh& mesh,
+                const std::vector<float>& areas,
+                Tile&& tile,
+                const float voxelSize,
+                const float margin,
+                const float maxArea,
+                std::vector<Tile>& tiles,
+                tbb::mutex& mutex) {
+    float area = 0.f;
+    for (uint32_t fi : tile.faces) {
+        area += areas[fi];
+    }
+    const Pvl::Vec3f size = tile.core.size();
+    const int splitDim = argMax(size);
+    if (area <= maxArea || size[splitDim] <= 2.f * MIN_TILE_SIZE) {
+        tbb::mutex::scoped_lock lock(mutex);
+        tiles.push_back(std::move(tile));
+        return;
+    }
+    const float mid = std::floor(tile.core.center()[splitDim]);
+    Tile left, right;
+    left.core = right.core = tile.core;
+    left.core.upper()[splitDim] = mid;
+    right.core.lower()[splitDim] = mid;
+    const Pvl::Box3f leftBox = extended(left.core, margin);
+    const Pvl::Box3f rightBox = extended(right.core, margin);
+    for (uint32_t fi : tile.faces) {
+        const Pvl::Box3f box = faceBox(mesh, fi, voxelSize);
+        if (overlaps(box, leftBox)) {
+            left.faces.push_back(fi);
+        }
+        if (overlaps(box, rightBox)) {
+            right.faces.push_back(fi);
+        }
+    }
+    tile = {};
+    tbb::parallel_invoke(
+        [&] { splitTiles(mesh, areas, std::move(left), voxelSize, margin, maxArea, tiles, mutex); },
+        [&] { splitTiles(mesh, areas, std::move(right), voxelSize, margin, maxArea, tiles, mutex); });
+}
+
+/// Returns barycentric coordinates of the point of the triangle closest to p (Ericson, Real-Time Collision
+/// Detection, 5.1.5).
+Pvl::Vec3f closestPoint(const Pvl::Vec3f& p, const Pvl::Vec3f& a, const Pvl::Vec3f& b, const Pvl::Vec3f& c) {
+    const Pvl::Vec3f ab = b - a;
+    const Pvl::Vec3f ac = c - a;
+    const Pvl::Vec3f ap = p - a;
+    const float d1 = Pvl::dotProd(ab, ap);
+    const float d2 = Pvl::dotProd(ac, ap);
+    if (d1 <= 0.f && d2 <= 0.f) {
+        return Pvl::Vec3f(1.f, 0.f, 0.f);
+    }
+    const Pvl::Vec3f bp = p - b;
+    const float d3 = Pvl::dotProd(ab, bp);
+    const float d4 = Pvl::dotProd(ac, bp);
+    if (d3 >= 0.f && d4 <= d3) {
+        return Pvl::Vec3f(0.f, 1.f, 0.f);
+    }
+    const float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f) {
+        const float v = d1 / (d1 - d3);
+        return Pvl::Vec3f(1.f - v, v, 0.f);
+    }
+    const Pvl::Vec3f cp = p - c;
+    const float d5 = Pvl::dotProd(ab, cp);
+    const float d6 = Pvl::dotProd(ac, cp);
+    if (d6 >= 0.f && d5 <= d6) {
+        return Pvl::Vec3f(0.f, 0.f, 1.f);
+    }
+    const float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f) {
+        const float w = d2 / (d2 - d6);
+        return Pvl::Vec3f(1.f - w, 0.f, w);
+    }
+    const float va = d3 * d6 - d5 * d4;
+    if (va <= 0.f && d4 - d3 >= 0.f && d5 - d6 >= 0.f) {
+        const float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        return Pvl::Vec3f(0.f, 1.f - w, w);
+    }
+    const float sum = va + vb + vc;
+    if (sum <= 0.f) {
+        // degenerate triangle
+        return Pvl::Vec3f(1.f, 0.f, 0.f);
+    }
+    const float v = vb / sum;
+    const float w = vc / sum;
+    return Pvl::Vec3f(1.f - v - w, v, w);
+}
+
+/// Finds the closest face of the original mesh using the closest-polygon grid of the tile.
+class ClosestFace {
+    const TexturedMesh& mesh_;
+    const Tile& tile_;
+    const openvdb::math::Transform& tr_;
+    openvdb::Int32Grid::ConstAccessor accessor_;
+
+public:
+    ClosestFace(const TexturedMesh& mesh,
+                const Tile& tile,
+                const openvdb::math::Transform& tr,
+                const openvdb::Int32Grid& indexGrid)
+        : mesh_(mesh)
+        , tile_(tile)
+        , tr_(tr)
+        , accessor_(indexGrid.getConstAccessor()) {}
+
+    /// Returns the face index in the mesh and the barycentric coordinates of the closest point, or false if
+    /// there is no face in the narrow band around the point.
+    bool find(const Pvl::Vec3f& p, uint32_t& face, Pvl::Vec3f& bary) {
+        const openvdb::Coord ijk = tr_.worldToIndexNodeCentered(openvdb::Vec3d(p[0], p[1], p[2]));
+        float minDistSqr = std::numeric_limits<float>::max();
+        for (int z = -1; z <= 1; ++z) {
+            for (int y = -1; y <= 1; ++y) {
+                for (int x = -1; x <= 1; ++x) {
+                    int32_t index;
+                    if (!accessor_.probeValue(ijk.offsetBy(x, y, z), index)) {
+                        continue;
+                    }
+                    const uint32_t fi = tile_.faces[index];
+                    const TexturedMesh::Face& f = mesh_.faces[fi];
+                    const Pvl::Vec3f& a = mesh_.vertices[f[0]];
+                    const Pvl::Vec3f& b = mesh_.vertices[f[1]];
+                    const Pvl::Vec3f& c = mesh_.vertices[f[2]];
+                    const Pvl::Vec3f w = closestPoint(p, a, b, c);
+                    const float distSqr = Pvl::normSqr(w[0] * a + w[1] * b + w[2] * c - p);
+                    if (distSqr < minDistSqr) {
+                        minDistSqr = distSqr;
+                        face = fi;
+                        bary = w;
+                    }
+                }
+            }
+        }
+        return minDistSqr < std::numeric_limits<float>::max();
+    }
+};
+
+/// Extracts the surface of the tile and transfers the attributes of the original mesh.
+void repairTile(const TexturedMesh& mesh,
+                const Tile& tile,
+                const openvdb::math::Transform& tr,
+                const float voxelSize,
+                const float bandWidth,
+                Patch& patch) {
+    TileAdapter adapter(mesh, tile.faces, tr);
+    openvdb::Int32Grid::Ptr indexGrid = openvdb::Int32Grid::create();
+    openvdb::FloatGrid::Ptr grid = openvdb::tools::meshToVolume<openvdb::FloatGrid>(
+        adapter, tr, bandWidth, bandWidth, 0, indexGrid.get());
+
+    std::vector<openvdb::Vec3s> points;
+    std::vector<openvdb::Vec3I> triangles;
+    std::vector<openvdb::Vec4I> quads;
+    openvdb::tools::volumeToMesh(*grid, points, triangles, quads);
+    grid.reset();
+
+    // keep faces in the core extended by a voxel; the overlapping faces of neighboring tiles are the same
+    // and get merged when welding the patches
+    const Pvl::Box3f keepBox = extended(tile.core, 1.f);
+    std::vector<int> remap(points.size(), -1);
+    auto addFace = [&](const uint32_t i0, const uint32_t i1, const uint32_t i2) {
+        Pvl::Vec3f centroid(0.f);
+        for (uint32_t i : { i0, i1, i2 }) {
+            centroid += Pvl::Vec3f(points[i].x(), points[i].y(), points[i].z());
+        }
+        centroid /= 3.f * voxelSize;
+        for (int j = 0; j < 3; ++j) {
+            if (centroid[j] < keepBox.lower()[j] || centroid[j] >= keepBox.upper()[j]) {
+                return;
+            }
+        }
+        TexturedMesh::Face face;
+        int k = 0;
+        for (uint32_t i : { i0, i1, i2 }) {
+            if (remap[i] == -1) {
+                remap[i] = int(patch.vertices.size());
+                patch.vertices.emplace_back(points[i].x(), points[i].y(), points[i].z());
+            }
+            face[k++] = uint32_t(remap[i]);
+        }
+        patch.faces.push_back(face);
+    };
+    for (const openvdb::Vec3I& f : triangles) {
+        addFace(f[0], f[2], f[1]);
+    }
+    for (const openvdb::Vec4I& f : quads) {
+        addFace(f[0], f[2], f[1]);
+        addFace(f[0], f[3], f[2]);
+    }
+
+    ClosestFace closest(mesh, tile, tr, *indexGrid);
+    const bool hasColors = !mesh.colors.empty();
+    const bool hasClasses = !mesh.classes.empty();
+    if (hasColors || hasClasses) {
+        patch.colors.resize(hasColors ? patch.vertices.size() : 0, Color(128, 128, 128));
+        patch.classes.resize(hasClasses ? patch.vertices.size() : 0, 0);
+        for (std::size_t vi = 0; vi < patch.vertices.size(); ++vi) {
+            uint32_t fi;
+            Pvl::Vec3f w;
+            if (!closest.find(patch.vertices[vi], fi, w)) {
+                continue;
+            }
+            const TexturedMesh::Face& f = mesh.faces[fi];
+            if (hasColors) {
+                Pvl::Vec3f color(0.f);
+                for (int i = 0; i < 3; ++i) {
+                    const Color& c = mesh.colors[f[i]];
+                    color += w[i] * Pvl::Vec3f(c[0], c[1], c[2]);
+                }
+                patch.colors[vi] =
+                    Color(uint8_t(color[0] + 0.5f), uint8_t(color[1] + 0.5f), uint8_t(color[2] + 0.5f));
+            }
+            if (hasClasses) {
+                patch.classes[vi] = mesh.classes[f[argMax(w)]];
+            }
+        }
+    }
+    if (!mesh.uv.empty()) {
+        // all corners are mapped by the face closest to the centroid, so the face stays in a single chart
+        patch.uv.resize(3 * patch.faces.size(), Pvl::Vec2f(0.f));
+        for (std::size_t fi = 0; fi < patch.faces.size(); ++fi) {
+            const TexturedMesh::Face& f = patch.faces[fi];
+            const Pvl::Vec3f centroid =
+                (patch.vertices[f[0]] + patch.vertices[f[1]] + patch.vertices[f[2]]) / 3.f;
+            uint32_t source;
+            Pvl::Vec3f w;
+            if (!closest.find(centroid, source, w)) {
+                continue;
+            }
+            const TexturedMesh::Face& sf = mesh.faces[source];
+            const TexturedMesh::Face& st = mesh.texIds[source];
+            for (int i = 0; i < 3; ++i) {
+                w = closestPoint(
+                    patch.vertices[f[i]], mesh.vertices[sf[0]], mesh.vertices[sf[1]], mesh.vertices[sf[2]]);
+                patch.uv[3 * fi + i] = w[0] * mesh.uv[st[0]] + w[1] * mesh.uv[st[1]] + w[2] * mesh.uv[st[2]];
+            }
+        }
+    }
+}
+
+/// Welds the vertices shared by the patches and removes the faces extracted by multiple tiles.
+void mergePatches(std::vector<Patch>& patches, const float voxelSize, TexturedMesh& repaired) {
+    std::vector<std::size_t> vertexOffsets(patches.size() + 1, 0);
+    for (std::size_t pi = 0; pi < patches.size(); ++pi) {
+        vertexOffsets[pi + 1] = vertexOffsets[pi] + patches[pi].vertices.size();
+    }
+    const std::size_t numVertices = vertexOffsets.back();
+
+    // neighboring tiles extract identical vertices in the overlap, found by sorting quantized positions
+    using Key = std::pair<std::array<int64_t, 3>, uint32_t>;
+    std::vector<Key> keys(numVertices);
+    tbb::parallel_for(std::size_t(0), patches.size(), [&](std::size_t pi) {
+        for (std::size_t vi = 0; vi < patches[pi].vertices.size(); ++vi) {
+            const Pvl::Vec3f& p = patches[pi].vertices[vi];
+            Key& key = keys[vertexOffsets[pi] + vi];
+            for (int i = 0; i < 3; ++i) {
+                key.first[i] = std::llround(double(p[i]) / voxelSize * 256.);
+            }
+            key.second = uint32_t(vertexOffsets[pi] + vi);
+        }
+    });
+    tbb::parallel_sort(keys.begin(), keys.end());
+
+    const bool hasColors = !patches.empty() && !patches.front().colors.empty();
+    const bool hasClasses = !patches.empty() && !patches.front().classes.empty();
+    const bool hasUv = !patches.empty() && !patches.front().uv.empty();
+    std::vector<uint32_t> remap(numVertices);
+    for (std::size_t i = 0; i < numVertices; ++i) {
+        if (i == 0 || keys[i].first != keys[i - 1].first) {
+            const uint32_t index = keys[i].second;
+            const std::size_t pi = std::upper_bound(vertexOffsets.begin(), vertexOffsets.end(), index) -
+                                   vertexOffsets.begin() - 1;
+            const Patch& patch = patches[pi];
+            const std::size_t vi = index - vertexOffsets[pi];
+            repaired.vertices.push_back(patch.vertices[vi]);
+            if (hasColors) {
+                repaired.colors.push_back(patch.colors[vi]);
+            }
+            if (hasClasses) {
+                repaired.classes.push_back(patch.classes[vi]);
+            }
+        }
+        remap[keys[i].second] = uint32_t(repaired.vertices.size() - 1);
+    }
+    keys = {};
+
+    std::vector<TexturedMesh::Face> faces;
+    std::vector<Pvl::Vec2f> uv;
+    for (std::size_t pi = 0; pi < patches.size(); ++pi) {
+        Patch& patch = patches[pi];
+        for (std::size_t fi = 0; fi < patch.faces.size(); ++fi) {
+            TexturedMesh::Face f;
+            for (int i = 0; i < 3; ++i) {
+                f[i] = remap[vertexOffsets[pi] + patch.faces[fi][i]];
+            }
+            if (f[0] == f[1] || f[1] == f[2] || f[0] == f[2]) {
+                continue;
+            }
+            faces.push_back(f);
+            if (hasUv) {
+                uv.insert(uv.end(), patch.uv.begin() + 3 * fi, patch.uv.begin() + 3 * fi + 3);
+            }
+        }
+        patch = {};
+    }
+
+    // faces in the overlap of tiles are duplicated
+    std::vector<std::pair<TexturedMesh::Face, uint32_t>> sorted(faces.size());
+    tbb::parallel_for(std::size_t(0), faces.size(), [&](std::size_t fi) {
+        TexturedMesh::Face f = faces[fi];
+        std::sort(f.begin(), f.end());
+        sorted[fi] = std::make_pair(f, uint32_t(fi));
+    });
+    tbb::parallel_sort(sorted.begin(), sorted.end());
+    std::vector<uint8_t> keep(faces.size(), 0);
+    for (std::size_t i = 0; i < sorted.size(); ++i) {
+        keep[sorted[i].second] = i == 0 || sorted[i].first != sorted[i - 1].first;
+    }
+    sorted = {};
+    for (std::size_t fi = 0; fi < faces.size(); ++fi) {
+        if (!keep[fi]) {
+            continue;
+        }
+        repaired.faces.push_back(faces[fi]);
+        if (hasUv) {
+            const uint32_t ti = uint32_t(repaired.uv.size());
+            repaired.texIds.push_back(TexturedMesh::Face{ ti, ti + 1, ti + 2 });
+            repaired.uv.insert(repaired.uv.end(), uv.begin() + 3 * fi, uv.begin() + 3 * fi + 3);
+        }
+    }
+}
+
+} // namespace
+
+bool repairMesh(TexturedMesh& mesh, const RepairSettings& settings, std::function<bool(float)> progress) {
+    initializeOpenVdb();
+
+    Pvl::Box3f box;
+    for (const Pvl::Vec3f& p : mesh.vertices) {
+        box.extend(p);
+    }
+    const float extent = std::max({ box.size()[0], box.size()[1], box.size()[2] });
+    const float voxelSize =
+        settings.voxelSize > 0.f ? settings.voxelSize : settings.relativeVoxelSize * extent;
+    openvdb::math::Transform::Ptr tr = openvdb::math::Transform::createLinearTransform(voxelSize);
+
+    // surfaces are extracted up to a voxel beyond the core, which needs the distances a voxel further
+    const float margin = settings.bandWidth + 3.f;
+    std::vector<float> areas(mesh.faces.size());
+    tbb::parallel_for(std::size_t(0), mesh.faces.size(), [&](std::size_t fi) {
+        areas[fi] = mesh.area(uint32_t(fi)) / (voxelSize * voxelSize);
+    });
+    Tile root;
+    Pvl::Vec3f lower, upper;
+    for (int i = 0; i < 3; ++i) {
+        lower[i] = std::floor(box.lower()[i] / voxelSize) - margin;
+        upper[i] = std::ceil(box.upper()[i] / voxelSize) + margin;
+    }
+    root.core = Pvl::Box3f(lower, upper);
+    root.faces.resize(mesh.faces.size());
+    std::iota(root.faces.begin(), root.faces.end(), 0);
+
+    // each thread holds the volumes of a single tile
+    const float memoryPerTile =
+        float(settings.memoryLimit) * 1024.f * 1024.f / tbb::this_task_arena::max_concurrency();
+    const float maxArea = memoryPerTile / (BYTES_PER_AREA * (1.f + 0.25f * settings.bandWidth));
+    std::vector<Tile> tiles;
+    tbb::mutex mutex;
+    splitTiles(mesh, areas, std::move(root), voxelSize, margin, maxArea, tiles, mutex);
+    areas = {};
+    std::cout << "Repairing mesh in " << tiles.size() << " tiles with voxel size " << voxelSize << std::endl;
+
+    std::vector<Patch> patches(tiles.size());
+    auto meter = Pvl::makeProgressMeter(tiles.size(), std::move(progress));
+    tbb::atomic<bool> cancelled = false;
+    tbb::parallel_for(tbb::blocked_range<std::size_t>(0, tiles.size(), 1),
+        [&](const tbb::blocked_range<std::size_t>& range) {
+            for (std::size_t ti = range.begin(); ti < range.end(); ++ti) {
+                if (cancelled) {
+                    return;
+                }
+                repairTile(mesh, tiles[ti], *tr, voxelSize, settings.bandWidth, patches[ti]);
+                tiles[ti].faces = {};
+                if (meter.inc()) {
+                    cancelled = true;
+                }
+            }
+        });
+    if (cancelled) {
+        return false;
+    }
+
+    TexturedMesh repaired;
+    mergePatches(patches, voxelSize, repaired);
+    repaired.srs = mesh.srs;
+    repaired.classToColor = std::move(mesh.classToColor);
+    if (!repaired.uv.empty()) {
+        repaired.texture = std::move(mesh.texture);
+        repaired.pyramid = std::move(mesh.pyramid);
+    }
+    mesh = std::move(repaired);
+    std::cout << "Repaired mesh has " << mesh.vertices.size() << " vertices and " << mesh.faces.size()
+              << " faces" << std::endl;
+    return true;
+}
+
+#else
+
+bool repairMesh(TexturedMesh&, const RepairSettings&, std::function<bool(float)>) {
+    throw std::runtime_error("MPCV not linked with OpenVDB, please recompile with WITH_OPENVDB=ON");
+}
+
+#endif
+
+} // namespace Mpcv
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "mesh.h"
+#include <functional>
+
+namespace Mpcv {
+
+struct RepairSettings {
+    ///< Size of a voxel in units of the mesh, zero to derive it from the mesh extent
+    float voxelSize = 0.f;
+
+    ///< Voxel size relative to the largest extent of the mesh, used if voxelSize is zero
+    float relativeVoxelSize = 1.f / 1500.f;
+
+    ///< Half-width of the narrow band of the distance field in voxels
+    float bandWidth = 1.f;
+
+    ///< Approximate memory used by the volumes of the tiles processed in parallel, in megabytes
+    std::size_t memoryLimit = 4096;
+};
+
+/// \brief Replaces the mesh by the zero iso-surface of its signed distance field.
+///
+/// This closes small holes and removes non-manifold parts and self-intersections. The bounding box of the
+/// mesh is split into tiles, so that the narrow-band volumes of the tiles processed in parallel fit into the
+/// memory limit. Tiles overlap by a few voxels and the extracted surfaces are welded together. Vertex colors,
+/// classes and texture coordinates are transferred from the closest triangles of the original mesh; the
+/// texture and the spatial reference system are kept.
+///
+/// \return False if cancelled by the progress callback; the mesh is not modified in that case.
+/// \throw std::runtime_error if not linked with OpenVDB.
+bool repairMesh(TexturedMesh& mesh, const RepairSettings& settings, std::function<bool(float)> progress);
+
+} // namespace Mpcv
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "pvl/Vector.hpp"
+#include <array>
+#include <stdint.h>
+
+namespace Mpcv {
+
+/// \brief Owen-scrambled Sobol sequence, see "Practical Hash-based Owen Scrambling" (Burley 2020).
+///
+/// Samples are indexed by the pixel, the sample number and the dimension, so the render is reproducible and
+/// independent of the thread scheduling. Each pair of dimensions uses the first two Sobol dimensions with a
+/// shuffled index ("padding"), which keeps the 2D stratification of consecutive samples in every pair.
+class Sampler {
+    uint32_t index_;
+    uint32_t seed_;
+    uint32_t dim_ = 0;
+
+public:
+    Sampler(const Pvl::Vec2i& pixel, const uint32_t index, const uint32_t seed = 0)
+        : index_(index)
+        , seed_(hashCombine(hash(seed), hashCombine(hash(pixel[0]), hash(pixel[1])))) {}
+
+    /// \brief Returns the sample in the next dimension.
+    float get1D() {
+        return get2D()[0];
+    }
+
+    /// \brief Returns the sample in the next two dimensions.
+    Pvl::Vec2f get2D() {
+        const uint32_t seed = hashCombine(seed_, hash(dim_++));
+        const uint32_t index = nestedUniformScramble(index_, seed);
+        const uint32_t x = nestedUniformScramble(sobol(index, 0), hashCombine(seed, 0));
+        const uint32_t y = nestedUniformScramble(sobol(index, 1), hashCombine(seed, 1));
+        return Pvl::Vec2f(toFloat(x), toFloat(y));
+    }
+
+private:
+    static uint32_t sobol(uint32_t index, const int dim) {
+        static const std::array<std::array<uint32_t, 32>, 2> directions = makeDirections();
+        uint32_t result = 0;
+        for (int bit = 0; index != 0; index >>= 1, ++bit) {
+            if (index & 1) {
+                result ^= directions[dim][bit];
+            }
+        }
+        return result;
+    }
+
+    static std::array<std::array<uint32_t, 32>, 2> makeDirections() {
+        std::array<std::array<uint32_t, 32>, 2> directions;
+        // the first dimension is the van der Corput sequence, the second one uses polynomial x + 1
+        uint32_t m = 1;
+        for (int k = 0; k < 32; ++k) {
+            directions[0][k] = 1u << (31 - k);
+            directions[1][k] = m << (31 - k);
+            m ^= m << 1;
+        }
+        return directions;
+    }
+
+    static uint32_t reverseBits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    static uint32_t laineKarrasPermutation(uint32_t x, const uint32_t seed) {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+
+    static uint32_t nestedUniformScramble(uint32_t x, const uint32_t seed) {
+        x = reverseBits(x);
+        x = laineKarrasPermutation(x, seed);
+        return reverseBits(x);
+    }
+
+    static uint32_t hash(uint32_t x) {
+        x ^= x >> 16;
+        x *= 0x21f0aaadu;
+        x ^= x >> 15;
+        x *= 0x735a2d97u;
+        x ^= x >> 15;
+        return x;
+    }
+
+    static uint32_t hashCombine(const uint32_t seed, const uint32_t v) {
+        return seed ^ (v + (seed << 6) + (seed >> 2));
+    }
+
+    static float toFloat(const uint32_t x) {
+        // keep only 24 bits so that the result is strictly less than 1
+        return float(x >> 8) * (1.f / float(1u << 24));
+    }
+};
+
+} // namespace Mpcv
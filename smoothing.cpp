@@ -0,0 +1,62 @@
+#include "smoothing.h"
+#include "pvl/Utils.hpp"
+#include <algorithm>
+#include <tbb/tbb.h>
+
+namespace Mpcv {
+
+bool smooth(TexturedMesh& mesh,
+            const MeshTopology& topology,
+            const SmoothingSettings& settings,
+            std::function<bool(float)> progress) {
+    const std::size_t numVertices = mesh.vertices.size();
+    PVL_ASSERT(topology.numVertices() == numVertices);
+
+    std::vector<uint8_t> allowed(256, settings.classes.empty());
+    for (uint8_t c : settings.classes) {
+        allowed[c] = 1;
+    }
+    const bool useClasses = !settings.classes.empty() && !mesh.classes.empty();
+    std::vector<uint8_t> movable(numVertices);
+    tbb::parallel_for(std::size_t(0), numVertices, [&](std::size_t vi) {
+        movable[vi] = !topology.boundary(uint32_t(vi)) && !topology.isolated(uint32_t(vi)) &&
+                      (!useClasses || allowed[mesh.classes[vi]]);
+    });
+
+    // double-buffered, each step reads the positions of the previous one
+    Column<Pvl::Vec3f> smoothed{ std::vector<Pvl::Vec3f>(numVertices) };
+    auto step = [&](const float weight) {
+        const Column<Pvl::Vec3f>& positions = mesh.vertices;
+        tbb::parallel_for(tbb::blocked_range<std::size_t>(0, numVertices),
+            [&](const tbb::blocked_range<std::size_t>& range) {
+                for (std::size_t vi = range.begin(); vi < range.end(); ++vi) {
+                    const Pvl::Vec3f& p = positions[vi];
+                    if (!movable[vi]) {
+                        smoothed[vi] = p;
+                        continue;
+                    }
+                    const IndexRange neighs = topology.neighbors(uint32_t(vi));
+                    Pvl::Vec3f sum(0.f);
+                    for (uint32_t ni : neighs) {
+                        sum += positions[ni];
+                    }
+                    smoothed[vi] = p + weight * (sum / float(neighs.size()) - p);
+                }
+            });
+        std::swap(mesh.vertices, smoothed);
+    };
+
+    auto meter = Pvl::makeProgressMeter(std::max(settings.iterations, 1), std::move(progress));
+    for (int iter = 0; iter < settings.iterations; ++iter) {
+        step(settings.lambda);
+        if (settings.mu != 0.f) {
+            step(settings.mu);
+        }
+        if (meter.inc()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace Mpcv
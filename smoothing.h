@@ -0,0 +1,36 @@
+#pragma once
+
+#include "topology.h"
+#include <functional>
+#include <vector>
+
+namespace Mpcv {
+
+struct SmoothingSettings {
+    ///< Number of iterations; with Taubin smoothing, each iteration does a shrinking and an inflating step
+    int iterations = 1;
+
+    ///< Weight of the shrinking step, in (0, 1]
+    float lambda = 0.5f;
+
+    ///< Weight of the inflating step, negative with |mu| > lambda; zero for plain Laplacian smoothing
+    float mu = -0.53f;
+
+    ///< If not empty, only vertices of these classes are moved
+    std::vector<uint8_t> classes;
+};
+
+/// \brief Smooths the mesh by moving each vertex towards the centroid of its neighbors.
+///
+/// Iterations are Jacobi steps computed in parallel over the given topology. Alternating positive and
+/// negative weights (Taubin 1995) removes the noise without shrinking the mesh. Boundary vertices, isolated
+/// vertices and vertices of other than the selected classes keep their positions; faces and attributes are
+/// not modified.
+///
+/// \return False if cancelled by the progress callback; the mesh holds the result of the done iterations.
+bool smooth(TexturedMesh& mesh,
+            const MeshTopology& topology,
+            const SmoothingSettings& settings,
+            std::function<bool(float)> progress);
+
+} // namespace Mpcv
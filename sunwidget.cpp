@@ -30,6 +30,8 @@ void SunWidget::on_pushButton_clicked() {
     settings.resolution = Pvl::Vec2i(widthSpin->value(), heightSpin->value());
     settings.numIters = itersSpin->value();
     settings.denoise = checkBox->checkState() == Qt::Checked;
+    QCheckBox* adaptiveBox = findChild<QCheckBox*>("adaptiveBox");
+    settings.adaptive = adaptiveBox->checkState() == Qt::Checked;
 
     QDoubleSpinBox* latitudeSpin = findChild<QDoubleSpinBox*>("latitude");
     QDoubleSpinBox* longitudeSpin = findChild<QDoubleSpinBox*>("longitude");
@@ -2,6 +2,8 @@
 #include "parameters.h"
 #include <QFileInfo>
 #include <QImageReader>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 #ifdef HAS_JPEG
@@ -16,43 +18,56 @@
 namespace Mpcv {
 
 #ifdef HAS_JPEG
-JpegTexture::JpegTexture(const std::string& filename) {
+JpegTexture::JpegTexture(const std::string& filename, const float scale) {
     FILE* file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        throw std::runtime_error("Error reading JPEG image '" + filename + "'");
+    }
 
     jpeg_error_mgr err;
     jpeg_decompress_struct info;
     info.err = jpeg_std_error(&err);
     jpeg_create_decompress(&info);
 
-    if (!file) {
-        throw std::runtime_error("Error reading JPEG image '" + filename + "'");
-    }
-
     jpeg_stdio_src(&info, file);
     jpeg_read_header(&info, TRUE);
 
+    if (scale < 1.f) {
+        // DCT scaling, only the coefficients needed for the smaller image are decoded
+        info.scale_num = std::max(1, std::min(8, int(std::ceil(scale * 8.f))));
+        info.scale_denom = 8;
+    }
+
     jpeg_start_decompress(&info);
 
     width_ = info.output_width;
     height_ = info.output_height;
-    channels_ = info.num_components;
+    channels_ = info.output_components;
 
-    std::cout << "Loading JPEG image of size " << width_ << "x" << height_ << std::endl;
+    std::cout << "Loading JPEG image of size " << info.image_width << "x" << info.image_height << " as "
+              << width_ << "x" << height_ << std::endl;
 
     data_ = (uint8_t*)malloc(width_ * height_ * channels_);
-    uint8_t* rowptr[1];
+    if (!data_) {
+        jpeg_destroy_decompress(&info);
+        fclose(file);
+        throw std::runtime_error("Cannot allocate memory for JPEG image '" + filename + "'");
+    }
+
+    // the decoder produces several rows at once, read them in batches directly into the image
+    constexpr int BATCH_SIZE = 16;
+    uint8_t* rowptr[BATCH_SIZE];
     while (info.output_scanline < info.output_height) {
-        rowptr[0] = (uint8_t*)data_ + channels_ * info.output_width * info.output_scanline;
-        jpeg_read_scanlines(&info, rowptr, 1);
+        const int count = std::min<int>(BATCH_SIZE, info.output_height - info.output_scanline);
+        for (int i = 0; i < count; ++i) {
+            rowptr[i] = data_ + channels_ * width_ * (info.output_scanline + i);
+        }
+        jpeg_read_scanlines(&info, rowptr, count);
     }
 
     jpeg_finish_decompress(&info);
     jpeg_destroy_decompress(&info);
     fclose(file);
-
-    std::cout << "row = " << int(data_[0]) << "," << int(data_[1]) << "," << int(data_[2]) << ","
-              << int(data_[3]) << "," << int(data_[4]) << "," << int(data_[5]) << "," << int(data_[6])
-              << std::endl;
 }
 
 JpegTexture::~JpegTexture() {
@@ -64,35 +79,177 @@ Pvl::Vec2i JpegTexture::size() const {
 }
 
 ImageFormat JpegTexture::format() const {
-    return channels_ == 4 ? ImageFormat::RGBA : ImageFormat::RGB;
+    switch (channels_) {
+    case 1:
+        return ImageFormat::GRAY;
+    case 4:
+        return ImageFormat::RGBA;
+    default:
+        return ImageFormat::RGB;
+    }
 }
 
 uint8_t* JpegTexture::data() {
     return data_;
 }
 
+std::size_t JpegTexture::bytesPerLine() const {
+    return width_ * channels_;
+}
+
 #endif
 
 #ifdef HAS_PNG
 
-PngTexture::PngTexture(const std::string& filename) {
-    png_image image;
-    memset(&image, 0, sizeof(image));
-    image.version = PNG_IMAGE_VERSION;
+namespace {
 
-    if (!png_image_begin_read_from_file(&image, filename.c_str())) {
-        throw std::runtime_error("Failed to read PNG file '" + filename + "'");
+/// \brief State of the PNG decoder, released by the caller also after errors reported by libpng.
+struct PngReader {
+    FILE* file = nullptr;
+    png_structp png = nullptr;
+    png_infop info = nullptr;
+
+    ///< Decoded image
+    uint8_t* data = nullptr;
+    std::size_t width = 0;
+    std::size_t height = 0;
+
+    ///< Buffers used by the downscaled decoding
+    uint8_t* row = nullptr;
+    uint32_t* sums = nullptr;
+    uint8_t* full = nullptr;
+    png_bytep* rows = nullptr;
+};
+
+/// \brief Adds texels of the row to the sums of the boxes of factor x factor texels.
+void accumulateRow(const uint8_t* row, const std::size_t width, const int factor, uint32_t* sums) {
+    for (std::size_t x = 0; x < width; ++x) {
+        uint32_t* sum = sums + (x / factor) * 3;
+        sum[0] += row[3 * x];
+        sum[1] += row[3 * x + 1];
+        sum[2] += row[3 * x + 2];
+    }
+}
+
+/// \brief Writes averages of the boxes to the output row and resets the sums.
+void finishRow(uint32_t* sums,
+               const std::size_t width,
+               const int factor,
+               const int numRows,
+               uint8_t* output) {
+    const std::size_t outputWidth = (width + factor - 1) / factor;
+    for (std::size_t x = 0; x < outputWidth; ++x) {
+        const uint32_t count = uint32_t(std::min<std::size_t>(factor, width - x * factor) * numRows);
+        for (int c = 0; c < 3; ++c) {
+            output[3 * x + c] = uint8_t((sums[3 * x + c] + count / 2) / count);
+            sums[3 * x + c] = 0;
+        }
     }
+}
+
+/// \brief Decodes the image to RGB, downscaled by given factor.
+///
+/// Errors of libpng jump back to this function, so it only uses state stored in the reader.
+bool decodePng(PngReader& r, const int factor) {
+    if (setjmp(png_jmpbuf(r.png))) {
+        return false;
+    }
+    png_init_io(r.png, r.file);
+    png_read_info(r.png, r.info);
+    png_set_expand(r.png);
+    png_set_strip_16(r.png);
+    png_set_strip_alpha(r.png);
+    png_set_gray_to_rgb(r.png);
+    const int passes = png_set_interlace_handling(r.png);
+    png_read_update_info(r.png, r.info);
+
+    const std::size_t width = png_get_image_width(r.png, r.info);
+    const std::size_t height = png_get_image_height(r.png, r.info);
+    r.width = (width + factor - 1) / factor;
+    r.height = (height + factor - 1) / factor;
+    r.data = (uint8_t*)malloc(r.width * r.height * 3);
+    if (!r.data) {
+        return false;
+    }
+    const std::size_t rowBytes = width * 3;
+    auto reduceRow = [&r, width, height, factor](const uint8_t* row, const std::size_t y) {
+        accumulateRow(row, width, factor, r.sums);
+        if ((y + 1) % factor == 0 || y + 1 == height) {
+            uint8_t* output = r.data + (y / factor) * r.width * 3;
+            finishRow(r.sums, width, factor, int(y % factor) + 1, output);
+        }
+    };
+
+    if (factor == 1 || passes > 1) {
+        // interlaced rows are only complete after the last pass, the full image must be decoded first
+        uint8_t* target = r.data;
+        if (factor > 1) {
+            r.full = (uint8_t*)malloc(rowBytes * height);
+            target = r.full;
+        }
+        r.rows = (png_bytep*)malloc(height * sizeof(png_bytep));
+        if (!target || !r.rows) {
+            return false;
+        }
+        for (std::size_t y = 0; y < height; ++y) {
+            r.rows[y] = target + y * rowBytes;
+        }
+        png_read_image(r.png, r.rows);
+        if (factor > 1) {
+            r.sums = (uint32_t*)calloc(r.width * 3, sizeof(uint32_t));
+            if (!r.sums) {
+                return false;
+            }
+            for (std::size_t y = 0; y < height; ++y) {
+                reduceRow(r.rows[y], y);
+            }
+        }
+    } else {
+        r.row = (uint8_t*)malloc(rowBytes);
+        r.sums = (uint32_t*)calloc(r.width * 3, sizeof(uint32_t));
+        if (!r.row || !r.sums) {
+            return false;
+        }
+        for (std::size_t y = 0; y < height; ++y) {
+            png_read_row(r.png, r.row, nullptr);
+            reduceRow(r.row, y);
+        }
+    }
+    png_read_end(r.png, nullptr);
+    return true;
+}
+
+} // namespace
 
-    image.format = PNG_FORMAT_RGB;
-    data_ = (uint8_t*)malloc(PNG_IMAGE_SIZE(image));
+PngTexture::PngTexture(const std::string& filename, const float scale) {
+    const int factor = scale < 1.f ? std::max(1, int(std::lround(1.f / scale))) : 1;
 
-    if (!png_image_finish_read(&image, nullptr, data_, 0, nullptr)) {
+    PngReader reader;
+    reader.file = fopen(filename.c_str(), "rb");
+    if (!reader.file) {
         throw std::runtime_error("Failed to read PNG file '" + filename + "'");
     }
-    width_ = image.width;
-    height_ = image.height;
-    channels_ = PNG_IMAGE_SAMPLE_CHANNELS(image.format);
+    reader.png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (reader.png) {
+        reader.info = png_create_info_struct(reader.png);
+    }
+    const bool success = reader.info && decodePng(reader, factor);
+
+    png_destroy_read_struct(&reader.png, &reader.info, nullptr);
+    fclose(reader.file);
+    free(reader.row);
+    free(reader.sums);
+    free(reader.full);
+    free(reader.rows);
+    if (!success) {
+        free(reader.data);
+        throw std::runtime_error("Failed to read PNG file '" + filename + "'");
+    }
+    data_ = reader.data;
+    width_ = reader.width;
+    height_ = reader.height;
+    channels_ = 3;
+    std::cout << "Loaded PNG image as " << width_ << "x" << height_ << std::endl;
 }
 
 PngTexture::~PngTexture() {
@@ -104,13 +261,17 @@ Pvl::Vec2i PngTexture::size() const {
 }
 
 ImageFormat PngTexture::format() const {
-    return channels_ == 4 ? ImageFormat::RGBA : ImageFormat::RGB;
+    return ImageFormat::RGB;
 }
 
 uint8_t* PngTexture::data() {
     return data_;
 }
 
+std::size_t PngTexture::bytesPerLine() const {
+    return width_ * channels_;
+}
+
 #endif
 
 std::unique_ptr<ITexture> makeTexture(const QString& filename) {
@@ -119,33 +280,35 @@ std::unique_ptr<ITexture> makeTexture(const QString& filename) {
     }
     QString ext = QFileInfo(filename).suffix();
     QImageReader reader(filename);
-    QSize size = reader.size();
+    const QSize sourceSize = reader.size();
+    QSize size = sourceSize;
     float scale = Mpcv::Parameters::global().textureScale;
     if (scale < 1.f) {
         size *= scale;
         reader.setScaledSize(size);
     }
 
+    // Qt decodes the full image before scaling it, the native readers downscale while decoding
     const int maxQtSize = (1 << 15) - 1;
-    if (size.width() <= maxQtSize && size.height() <= maxQtSize) {
-        std::cout << "Loading image '" + filename.toStdString() + "' using Qt reader" << std::endl;
-        return std::make_unique<QtTexture>(reader.read());
-    } else
+    const bool largeSource = sourceSize.width() > maxQtSize || sourceSize.height() > maxQtSize;
+    const bool useNative = largeSource || scale < 1.f;
 #ifdef HAS_JPEG
-        if (ext == "jpg" || ext == "jpeg") {
+    if (useNative && (ext == "jpg" || ext == "jpeg")) {
         std::cout << "Loading image '" + filename.toStdString() + "' using libjpeg reader" << std::endl;
-        return std::make_unique<JpegTexture>(filename.toStdString());
-    } else
+        return std::make_unique<JpegTexture>(filename.toStdString(), scale);
+    }
 #endif
 #ifdef HAS_PNG
-        if (ext == "png") {
+    if (useNative && ext == "png") {
         std::cout << "Loading image '" + filename.toStdString() + "' using libpng reader" << std::endl;
-        return std::make_unique<PngTexture>(filename.toStdString());
-    } else
+        return std::make_unique<PngTexture>(filename.toStdString(), scale);
+    }
 #endif
-    {
-        throw std::runtime_error("Cannot read texture '" + filename.toStdString() + "', image too large");
+    if (size.width() <= maxQtSize && size.height() <= maxQtSize) {
+        std::cout << "Loading image '" + filename.toStdString() + "' using Qt reader" << std::endl;
+        return std::make_unique<QtTexture>(reader.read());
     }
+    throw std::runtime_error("Cannot read texture '" + filename.toStdString() + "', image too large");
 }
 
 } // namespace Mpcv
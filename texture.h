@@ -1,5 +1,6 @@
 #pragma once
 
+#include "column.h"
 #include "pvl/Vector.hpp"
 #include <QImage>
 #include <cstdint>
@@ -24,6 +25,9 @@ public:
     virtual ImageFormat format() const = 0;
 
     virtual uint8_t* data() = 0;
+
+    /// \brief Number of bytes between consecutive rows of pixels.
+    virtual std::size_t bytesPerLine() const = 0;
 };
 
 class QtTexture : public ITexture {
@@ -57,6 +61,10 @@ public:
     virtual uint8_t* data() override {
         return image_.bits();
     }
+
+    virtual std::size_t bytesPerLine() const override {
+        return image_.bytesPerLine();
+    }
 };
 
 #ifdef HAS_JPEG
@@ -67,7 +75,10 @@ class JpegTexture : public ITexture {
     std::size_t channels_;
 
 public:
-    JpegTexture(const std::string& filename);
+    /// \brief Decodes the image, downscaled by DCT scaling if scale is less than one.
+    ///
+    /// Only scales M/8 are supported, the image is decoded at the nearest scale not smaller than requested.
+    JpegTexture(const std::string& filename, float scale = 1.f);
 
     ~JpegTexture();
 
@@ -76,6 +87,8 @@ public:
     virtual ImageFormat format() const override;
 
     virtual uint8_t* data() override;
+
+    virtual std::size_t bytesPerLine() const override;
 };
 
 #endif
@@ -88,7 +101,10 @@ class PngTexture : public ITexture {
     std::size_t channels_;
 
 public:
-    PngTexture(const std::string& filename);
+    /// \brief Decodes the image to RGB, downscaled by integer factor if scale is less than one.
+    ///
+    /// Non-interlaced images are reduced row by row while decoding, so the full-size image is never stored.
+    PngTexture(const std::string& filename, float scale = 1.f);
 
     ~PngTexture();
 
@@ -97,10 +113,50 @@ public:
     virtual ImageFormat format() const override;
 
     virtual uint8_t* data() override;
+
+    virtual std::size_t bytesPerLine() const override;
 };
 
 #endif
 
+/// \brief Texture with pixels stored in a column, used for textures mapped from the mesh cache.
+class ColumnTexture : public ITexture {
+    Column<uint8_t> data_;
+    Pvl::Vec2i size_;
+    ImageFormat format_;
+    std::size_t bytesPerLine_;
+
+public:
+    ColumnTexture(Column<uint8_t>&& data,
+                  const Pvl::Vec2i& size,
+                  const ImageFormat format,
+                  const std::size_t bytesPerLine)
+        : data_(std::move(data))
+        , size_(size)
+        , format_(format)
+        , bytesPerLine_(bytesPerLine) {
+        if (data_.size() < bytesPerLine_ * size_[1]) {
+            throw std::runtime_error("Invalid texture data");
+        }
+    }
+
+    virtual Pvl::Vec2i size() const override {
+        return size_;
+    }
+
+    virtual ImageFormat format() const override {
+        return format_;
+    }
+
+    virtual uint8_t* data() override {
+        return data_.data();
+    }
+
+    virtual std::size_t bytesPerLine() const override {
+        return bytesPerLine_;
+    }
+};
+
 std::unique_ptr<ITexture> makeTexture(const QString& filename);
 
 } // namespace Mpcv
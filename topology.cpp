@@ -0,0 +1,129 @@
+#include "topology.h"
+#include <algorithm>
+#include <tbb/tbb.h>
+
+namespace Mpcv {
+
+MeshTopology::MeshTopology(const TexturedMesh& mesh) {
+    const std::size_t numVertices = mesh.vertices.size();
+    const std::size_t numFaces = mesh.faces.size();
+    PVL_ASSERT(3 * numFaces < std::numeric_limits<uint32_t>::max());
+
+    // vertex-to-face, counting sort of face corners by vertices
+    faceOffsets_.assign(numVertices + 1, 0);
+    for (const TexturedMesh::Face& f : mesh.faces) {
+        for (int i = 0; i < 3; ++i) {
+            faceOffsets_[f[i] + 1]++;
+        }
+    }
+    for (std::size_t vi = 0; vi < numVertices; ++vi) {
+        faceOffsets_[vi + 1] += faceOffsets_[vi];
+    }
+    faces_.resize(3 * numFaces);
+    std::vector<uint32_t> fill(faceOffsets_.begin(), faceOffsets_.end() - 1);
+    for (std::size_t fi = 0; fi < numFaces; ++fi) {
+        for (int i = 0; i < 3; ++i) {
+            faces_[fill[mesh.faces[fi][i]]++] = uint32_t(fi);
+        }
+    }
+    fill = {};
+
+    // vertex-to-vertex, gathered from the incident faces; an edge shared by a single face is on the boundary
+    boundary_.resize(numVertices);
+    auto gather = [&](const std::size_t vi, std::vector<uint32_t>& adjacent) {
+        adjacent.clear();
+        for (uint32_t k = faceOffsets_[vi]; k < faceOffsets_[vi + 1]; ++k) {
+            const TexturedMesh::Face& f = mesh.faces[faces_[k]];
+            for (int i = 0; i < 3; ++i) {
+                if (f[i] != vi) {
+                    adjacent.push_back(f[i]);
+                }
+            }
+        }
+        std::sort(adjacent.begin(), adjacent.end());
+        bool isBoundary = false;
+        std::size_t unique = 0;
+        for (std::size_t i = 0; i < adjacent.size();) {
+            std::size_t j = i + 1;
+            while (j < adjacent.size() && adjacent[j] == adjacent[i]) {
+                ++j;
+            }
+            isBoundary |= (j - i) == 1;
+            adjacent[unique++] = adjacent[i];
+            i = j;
+        }
+        adjacent.resize(unique);
+        return isBoundary;
+    };
+
+    using Range = tbb::blocked_range<std::size_t>;
+    neighborOffsets_.assign(numVertices + 1, 0);
+    tbb::parallel_for(Range(0, numVertices), [&](const Range& r) {
+        std::vector<uint32_t> adjacent;
+        for (std::size_t vi = r.begin(); vi < r.end(); ++vi) {
+            boundary_[vi] = gather(vi, adjacent);
+            neighborOffsets_[vi + 1] = uint32_t(adjacent.size());
+        }
+    });
+    for (std::size_t vi = 0; vi < numVertices; ++vi) {
+        neighborOffsets_[vi + 1] += neighborOffsets_[vi];
+    }
+    neighbors_.resize(neighborOffsets_.back());
+    tbb::parallel_for(Range(0, numVertices), [&](const Range& r) {
+        std::vector<uint32_t> adjacent;
+        for (std::size_t vi = r.begin(); vi < r.end(); ++vi) {
+            gather(vi, adjacent);
+            std::copy(adjacent.begin(), adjacent.end(), neighbors_.begin() + neighborOffsets_[vi]);
+        }
+    });
+}
+
+namespace {
+
+template <typename T>
+void remapAttribute(Column<T>& values, const std::vector<uint32_t>& newToOld) {
+    if (values.empty()) {
+        return;
+    }
+    std::vector<T> remapped(newToOld.size());
+    for (std::size_t i = 0; i < newToOld.size(); ++i) {
+        remapped[i] = values[newToOld[i]];
+    }
+    values = std::move(remapped);
+}
+
+} // namespace
+
+void removeUnreferencedVertices(TexturedMesh& mesh) {
+    constexpr uint32_t UNREFERENCED = uint32_t(-1);
+    std::vector<uint32_t> oldToNew(mesh.vertices.size(), UNREFERENCED);
+    for (const TexturedMesh::Face& f : mesh.faces) {
+        for (int i = 0; i < 3; ++i) {
+            oldToNew[f[i]] = 0;
+        }
+    }
+    // keeps the original order of vertices
+    std::vector<uint32_t> newToOld;
+    for (std::size_t vi = 0; vi < oldToNew.size(); ++vi) {
+        if (oldToNew[vi] != UNREFERENCED) {
+            oldToNew[vi] = uint32_t(newToOld.size());
+            newToOld.push_back(uint32_t(vi));
+        }
+    }
+    if (newToOld.size() == mesh.vertices.size()) {
+        return;
+    }
+    for (TexturedMesh::Face& f : mesh.faces) {
+        for (int i = 0; i < 3; ++i) {
+            f[i] = oldToNew[f[i]];
+        }
+    }
+    remapAttribute(mesh.vertices, newToOld);
+    remapAttribute(mesh.normals, newToOld);
+    remapAttribute(mesh.colors, newToOld);
+    remapAttribute(mesh.times, newToOld);
+    remapAttribute(mesh.ao, newToOld);
+    remapAttribute(mesh.classes, newToOld);
+}
+
+} // namespace Mpcv
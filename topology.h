@@ -0,0 +1,82 @@
+#pragma once
+
+#include "mesh.h"
+#include <cstdint>
+#include <vector>
+
+namespace Mpcv {
+
+/// \brief Contiguous range of indices stored in a CSR array.
+struct IndexRange {
+    const uint32_t* first;
+    const uint32_t* last;
+
+    const uint32_t* begin() const {
+        return first;
+    }
+
+    const uint32_t* end() const {
+        return last;
+    }
+
+    std::size_t size() const {
+        return last - first;
+    }
+
+    bool empty() const {
+        return first == last;
+    }
+};
+
+/// \brief Connectivity of a triangle mesh, stored in compressed sparse row arrays.
+///
+/// The topology references the faces of \ref TexturedMesh by their indices and does not copy the vertices
+/// nor any attributes, so operations can modify the mesh in place. It is only valid while the faces of the mesh
+/// do not change; modifying vertex positions or attributes does not invalidate it.
+class MeshTopology {
+    ///< Vertex-to-vertex adjacency, neighbors of vertex vi are neighbors_[neighborOffsets_[vi]...]
+    std::vector<uint32_t> neighborOffsets_;
+    std::vector<uint32_t> neighbors_;
+
+    ///< Vertex-to-face adjacency, faces incident to vertex vi are faces_[faceOffsets_[vi]...]
+    std::vector<uint32_t> faceOffsets_;
+    std::vector<uint32_t> faces_;
+
+    ///< Vertices with an edge that is used by a single face
+    std::vector<uint8_t> boundary_;
+
+public:
+    /// \brief Builds the connectivity in parallel.
+    explicit MeshTopology(const TexturedMesh& mesh);
+
+    std::size_t numVertices() const {
+        return boundary_.size();
+    }
+
+    /// \brief Returns the vertices sharing an edge with given vertex, sorted by their indices.
+    IndexRange neighbors(const uint32_t vi) const {
+        const uint32_t* data = neighbors_.data();
+        return IndexRange{ data + neighborOffsets_[vi], data + neighborOffsets_[vi + 1] };
+    }
+
+    /// \brief Returns the faces incident to given vertex.
+    IndexRange faces(const uint32_t vi) const {
+        const uint32_t* data = faces_.data();
+        return IndexRange{ data + faceOffsets_[vi], data + faceOffsets_[vi + 1] };
+    }
+
+    /// \brief Returns true if the vertex lies on the boundary (or on a non-manifold edge used by a single face).
+    bool boundary(const uint32_t vi) const {
+        return boundary_[vi] != 0;
+    }
+
+    /// \brief Returns true if the vertex is not referenced by any face.
+    bool isolated(const uint32_t vi) const {
+        return faceOffsets_[vi] == faceOffsets_[vi + 1];
+    }
+};
+
+/// \brief Removes vertices not referenced by any face, together with their per-vertex attributes.
+void removeUnreferencedVertices(TexturedMesh& mesh);
+
+} // namespace Mpcv
@@ -0,0 +1,368 @@
+#include "virtualtexture.h"
+#include "lod.h"
+#include "pvl/Box.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <tbb/tbb.h>
+
+namespace Mpcv {
+
+namespace {
+
+constexpr char PYRAMID_MAGIC[4] = { 'M', 'P', 'V', 'T' };
+constexpr uint32_t PYRAMID_VERSION = 1;
+
+///< Tiles start at page boundaries, so that each tile is paged in separately
+constexpr std::size_t PYRAMID_ALIGNMENT = 4096;
+
+struct PyramidHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tileSize;
+    uint32_t border;
+    uint32_t keySize;
+    uint32_t padding;
+};
+
+std::size_t alignUp(const std::size_t offset) {
+    return (offset + PYRAMID_ALIGNMENT - 1) / PYRAMID_ALIGNMENT * PYRAMID_ALIGNMENT;
+}
+
+std::size_t tileStride() {
+    return alignUp(std::size_t(TexturePyramid::PADDED_SIZE) * TexturePyramid::PADDED_SIZE * 3);
+}
+
+/// \brief Source texels of a level; the finest level is read from the texture, coarser levels are packed RGB.
+struct LevelImage {
+    const uint8_t* data;
+    std::size_t bytesPerLine;
+    ImageFormat format;
+    Pvl::Vec2i size;
+
+    /// \brief Reads the texel, coordinates outside of the image are clamped to the edge.
+    void texel(int x, int y, uint8_t* rgb) const {
+        x = std::min(std::max(x, 0), size[0] - 1);
+        y = std::min(std::max(y, 0), size[1] - 1);
+        const uint8_t* row = data + y * bytesPerLine;
+        switch (format) {
+        case ImageFormat::GRAY:
+            rgb[0] = rgb[1] = rgb[2] = row[x];
+            break;
+        case ImageFormat::RGB:
+            std::copy(row + 3 * x, row + 3 * x + 3, rgb);
+            break;
+        case ImageFormat::BGR:
+            rgb[0] = row[3 * x + 2];
+            rgb[1] = row[3 * x + 1];
+            rgb[2] = row[3 * x];
+            break;
+        case ImageFormat::RGBA:
+            std::copy(row + 4 * x, row + 4 * x + 3, rgb);
+            break;
+        case ImageFormat::BGRA:
+            rgb[0] = row[4 * x + 2];
+            rgb[1] = row[4 * x + 1];
+            rgb[2] = row[4 * x];
+            break;
+        }
+    }
+};
+
+/// \brief Halves the resolution of the image using a box filter.
+std::vector<uint8_t> downsample(const LevelImage& image, const Pvl::Vec2i& size) {
+    std::vector<uint8_t> result(std::size_t(size[0]) * size[1] * 3);
+    tbb::parallel_for(0, size[1], [&](const int y) {
+        uint8_t texels[4][3];
+        for (int x = 0; x < size[0]; ++x) {
+            image.texel(2 * x, 2 * y, texels[0]);
+            image.texel(2 * x + 1, 2 * y, texels[1]);
+            image.texel(2 * x, 2 * y + 1, texels[2]);
+            image.texel(2 * x + 1, 2 * y + 1, texels[3]);
+            uint8_t* dst = &result[(std::size_t(y) * size[0] + x) * 3];
+            for (int c = 0; c < 3; ++c) {
+                dst[c] = uint8_t((texels[0][c] + texels[1][c] + texels[2][c] + texels[3][c] + 2) / 4);
+            }
+        }
+    });
+    return result;
+}
+
+} // namespace
+
+TexturePyramid::TexturePyramid(const Pvl::Vec2i& size)
+    : size_(size) {
+    levelOffsets_.push_back(0);
+    for (int level = 0;; ++level) {
+        const Pvl::Vec2i levelSize = this->size(level);
+        const Pvl::Vec2i count(
+            (levelSize[0] + TILE_SIZE - 1) / TILE_SIZE, (levelSize[1] + TILE_SIZE - 1) / TILE_SIZE);
+        tileCounts_.push_back(count);
+        levelOffsets_.push_back(levelOffsets_.back() + count[0] * count[1]);
+        if (count[0] == 1 && count[1] == 1) {
+            break;
+        }
+    }
+}
+
+Pvl::Vec2i TexturePyramid::size(const int level) const {
+    return Pvl::Vec2i(
+        std::max(((size_[0] - 1) >> level) + 1, 1), std::max(((size_[1] - 1) >> level) + 1, 1));
+}
+
+int TexturePyramid::tileLevel(const uint32_t tile) const {
+    auto iter = std::upper_bound(levelOffsets_.begin(), levelOffsets_.end(), tile);
+    return int(iter - levelOffsets_.begin()) - 1;
+}
+
+Pvl::Vec2i TexturePyramid::tileCoords(const uint32_t tile) const {
+    const int level = tileLevel(tile);
+    const uint32_t local = tile - levelOffsets_[level];
+    return Pvl::Vec2i(local % tileCounts_[level][0], local / tileCounts_[level][0]);
+}
+
+uint32_t TexturePyramid::ancestor(const uint32_t tile, const int level) const {
+    const int tileLevel = this->tileLevel(tile);
+    if (level <= tileLevel) {
+        return tile;
+    }
+    const Pvl::Vec2i coords = tileCoords(tile);
+    const int shift = level - tileLevel;
+    return tileIndex(level, coords[0] >> shift, coords[1] >> shift);
+}
+
+const uint8_t* TexturePyramid::tileData(const uint32_t tile) const {
+    return file_->data() + dataOffset_ + tile * tileStride();
+}
+
+std::unique_ptr<TexturePyramid> TexturePyramid::build(ITexture& texture,
+                                                      const std::string& file,
+                                                      const std::string& key,
+                                                      std::function<bool(float)> progress) {
+    std::unique_ptr<TexturePyramid> pyramid(new TexturePyramid(texture.size()));
+    std::cout << "Building texture pyramid with " << pyramid->levels() << " levels and "
+              << pyramid->numTiles() << " tiles" << std::endl;
+
+    PyramidHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::copy(PYRAMID_MAGIC, PYRAMID_MAGIC + 4, header.magic);
+    header.version = PYRAMID_VERSION;
+    header.width = pyramid->size_[0];
+    header.height = pyramid->size_[1];
+    header.tileSize = TILE_SIZE;
+    header.border = BORDER;
+    header.keySize = uint32_t(key.size());
+    pyramid->dataOffset_ = alignUp(sizeof(header) + key.size());
+
+    // written to a temporary file and renamed, so that the file can be overwritten while it is mapped
+    const std::string tempFile = file + ".tmp";
+    std::ofstream out;
+    out.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+    out.open(tempFile, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(key.data(), key.size());
+    const std::vector<char> padding(std::max(pyramid->dataOffset_, tileStride()), 0);
+    out.write(padding.data(), pyramid->dataOffset_ - out.tellp());
+
+    const std::size_t tileBytes = std::size_t(PADDED_SIZE) * PADDED_SIZE * 3;
+    std::vector<uint8_t> tile(tileBytes);
+    LevelImage image{ texture.data(), texture.bytesPerLine(), texture.format(), texture.size() };
+    std::vector<uint8_t> levelData;
+    std::size_t written = 0;
+    for (int level = 0; level < pyramid->levels(); ++level) {
+        if (level > 0) {
+            // the previous level is released only after the next one is computed from it
+            std::vector<uint8_t> data = downsample(image, pyramid->size(level));
+            levelData = std::move(data);
+            image = LevelImage{ levelData.data(), std::size_t(pyramid->size(level)[0]) * 3, ImageFormat::RGB,
+                pyramid->size(level) };
+        }
+        const Pvl::Vec2i count = pyramid->tileCount(level);
+        for (int ty = 0; ty < count[1]; ++ty) {
+            for (int tx = 0; tx < count[0]; ++tx) {
+                const int x0 = tx * TILE_SIZE - BORDER;
+                const int y0 = ty * TILE_SIZE - BORDER;
+                tbb::parallel_for(0, int(PADDED_SIZE), [&](const int y) {
+                    uint8_t* row = &tile[std::size_t(y) * PADDED_SIZE * 3];
+                    for (int x = 0; x < PADDED_SIZE; ++x) {
+                        image.texel(x0 + x, y0 + y, row + 3 * x);
+                    }
+                });
+                out.write(reinterpret_cast<const char*>(tile.data()), tileBytes);
+                out.write(padding.data(), tileStride() - tileBytes);
+                ++written;
+                if (progress(100.f * written / pyramid->numTiles())) {
+                    out.close();
+                    std::remove(tempFile.c_str());
+                    return nullptr;
+                }
+            }
+        }
+    }
+    out.close();
+    if (std::rename(tempFile.c_str(), file.c_str()) != 0) {
+        throw std::runtime_error("Cannot write file '" + file + "'");
+    }
+    pyramid->file_ = std::make_shared<MappedFile>(file);
+    return pyramid;
+}
+
+std::unique_ptr<TexturePyramid> TexturePyramid::load(const std::string& file, const std::string& key) {
+    std::shared_ptr<MappedFile> mapping;
+    try {
+        mapping = std::make_shared<MappedFile>(file);
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+    PyramidHeader header;
+    if (mapping->size() < sizeof(header)) {
+        return nullptr;
+    }
+    std::memcpy(&header, mapping->data(), sizeof(header));
+    if (!std::equal(PYRAMID_MAGIC, PYRAMID_MAGIC + 4, header.magic) || header.version != PYRAMID_VERSION ||
+        header.tileSize != TILE_SIZE || header.border != BORDER || header.width == 0 || header.height == 0 ||
+        mapping->size() < sizeof(header) + header.keySize) {
+        return nullptr;
+    }
+    const char* storedKey = reinterpret_cast<const char*>(mapping->data() + sizeof(header));
+    if (std::string(storedKey, header.keySize) != key) {
+        return nullptr;
+    }
+    std::unique_ptr<TexturePyramid> pyramid(new TexturePyramid(Pvl::Vec2i(header.width, header.height)));
+    pyramid->dataOffset_ = alignUp(sizeof(header) + header.keySize);
+    if (mapping->size() < pyramid->dataOffset_ + pyramid->numTiles() * tileStride()) {
+        return nullptr;
+    }
+    pyramid->file_ = std::move(mapping);
+    return pyramid;
+}
+
+void assignTiles(const TexturePyramid& pyramid,
+                 TexturedMesh& mesh,
+                 LodHierarchy* lod,
+                 std::vector<TextureRun>& runs,
+                 std::vector<TextureNode>& nodes) {
+    const std::size_t numMeshFaces = mesh.faces.size();
+    const std::size_t numFaces = numMeshFaces + (lod ? lod->faces.size() : 0);
+    auto face = [&](const std::size_t fi) -> TexturedMesh::Face& {
+        return fi < numMeshFaces ? mesh.faces[fi] : lod->faces[fi - numMeshFaces];
+    };
+    auto texIds = [&](const std::size_t fi) -> TexturedMesh::Face& {
+        return fi < numMeshFaces ? mesh.texIds[fi] : lod->texIds[fi - numMeshFaces];
+    };
+    const Pvl::Vec2f size(pyramid.size()[0], pyramid.size()[1]);
+    auto texel = [&](const uint32_t ti) {
+        const Pvl::Vec2f& uv = mesh.uv[ti];
+        // rows of the tiles start at the top of the image
+        return Pvl::Vec2f(uv[0] * size[0], (1.f - uv[1]) * size[1]);
+    };
+
+    // finest tile containing the texture coordinates of the face, including the border
+    std::vector<uint32_t> tiles(numFaces);
+    tbb::parallel_for(std::size_t(0), numFaces, [&](const std::size_t fi) {
+        const TexturedMesh::Face& t = texIds(fi);
+        const Pvl::Vec2f p0 = texel(t[0]), p1 = texel(t[1]), p2 = texel(t[2]);
+        const Pvl::Vec2f lower = Pvl::min(p0, Pvl::min(p1, p2));
+        const Pvl::Vec2f upper = Pvl::max(p0, Pvl::max(p1, p2));
+        const Pvl::Vec2f centroid = (p0 + p1 + p2) / 3.f;
+        const int coarsest = pyramid.levels() - 1;
+        tiles[fi] = pyramid.tileIndex(coarsest, 0, 0);
+        const int tileSize = TexturePyramid::TILE_SIZE;
+        // keep one texel for bilinear filtering
+        const float margin = TexturePyramid::BORDER - 1;
+        for (int level = 0; level < coarsest; ++level) {
+            const float scale = 1.f / (1 << level);
+            const Pvl::Vec2i count = pyramid.tileCount(level);
+            const int tx = std::min(std::max(int(centroid[0] * scale) / tileSize, 0), count[0] - 1);
+            const int ty = std::min(std::max(int(centroid[1] * scale) / tileSize, 0), count[1] - 1);
+            if (lower[0] * scale >= tx * tileSize - margin && lower[1] * scale >= ty * tileSize - margin &&
+                upper[0] * scale <= (tx + 1) * tileSize + margin &&
+                upper[1] * scale <= (ty + 1) * tileSize + margin) {
+                tiles[fi] = pyramid.tileIndex(level, tx, ty);
+                break;
+            }
+        }
+    });
+
+    // sort faces by tiles within ranges that must stay contiguous
+    std::vector<FaceRange> ranges;
+    if (lod) {
+        for (const LodCluster& cluster : lod->clusters) {
+            ranges.push_back(cluster.faces);
+        }
+    } else {
+        ranges.push_back(FaceRange{ 0, uint32_t(numFaces) });
+    }
+    tbb::parallel_for(std::size_t(0), ranges.size(), [&](const std::size_t ri) {
+        const FaceRange& range = ranges[ri];
+        std::vector<uint32_t> order(range.count);
+        std::iota(order.begin(), order.end(), range.first);
+        std::stable_sort(
+            order.begin(), order.end(), [&tiles](uint32_t i, uint32_t j) { return tiles[i] < tiles[j]; });
+        std::vector<TexturedMesh::Face> sortedFaces(range.count), sortedTexIds(range.count);
+        std::vector<uint32_t> sortedTiles(range.count);
+        for (uint32_t i = 0; i < range.count; ++i) {
+            sortedFaces[i] = face(order[i]);
+            sortedTexIds[i] = texIds(order[i]);
+            sortedTiles[i] = tiles[order[i]];
+        }
+        for (uint32_t i = 0; i < range.count; ++i) {
+            face(range.first + i) = sortedFaces[i];
+            texIds(range.first + i) = sortedTexIds[i];
+            tiles[range.first + i] = sortedTiles[i];
+        }
+    });
+
+    runs.clear();
+    nodes.clear();
+    std::vector<uint32_t> tileToNode(pyramid.numTiles(), uint32_t(-1));
+    std::vector<Pvl::Box3f> boxes;
+    std::vector<double> areas, texelAreas;
+    for (std::size_t fi = 0; fi < numFaces; ++fi) {
+        const uint32_t tile = tiles[fi];
+        if (tileToNode[tile] == uint32_t(-1)) {
+            tileToNode[tile] = uint32_t(nodes.size());
+            nodes.push_back(TextureNode{ tile, Pvl::Vec3f(0.f), 0.f, 0.f });
+            boxes.emplace_back();
+            areas.push_back(0.);
+            texelAreas.push_back(0.);
+        }
+        const uint32_t node = tileToNode[tile];
+        if (!runs.empty() && runs.back().node == node && runs.back().first + runs.back().count == fi) {
+            ++runs.back().count;
+        } else {
+            runs.push_back(TextureRun{ uint32_t(fi), 1, node });
+        }
+
+        const TexturedMesh::Face& f = face(fi);
+        const TexturedMesh::Face& t = texIds(fi);
+        const Pvl::Vec3f& p0 = mesh.vertices[f[0]];
+        const Pvl::Vec3f& p1 = mesh.vertices[f[1]];
+        const Pvl::Vec3f& p2 = mesh.vertices[f[2]];
+        boxes[node].extend(p0);
+        boxes[node].extend(p1);
+        boxes[node].extend(p2);
+        areas[node] += 0.5 * Pvl::norm(Pvl::crossProd(p1 - p0, p2 - p0));
+        const Pvl::Vec2f e1 = texel(t[1]) - texel(t[0]);
+        const Pvl::Vec2f e2 = texel(t[2]) - texel(t[0]);
+        texelAreas[node] += 0.5 * std::abs(e1[0] * e2[1] - e1[1] * e2[0]);
+    }
+    for (std::size_t ni = 0; ni < nodes.size(); ++ni) {
+        TextureNode& node = nodes[ni];
+        node.center = boxes[ni].center();
+        node.radius = 0.5f * Pvl::norm(boxes[ni].size());
+        if (texelAreas[ni] > 0.) {
+            node.texelSize = float(std::sqrt(areas[ni] / texelAreas[ni]));
+        } else {
+            // degenerate texture coordinates, use the size of the tile as a rough estimate
+            node.texelSize = 2.f * node.radius / TexturePyramid::TILE_SIZE;
+        }
+    }
+}
+
+} // namespace Mpcv
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "mesh.h"
+#include <functional>
+#include <memory>
+
+namespace Mpcv {
+
+class LodHierarchy;
+
+/// \brief Mip pyramid of a texture split into square tiles, stored in a memory-mapped file.
+///
+/// Each tile holds TILE_SIZE texels of its level plus a border of BORDER texels copied from the neighboring
+/// tiles, so that faces slightly overlapping the tile can be drawn with the tile alone. Every level halves
+/// the resolution of the previous one; the coarsest level is a single tile. Tiles are stored as packed RGB
+/// and paged in from the file only when uploaded.
+class TexturePyramid {
+public:
+    static constexpr int TILE_SIZE = 1024;
+    static constexpr int BORDER = 32;
+
+    ///< Size of the stored tiles in texels, including the borders
+    static constexpr int PADDED_SIZE = TILE_SIZE + 2 * BORDER;
+
+private:
+    std::shared_ptr<MappedFile> file_;
+    Pvl::Vec2i size_;
+    std::vector<Pvl::Vec2i> tileCounts_;
+    std::vector<uint32_t> levelOffsets_;
+    std::size_t dataOffset_;
+
+public:
+    /// \brief Splits the texture into tiles and saves the pyramid to given file.
+    ///
+    /// \param key Arbitrary string identifying the source texture, see \ref load.
+    /// \return Null pointer if cancelled by the progress callback.
+    static std::unique_ptr<TexturePyramid> build(ITexture& texture,
+                                                 const std::string& file,
+                                                 const std::string& key,
+                                                 std::function<bool(float)> progress);
+
+    /// \brief Maps a pyramid saved by \ref build.
+    ///
+    /// \return Null pointer if the file does not exist, is not valid or was built with a different key.
+    static std::unique_ptr<TexturePyramid> load(const std::string& file, const std::string& key);
+
+    /// \brief Size of the finest level in texels.
+    Pvl::Vec2i size() const {
+        return size_;
+    }
+
+    int levels() const {
+        return int(tileCounts_.size());
+    }
+
+    /// \brief Size of given level in texels.
+    Pvl::Vec2i size(const int level) const;
+
+    Pvl::Vec2i tileCount(const int level) const {
+        return tileCounts_[level];
+    }
+
+    std::size_t numTiles() const {
+        return levelOffsets_.back();
+    }
+
+    uint32_t tileIndex(const int level, const int x, const int y) const {
+        return levelOffsets_[level] + y * tileCounts_[level][0] + x;
+    }
+
+    int tileLevel(const uint32_t tile) const;
+
+    /// \brief Returns the column and row of the tile in its level.
+    Pvl::Vec2i tileCoords(const uint32_t tile) const;
+
+    /// \brief Returns the tile of a coarser level covering given tile.
+    uint32_t ancestor(const uint32_t tile, const int level) const;
+
+    /// \brief Returns the RGB texels of the tile, PADDED_SIZE rows of PADDED_SIZE texels.
+    const uint8_t* tileData(const uint32_t tile) const;
+
+private:
+    TexturePyramid(const Pvl::Vec2i& size);
+};
+
+/// \brief Faces drawn with the same tile.
+struct TextureRun {
+    ///< Range of drawn faces, see \ref LodHierarchy::face
+    uint32_t first;
+    uint32_t count;
+
+    ///< Index into the nodes
+    uint32_t node;
+};
+
+/// \brief Faces of the mesh assigned to a tile.
+struct TextureNode {
+    ///< Finest tile containing all the faces
+    uint32_t tile;
+
+    ///< Bounding sphere of the faces in local coordinates of the mesh
+    Pvl::Vec3f center;
+    float radius;
+
+    ///< Average size of a texel of the finest level in units of the mesh
+    float texelSize;
+};
+
+/// \brief Assigns faces to the finest tiles containing their texture coordinates.
+///
+/// Faces are sorted by their tiles, so that each tile is drawn by few contiguous runs. Faces of the LOD
+/// hierarchy are only sorted within their clusters, keeping the cluster ranges valid.
+void assignTiles(const TexturePyramid& pyramid,
+                 TexturedMesh& mesh,
+                 LodHierarchy* lod,
+                 std::vector<TextureRun>& runs,
+                 std::vector<TextureNode>& nodes);
+
+} // namespace Mpcv